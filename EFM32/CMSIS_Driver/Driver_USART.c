@@ -24,6 +24,12 @@
  *
  * - Implemented non-blocking mode for Send, Receive functions
  * - Implemented ARM_USART_GetModemStatus function
+ * - Implemented ARM_USART_ABORT_RECEIVE control
+ * - Signals ARM_USART_EVENT_SEND_COMPLETE and ARM_USART_EVENT_TX_COMPLETE
+ * - Implemented ARM_USART_CONTROL_RS485 control: DePin drives the DE/RE line of
+ *   an RS-485 transceiver, set by Send and cleared on the TXC interrupt of the
+ *   last character, before the application is signaled. Only LEUART0 has DePin
+ *   wired, see LEUART0_DE_PIN
  *
  * TODO: Implement transfer function
  * TODO: Implement the use of DMA for Send, Receive and Transfer functions.
@@ -40,6 +46,23 @@
 #include "em_leuart.h"
 #include "em_dma.h"
 
+/* Driver specific control: RS-485 transceiver driver enable (DE/RE), arg 1 enables it and 0 disables it */
+#ifndef ARM_USART_CONTROL_RS485
+#define ARM_USART_CONTROL_RS485 (0x80UL << ARM_USART_CONTROL_Pos)
+#endif
+
+/* EFM32_PIN.pin value of a pin not wired */
+#define EFM32_PIN_NONE (0xFFU)
+
+/* RS-485 DE/RE pin of LEUART0, PD6 (EXP-16 on the starter kit) by default. Define
+ * LEUART0_DE_PIN as EFM32_PIN_NONE if the board does not wire it */
+#ifndef LEUART0_DE_PORT
+#define LEUART0_DE_PORT gpioPortD
+#endif
+#ifndef LEUART0_DE_PIN
+#define LEUART0_DE_PIN 6
+#endif
+
 #define ARM_USART_DRV_VERSION    ARM_DRIVER_VERSION_MAJOR_MINOR(1, 0)   /* driver version */
 
 /* Driver Version */
@@ -70,10 +93,12 @@ typedef struct {
     uint32_t LOCATION;
     EFM32_PIN TxPin;
     EFM32_PIN RxPin;
+    EFM32_PIN DePin;            /* RS-485 DE/RE pin, EFM32_PIN_NONE if not wired */
     USART_TRANSFER_INFO xfer;
     ARM_USART_STATUS status;
     ARM_USART_MODEM_STATUS modem_status;
     ARM_USART_SignalEvent_t cb_event;
+    bool rs485;                 /* DePin driven by the driver */
 } EFM32_USART_RESOURCES;
 
 /* Driver Capabilities */
@@ -89,7 +114,7 @@ static EFM32_USART_RESOURCES USART0_Resources = {
      0,                         /* Smart Card Clock generator available */
      0,                         /* RTS Flow Control available */
      0,                         /* CTS Flow Control available */
-     0,                         /* Transmit completed event: \ref ARM_USART_EVENT_TX_COMPLETE */
+     1,                         /* Transmit completed event: \ref ARM_USART_EVENT_TX_COMPLETE */
      0,                         /* Signal receive character timeout event: \ref ARM_USART_EVENT_RX_TIMEOUT */
      0,                         /* RTS Line: 0=not available, 1=available */
      0,                         /* CTS Line: 0=not available, 1=available */
@@ -109,6 +134,7 @@ static EFM32_USART_RESOURCES USART0_Resources = {
     USART_ROUTE_LOCATION_LOC1,  /* Location */
     {gpioPortD, 0},
     {gpioPortD, 1},
+    {gpioPortA, EFM32_PIN_NONE}, /* DE Pin */
     {
      NULL, NULL,
      0, 0, 0, 0,
@@ -116,6 +142,7 @@ static EFM32_USART_RESOURCES USART0_Resources = {
     {0},
     {0},
     NULL,
+    false,
 };
 #endif
 
@@ -131,7 +158,7 @@ static EFM32_USART_RESOURCES USART1_Resources = {
      0,                         /* Smart Card Clock generator available */
      0,                         /* RTS Flow Control available */
      0,                         /* CTS Flow Control available */
-     0,                         /* Transmit completed event: \ref ARM_USART_EVENT_TX_COMPLETE */
+     1,                         /* Transmit completed event: \ref ARM_USART_EVENT_TX_COMPLETE */
      0,                         /* Signal receive character timeout event: \ref ARM_USART_EVENT_RX_TIMEOUT */
      0,                         /* RTS Line: 0=not available, 1=available */
      0,                         /* CTS Line: 0=not available, 1=available */
@@ -151,6 +178,7 @@ static EFM32_USART_RESOURCES USART1_Resources = {
     USART_ROUTE_LOCATION_LOC1,  /* Location */
     {gpioPortD, 0},
     {gpioPortD, 1},
+    {gpioPortA, EFM32_PIN_NONE}, /* DE Pin */
     {
      NULL, NULL,
      0, 0, 0, 0,
@@ -158,6 +186,7 @@ static EFM32_USART_RESOURCES USART1_Resources = {
     {0},
     {0},
     NULL,
+    false,
 };
 #endif
 #ifdef USART2
@@ -172,7 +201,7 @@ static EFM32_USART_RESOURCES USART2_Resources = {
      0,                         /* Smart Card Clock generator available */
      0,                         /* RTS Flow Control available */
      0,                         /* CTS Flow Control available */
-     0,                         /* Transmit completed event: \ref ARM_USART_EVENT_TX_COMPLETE */
+     1,                         /* Transmit completed event: \ref ARM_USART_EVENT_TX_COMPLETE */
      0,                         /* Signal receive character timeout event: \ref ARM_USART_EVENT_RX_TIMEOUT */
      0,                         /* RTS Line: 0=not available, 1=available */
      0,                         /* CTS Line: 0=not available, 1=available */
@@ -192,6 +221,7 @@ static EFM32_USART_RESOURCES USART2_Resources = {
     USART_ROUTE_LOCATION_LOC1,  /* Location */
     {gpioPortD, 0},
     {gpioPortD, 1},
+    {gpioPortA, EFM32_PIN_NONE}, /* DE Pin */
     {
      NULL, NULL,
      0, 0, 0, 0,
@@ -199,6 +229,7 @@ static EFM32_USART_RESOURCES USART2_Resources = {
     {0},
     {0},
     NULL,
+    false,
 };
 #endif
 #ifdef USART3
@@ -213,7 +244,7 @@ static EFM32_USART_RESOURCES USART3_Resources = {
      0,                         /* Smart Card Clock generator available */
      0,                         /* RTS Flow Control available */
      0,                         /* CTS Flow Control available */
-     0,                         /* Transmit completed event: \ref ARM_USART_EVENT_TX_COMPLETE */
+     1,                         /* Transmit completed event: \ref ARM_USART_EVENT_TX_COMPLETE */
      0,                         /* Signal receive character timeout event: \ref ARM_USART_EVENT_RX_TIMEOUT */
      0,                         /* RTS Line: 0=not available, 1=available */
      0,                         /* CTS Line: 0=not available, 1=available */
@@ -233,6 +264,7 @@ static EFM32_USART_RESOURCES USART3_Resources = {
     USART_ROUTE_LOCATION_LOC1,  /* Location */
     {gpioPortD, 0},
     {gpioPortD, 1},
+    {gpioPortA, EFM32_PIN_NONE}, /* DE Pin */
     {
      NULL, NULL,
      0, 0, 0, 0,
@@ -240,6 +272,7 @@ static EFM32_USART_RESOURCES USART3_Resources = {
     {0},
     {0},
     NULL,
+    false,
 };
 #endif
 
@@ -255,7 +288,7 @@ static EFM32_USART_RESOURCES LEUART0_Resources = {
      0,                         /* Smart Card Clock generator available */
      0,                         /* RTS Flow Control available */
      0,                         /* CTS Flow Control available */
-     0,                         /* Transmit completed event: \ref ARM_USART_EVENT_TX_COMPLETE */
+     1,                         /* Transmit completed event: \ref ARM_USART_EVENT_TX_COMPLETE */
      0,                         /* Signal receive character timeout event: \ref ARM_USART_EVENT_RX_TIMEOUT */
      0,                         /* RTS Line: 0=not available, 1=available */
      0,                         /* CTS Line: 0=not available, 1=available */
@@ -275,6 +308,7 @@ static EFM32_USART_RESOURCES LEUART0_Resources = {
     LEUART_ROUTE_LOCATION_LOC0, /* Location */
     {gpioPortD, 4},             // Tx
     {gpioPortD, 5},             // Rx
+    {LEUART0_DE_PORT, LEUART0_DE_PIN}, /* DE Pin */
     {
      NULL, NULL,
      0, 0, 0, 0,
@@ -282,6 +316,7 @@ static EFM32_USART_RESOURCES LEUART0_Resources = {
     {0},
     {0},
     NULL,
+    false,
 };
 #endif
 #ifdef LEUART1
@@ -296,7 +331,7 @@ static EFM32_USART_RESOURCES LEUART1_Resources = {
      0,                         /* Smart Card Clock generator available */
      0,                         /* RTS Flow Control available */
      0,                         /* CTS Flow Control available */
-     0,                         /* Transmit completed event: \ref ARM_USART_EVENT_TX_COMPLETE */
+     1,                         /* Transmit completed event: \ref ARM_USART_EVENT_TX_COMPLETE */
      0,                         /* Signal receive character timeout event: \ref ARM_USART_EVENT_RX_TIMEOUT */
      0,                         /* RTS Line: 0=not available, 1=available */
      0,                         /* CTS Line: 0=not available, 1=available */
@@ -316,6 +351,7 @@ static EFM32_USART_RESOURCES LEUART1_Resources = {
     LEUART_ROUTE_LOCATION_LOC0, /* Location */
     {gpioPortD, 4},             // Tx
     {gpioPortD, 5},             // Rx
+    {gpioPortA, EFM32_PIN_NONE}, /* DE Pin */
     {
      NULL, NULL,
      0, 0, 0, 0,
@@ -323,10 +359,35 @@ static EFM32_USART_RESOURCES LEUART1_Resources = {
     {0},
     {0},
     NULL,
+    false,
 };
 #endif
 
 // EFM32 functions
+
+/**
+ * Enables or disables the RS-485 transceiver driver enable line (DePin, active high).
+ * @param enable 1 to drive DePin, 0 to release it
+ * @param usart USART or LEUART resources
+ * @return ARM_DRIVER_OK or ARM_DRIVER_ERROR_UNSUPPORTED if DePin is not wired
+ */
+static int32_t EFM32_RS485_Control(uint32_t enable, EFM32_USART_RESOURCES * usart)
+{
+    if (usart->DePin.pin == EFM32_PIN_NONE) {
+        return ARM_DRIVER_ERROR_UNSUPPORTED;
+    }
+
+    if (enable != 0) {
+        GPIO_PinModeSet(usart->DePin.port, usart->DePin.pin, gpioModePushPull, 0);
+        usart->rs485 = true;
+    } else {
+        usart->rs485 = false;
+        GPIO_PinModeSet(usart->DePin.port, usart->DePin.pin, gpioModeDisabled, 0);
+    }
+
+    return ARM_DRIVER_OK;
+}
+
 static int32_t EFM32_USART_Initialize(ARM_USART_SignalEvent_t cb_event, EFM32_USART_RESOURCES * usart)
 {
     CMU_ClockEnable(cmuClock_GPIO, true);
@@ -451,6 +512,7 @@ static int32_t EFM32_USART_Uninitialize(EFM32_USART_RESOURCES * usart)
 
     GPIO_PinModeSet(usart->TxPin.port, usart->TxPin.pin, gpioModeDisabled, 1);  /* TX Pin */
     GPIO_PinModeSet(usart->RxPin.port, usart->RxPin.pin, gpioModeDisabled, 1);  /* RX Pin */
+    EFM32_RS485_Control(0, usart);
 
     usart->cb_event = NULL;
 
@@ -474,6 +536,7 @@ static int32_t EFM32_LEUART_Uninitialize(EFM32_USART_RESOURCES * usart)
 
     GPIO_PinModeSet(usart->TxPin.port, usart->TxPin.pin, gpioModeDisabled, 1);  /* TX Pin */
     GPIO_PinModeSet(usart->RxPin.port, usart->RxPin.pin, gpioModeDisabled, 1);  /* RX Pin */
+    EFM32_RS485_Control(0, usart);
 
     usart->cb_event = NULL;
 
@@ -542,6 +605,10 @@ static int32_t EFM32_USART_Send(const void *data, uint32_t num, EFM32_USART_RESO
     usart->xfer.TxBuf = (void *)data;
     usart->xfer.TxNum = num;
     usart->xfer.TxCnt = 0;
+    usart->status.tx_busy = true;
+    if (usart->rs485) {
+        GPIO_PinOutSet(usart->DePin.port, usart->DePin.pin);
+    }
     USART_Tx(usart->device, *aux);      // This will trigger the TX Done IRQ
 
     return ARM_DRIVER_OK;
@@ -562,6 +629,10 @@ static int32_t EFM32_LEUART_Send(const void *data, uint32_t num, EFM32_USART_RES
     usart->xfer.TxBuf = (void *)data;
     usart->xfer.TxNum = num;
     usart->xfer.TxCnt = 0;
+    usart->status.tx_busy = true;
+    if (usart->rs485) {
+        GPIO_PinOutSet(usart->DePin.port, usart->DePin.pin);
+    }
     LEUART_Tx(usart->device, *aux++);
 
     return ARM_DRIVER_OK;
@@ -742,6 +813,14 @@ static int32_t EFM32_USART_Control(uint32_t control, uint32_t arg, EFM32_USART_R
 
         return ARM_DRIVER_OK;
 
+    case ARM_USART_ABORT_RECEIVE:
+        USART_IntDisable(usart->device, USART_IEN_RXDATAV);
+        usart->status.rx_busy = false;
+        return ARM_DRIVER_OK;
+
+    case ARM_USART_CONTROL_RS485:
+        return EFM32_RS485_Control(arg, usart);
+
     case ARM_USART_MODE_ASYNCHRONOUS:
         usart->usart_cfg.baudrate = arg;
         break;
@@ -752,8 +831,10 @@ static int32_t EFM32_USART_Control(uint32_t control, uint32_t arg, EFM32_USART_R
     switch (control & ARM_USART_DATA_BITS_Msk) {
     case ARM_USART_DATA_BITS_5:
     case ARM_USART_DATA_BITS_6:
-    case ARM_USART_DATA_BITS_7:
         return ARM_DRIVER_ERROR_PARAMETER;
+    case ARM_USART_DATA_BITS_7:
+        usart->usart_cfg.databits = usartDatabits7;
+        break;
     case ARM_USART_DATA_BITS_8:
         usart->usart_cfg.databits = usartDatabits8;
         break;
@@ -835,7 +916,7 @@ static int32_t EFM32_USART_Control(uint32_t control, uint32_t arg, EFM32_USART_R
     return ARM_DRIVER_OK;
 }
 
-static int32_t EFM32_LEUART_Control(uint32_t control, uint32_t arg, EFM32_USART_RESOURCES const *usart)
+static int32_t EFM32_LEUART_Control(uint32_t control, uint32_t arg, EFM32_USART_RESOURCES * usart)
 {
     LEUART_Init_TypeDef leuart_cfg = LEUART_INIT_DEFAULT;
 
@@ -881,6 +962,14 @@ static int32_t EFM32_LEUART_Control(uint32_t control, uint32_t arg, EFM32_USART_
 
         return ARM_DRIVER_OK;
 
+    case ARM_USART_ABORT_RECEIVE:
+        LEUART_IntDisable(usart->device, LEUART_IEN_RXDATAV);
+        usart->status.rx_busy = false;
+        return ARM_DRIVER_OK;
+
+    case ARM_USART_CONTROL_RS485:
+        return EFM32_RS485_Control(arg, usart);
+
     case ARM_USART_MODE_ASYNCHRONOUS:
         leuart_cfg.baudrate = arg;
         break;
@@ -982,6 +1071,7 @@ static ARM_USART_MODEM_STATUS EFM32_LEUART_GetModemStatus(EFM32_USART_RESOURCES
 void USART_TX_IRQHandler(EFM32_USART_RESOURCES * usart)
 {
     uint32_t flags;
+    uint32_t event = 0;
 
     flags = USART_IntGet(usart->device);
     USART_IntClear(usart->device, flags);
@@ -992,8 +1082,19 @@ void USART_TX_IRQHandler(EFM32_USART_RESOURCES * usart)
         if (usart->xfer.TxCnt < usart->xfer.TxNum) {
             char *aux = (char *)usart->xfer.TxBuf;
             USART_Tx(usart->device, aux[usart->xfer.TxCnt]);
+        } else if ((usart->xfer.TxCnt == usart->xfer.TxNum) && (usart->status.tx_busy == true)) {
+            /* TXC: last character completely shifted out, release the bus right away */
+            if (usart->rs485) {
+                GPIO_PinOutClear(usart->DePin.port, usart->DePin.pin);
+            }
+            event = ARM_USART_EVENT_SEND_COMPLETE | ARM_USART_EVENT_TX_COMPLETE;
+            usart->status.tx_busy = false;
         }
     }
+
+    if ((event != 0) && (usart->cb_event != NULL)) {
+        usart->cb_event(event);
+    }
 }
 
 void USART_RX_IRQHandler(EFM32_USART_RESOURCES * usart)
@@ -1027,6 +1128,7 @@ void USART_RX_IRQHandler(EFM32_USART_RESOURCES * usart)
 void LEUART_TX_IRQHandler(EFM32_USART_RESOURCES * usart)
 {
     uint32_t flags;
+    uint32_t event = 0;
 
     flags = LEUART_IntGet(usart->device);
     LEUART_IntClear(usart->device, flags);
@@ -1037,8 +1139,19 @@ void LEUART_TX_IRQHandler(EFM32_USART_RESOURCES * usart)
         if (usart->xfer.TxCnt < usart->xfer.TxNum) {
             char *aux = (char *)usart->xfer.TxBuf;
             LEUART_Tx(usart->device, aux[usart->xfer.TxCnt]);
+        } else if ((usart->xfer.TxCnt == usart->xfer.TxNum) && (usart->status.tx_busy == true)) {
+            /* TXC: last character completely shifted out, release the bus right away */
+            if (usart->rs485) {
+                GPIO_PinOutClear(usart->DePin.port, usart->DePin.pin);
+            }
+            event = ARM_USART_EVENT_SEND_COMPLETE | ARM_USART_EVENT_TX_COMPLETE;
+            usart->status.tx_busy = false;
         }
     }
+
+    if ((event != 0) && (usart->cb_event != NULL)) {
+        usart->cb_event(event);
+    }
 }
 
 void LEUART_RX_IRQHandler(EFM32_USART_RESOURCES * usart)
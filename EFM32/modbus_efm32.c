@@ -21,17 +21,80 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 #include "em_device.h"
 #include "em_chip.h"
 #include "em_cmu.h"
 #include "bsp.h"
 #include "bsp_trace.h"
 
+#include "Driver_I2C.h"
 #include "modbus_client.h"
 
 extern ARM_DRIVER_USART Driver_LEUART0;
+extern ARM_DRIVER_I2C Driver_I2C0;
 
-uint16_t my_registers[50];
+#define NUM_REGISTERS (50)
+#define NUM_COILS (64)
+
+uint16_t my_registers[NUM_REGISTERS];
+uint32_t my_coils[(NUM_COILS + 31) / 32];
+
+/* LSM9DS1 accelerometer registers, the sensor is on I2C0 (PD7, PD6) as in CMSIS_Driver_Test_I2C.c */
+#define LSM9DS1_ADDR (0xD6)
+#define LSM9DS1_CTRL_REG6_XL (0x20)
+#define LSM9DS1_ODR_XL_119HZ (0x60)
+#define LSM9DS1_OUT_X_XL (0x28)
+
+#define ACCEL_PERIOD_MS (10)
+
+/* Events of a transfer that did not complete */
+#define I2C_ERROR_EVENTS (ARM_I2C_EVENT_ADDRESS_NACK | ARM_I2C_EVENT_BUS_ERROR | ARM_I2C_EVENT_ARBITRATION_LOST \
+                          | ARM_I2C_EVENT_TRANSFER_INCOMPLETE)
+
+typedef enum {
+    ACCEL_RESTARTING,           /* A transfer failed, the sensor is configured again in the next period */
+    ACCEL_CONFIGURING,
+    ACCEL_IDLE,
+    ACCEL_ADDRESSING,
+    ACCEL_READING,
+} ACCEL_STATE;
+
+/* Raw LSM9DS1 accelerometer readings (OUT_X_XL, OUT_Y_XL, OUT_Z_XL), served as
+ * input registers. The sensor sends them little endian, so the I2C read of 6 bytes
+ * from register 0x28 is received as is into accel_buf. accel_poll() copies it here
+ * once the transfer is done, so a failed read never shows and the client, polled
+ * from the same loop, never sees a half written sample */
+uint16_t accel_samples[3];
+
+static uint16_t accel_buf[3];
+static uint8_t accel_cmd[2];
+static volatile uint32_t i2c_events;    /* Events of the last transfer, 0 while it runs */
+static ACCEL_STATE accel_state;
+static uint32_t accel_ticks;
+
+/* Firmware version (major, minor), read only */
+uint16_t fw_version[2] = { 1, 0 };
+
+/* Uptime in ms (high word, low word), published by SysTick as a whole so both
+ * halves always come from the same tick */
+uint16_t uptime_copies[2][2];
+MODBUS_REGISTER_BANK uptime_bank;
+
+/* Holding registers: 0 to 49 general purpose, 100 & 101 firmware version, 200 & 201
+ * uptime. Anything else is answered with an illegal data address exception */
+static const MODBUS_REGISTER_RANGE register_map[] = {
+    {0, NUM_REGISTERS, my_registers, MODBUS_ACCESS_READ_WRITE, NULL, NULL},
+    {100, 2, fw_version, MODBUS_ACCESS_READ, NULL, NULL},
+    {200, 2, NULL, MODBUS_ACCESS_READ, NULL, &uptime_bank},
+};
+
+/* 9600 8N1 on an RS-485 transceiver, DE on LEUART0_DE_PIN */
+static const MODBUS_LINE_CONFIG leuart0_line = {9600, ARM_USART_PARITY_NONE, ARM_USART_STOP_BITS_1, false,
+    MODBUS_TRANSPORT_RTU, true
+};
+
+static MODBUS_CLIENT modbus;
 
 volatile uint32_t msTicks;      /* counts 1ms timeTicks */
 
@@ -41,7 +104,14 @@ volatile uint32_t msTicks;      /* counts 1ms timeTicks */
  */
 void SysTick_Handler(void)
 {
+    uint16_t *uptime;
+
     msTicks++;                  /* increment counter necessary in Delay() */
+
+    uptime = MODBUS_Bank_BeginUpdate(&uptime_bank);
+    uptime[0] = msTicks >> 16;
+    uptime[1] = msTicks & 0xFFFF;
+    MODBUS_Bank_Publish(&uptime_bank);
 }
 
 uint32_t getSysTicks(void)
@@ -49,14 +119,112 @@ uint32_t getSysTicks(void)
     return msTicks;
 }
 
-uint16_t read_register(uint16_t addr)
+/* Microseconds for the MODBUS frame timing, from the tick and the SysTick counter (counting down) */
+uint32_t getSysMicros(void)
 {
-    return my_registers[addr];
+    uint32_t ticks;
+    uint32_t count;
+
+    /* Read again if the tick changed in between */
+    do {
+        ticks = msTicks;
+        count = SysTick->VAL;
+    } while (ticks != msTicks);
+
+    return (ticks * 1000) + ((SysTick->LOAD - count) / ((SysTick->LOAD + 1) / 1000));
 }
 
-void write_register(uint16_t addr, uint16_t data)
+static void i2c_event(uint32_t event)
 {
-    my_registers[addr] = data;
+    i2c_events = event;
+}
+
+/**
+ * Writes the accelerometer configuration: 119 Hz, register address auto-increment
+ * is enabled by default
+ */
+static void accel_configure(void)
+{
+    accel_cmd[0] = LSM9DS1_CTRL_REG6_XL;
+    accel_cmd[1] = LSM9DS1_ODR_XL_119HZ;
+    accel_ticks = getSysTicks();
+    i2c_events = 0;
+    if (Driver_I2C0.MasterTransmit(LSM9DS1_ADDR, accel_cmd, 2, false) == ARM_DRIVER_OK) {
+        accel_state = ACCEL_CONFIGURING;
+    } else {
+        accel_state = ACCEL_RESTARTING;
+    }
+}
+
+/**
+ * Starts the I2C bus and the sensor
+ */
+static void accel_init(void)
+{
+    Driver_I2C0.Initialize(i2c_event);
+    Driver_I2C0.PowerControl(ARM_POWER_FULL);
+    Driver_I2C0.Control(ARM_I2C_BUS_SPEED, ARM_I2C_BUS_SPEED_STANDARD);
+
+    accel_configure();
+}
+
+/**
+ * Reads the accelerometer every ACCEL_PERIOD_MS without blocking. A transfer that
+ * fails (NACK, bus error, arbitration lost) or never ends restarts the sensor
+ */
+static void accel_poll(void)
+{
+    uint32_t events;
+
+    if ((accel_state != ACCEL_IDLE) && (accel_state != ACCEL_RESTARTING)) {
+        events = i2c_events;
+        if (events == 0) {
+            /* A failed transfer may signal nothing, start over in the next period */
+            if ((getSysTicks() - accel_ticks) >= ACCEL_PERIOD_MS) {
+                Driver_I2C0.Control(ARM_I2C_ABORT_TRANSFER, 0);
+                accel_state = ACCEL_RESTARTING;
+            }
+            return;
+        }
+        i2c_events = 0;
+        if (((events & ARM_I2C_EVENT_TRANSFER_DONE) == 0) || ((events & I2C_ERROR_EVENTS) != 0)) {
+            accel_state = ACCEL_RESTARTING;
+            return;
+        }
+    }
+
+    switch (accel_state) {
+    case ACCEL_RESTARTING:
+        if ((getSysTicks() - accel_ticks) >= ACCEL_PERIOD_MS) {
+            accel_configure();
+        }
+        break;
+    case ACCEL_IDLE:
+        if ((getSysTicks() - accel_ticks) >= ACCEL_PERIOD_MS) {
+            accel_ticks = getSysTicks();
+            /* Register address, then a repeated start to read the three axes */
+            accel_cmd[0] = LSM9DS1_OUT_X_XL;
+            if (Driver_I2C0.MasterTransmit(LSM9DS1_ADDR, accel_cmd, 1, true) == ARM_DRIVER_OK) {
+                accel_state = ACCEL_ADDRESSING;
+            }
+        }
+        break;
+    case ACCEL_ADDRESSING:
+        if (Driver_I2C0.MasterReceive(LSM9DS1_ADDR, (uint8_t *) accel_buf, sizeof(accel_buf), false) == ARM_DRIVER_OK) {
+            accel_state = ACCEL_READING;
+        } else {
+            accel_state = ACCEL_RESTARTING;
+        }
+        break;
+    case ACCEL_READING:
+        memcpy(accel_samples, accel_buf, sizeof(accel_samples));
+        accel_state = ACCEL_IDLE;
+        break;
+    default:
+        /* Configured, wait for the next period */
+        accel_state = ACCEL_IDLE;
+        break;
+    }
 }
 
 int main(void)
@@ -67,6 +235,8 @@ int main(void)
     /* If first word of user data page is non-zero, enable Energy Profiler trace */
     BSP_TraceProfilerSetup();
 
+    MODBUS_Bank_Init(&uptime_bank, uptime_copies[0], uptime_copies[1], 2);
+
     /* Setup SysTick Timer for 1 msec interrupts  */
     if (SysTick_Config(CMU_ClockFreqGet(cmuClock_CORE) / 1000)) {
         while (1) ;
@@ -78,13 +248,35 @@ int main(void)
     /* Initialize LED driver */
     BSP_LedsInit();
 
-    for (int i = 0; i < 50; i++) {
+    for (int i = 0; i < NUM_REGISTERS; i++) {
         my_registers[i] = i * 2;
     }
 
-    MODBUS_Init(&Driver_LEUART0);
+    accel_init();
+
+    /* RTU only: LEUART0 has no 7 data bits mode, so MODBUS_TRANSPORT_ASCII can never be used here */
+    MODBUS_Init(&modbus, &Driver_LEUART0, &leuart0_line);
+    MODBUS_SetRegisterMap(&modbus, register_map, sizeof(register_map) / sizeof(register_map[0]));
+    MODBUS_SetCoils(&modbus, my_coils, NUM_COILS);
+    MODBUS_SetInputRegisters(&modbus, accel_samples, 3);
+    MODBUS_SetAddress(&modbus, 1);
 
     do {
-        do_MODBUS_Client(500);
+        /* MODBUS_Poll never blocks, other tasks can run in this loop */
+        MODBUS_Poll(&modbus);
+        accel_poll();
+
+        /* Coils 0 & 1 drive the LEDs */
+        if (my_coils[0] & 0x01) {
+            BSP_LedSet(0);
+        } else {
+            BSP_LedClear(0);
+        }
+        if (my_coils[0] & 0x02) {
+            BSP_LedSet(1);
+        } else {
+            BSP_LedClear(1);
+        }
+        __WFE();
     } while (1);
 }
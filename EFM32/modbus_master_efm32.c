@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2020 Màrius Montón <marius.monton@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the License); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an AS IS BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Project:   MODBUS master based on CMSIS UART Driver for EFM32
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "em_device.h"
+#include "em_chip.h"
+#include "em_cmu.h"
+#include "bsp.h"
+#include "bsp_trace.h"
+
+#include "modbus_master.h"
+
+extern ARM_DRIVER_USART Driver_LEUART0;
+
+#define NUM_SLAVES (2)
+#define POLL_PERIOD (100)
+
+static MODBUS_MASTER modbus;
+
+/* Per slave, two reads of adjacent blocks (sent as a single request) and a setpoint write */
+uint16_t status_regs[NUM_SLAVES][4];
+uint16_t measure_regs[NUM_SLAVES][8];
+uint16_t setpoint[NUM_SLAVES];
+
+static MODBUS_TRANSACTION status_trans[NUM_SLAVES];
+static MODBUS_TRANSACTION measure_trans[NUM_SLAVES];
+static MODBUS_TRANSACTION setpoint_trans[NUM_SLAVES];
+
+volatile uint32_t msTicks;      /* counts 1ms timeTicks */
+
+/**
+ * @brief SysTick_Handler
+ * Interrupt Service Routine for system tick counter
+ */
+void SysTick_Handler(void)
+{
+    msTicks++;                  /* increment counter necessary in Delay() */
+}
+
+uint32_t getSysTicks(void)
+{
+    return msTicks;
+}
+
+void measure_done(MODBUS_TRANSACTION * trans)
+{
+    /* LED 0 shows the link with slave 1 */
+    if (trans == &measure_trans[0]) {
+        if (trans->status == MODBUS_TRANS_DONE) {
+            BSP_LedSet(0);
+        } else {
+            BSP_LedClear(0);
+        }
+    }
+}
+
+int main(void)
+{
+    uint32_t last_poll;
+    bool busy;
+
+    /* Chip errata */
+    CHIP_Init();
+
+    /* If first word of user data page is non-zero, enable Energy Profiler trace */
+    BSP_TraceProfilerSetup();
+
+    /* Setup SysTick Timer for 1 msec interrupts  */
+    if (SysTick_Config(CMU_ClockFreqGet(cmuClock_CORE) / 1000)) {
+        while (1) ;
+    }
+
+    /* User must choose which clock source feeds low-frequency B clock branch */
+    CMU_ClockSelectSet(cmuClock_LFB, cmuSelect_LFXO);
+
+    /* Initialize LED driver */
+    BSP_LedsInit();
+
+    MODBUS_Master_Init(&modbus, &Driver_LEUART0, NULL);
+
+    for (int i = 0; i < NUM_SLAVES; i++) {
+        status_trans[i].type = MODBUS_TRANS_READ;
+        status_trans[i].slave = i + 1;
+        status_trans[i].addr = 0;
+        status_trans[i].num = 4;
+        status_trans[i].data = status_regs[i];
+
+        measure_trans[i].type = MODBUS_TRANS_READ;
+        measure_trans[i].slave = i + 1;
+        measure_trans[i].addr = 4;
+        measure_trans[i].num = 8;
+        measure_trans[i].data = measure_regs[i];
+        measure_trans[i].done_cb = measure_done;
+
+        setpoint_trans[i].type = MODBUS_TRANS_WRITE;
+        setpoint_trans[i].slave = i + 1;
+        setpoint_trans[i].addr = 20;
+        setpoint_trans[i].num = 1;
+        setpoint_trans[i].data = &setpoint[i];
+    }
+
+    last_poll = getSysTicks();
+    do {
+        /* MODBUS_Master_Poll never blocks, other tasks can run in this loop */
+        busy = MODBUS_Master_Poll(&modbus);
+
+        /* Queue a new poll cycle once the previous one is finished */
+        if ((busy == false) && ((getSysTicks() - last_poll) >= POLL_PERIOD)) {
+            last_poll = getSysTicks();
+            for (int i = 0; i < NUM_SLAVES; i++) {
+                MODBUS_Master_Submit(&modbus, &status_trans[i]);
+                MODBUS_Master_Submit(&modbus, &measure_trans[i]);
+                setpoint[i] = measure_regs[i][0];
+                MODBUS_Master_Submit(&modbus, &setpoint_trans[i]);
+            }
+        }
+
+        __WFE();
+    } while (1);
+}
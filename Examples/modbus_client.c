@@ -18,27 +18,166 @@
  * Project:   CMSIS Driver implementation for STM32 devices
  *
  * This example implements a MODBUS client using CMSIS UART Driver. It implements
- * holding register functions (3, 6 & 16), with a maximum pkt length of 263 bytes,
+ * holding register functions (3, 6, 16 & 23), with a maximum pkt length of 263 bytes,
  * corresponding a function 16 with 254 bytes to write (127 registers + 9 bytes).
+ * Coils and discrete inputs (functions 1, 2, 5 & 15) are served from bit-packed
+ * arrays of 32-bit words, packed into the frames a word at a time.
+ * Input registers (function 4) are serialized straight from an application
+ * buffer (e.g. sensor samples), without copying them to a register bank first.
+ *
+ * Frames are delimited as MODBUS RTU specifies: bytes are accumulated in a single
+ * reception and a frame ends when the line stays silent for 3.5 character times.
+ * The silence is measured in microseconds: when new bytes are seen, the time since
+ * the previous ones less their own transmission time is the silence before them.
+ * Bytes after t3.5 of silence close the frame and are carried into the next one.
+ * Without new bytes, the frame is closed once t3.5 plus a character time have
+ * passed, as a byte that started within t3.5 would be complete by then.
+ *
+ * The client is a non-blocking state machine advanced by MODBUS_Poll(): reception
+ * stays armed between calls, and each call only checks for new bytes, closes the
+ * frame on silence and answers it. do_MODBUS_Client() is a blocking wrapper.
+ *
+ * Once a response is sent, reception is armed again from the driver event that
+ * signals the end of the transmission, so the next request is never missed. If
+ * that event does not come in time, MODBUS_Poll() aborts the transmission.
+ *
+ * Responses are built in place in the reception buffer, over the request fields
+ * already decoded, and sent from there: no second frame buffer nor header copies.
+ *
+ * Each serial port is served by its own MODBUS_CLIENT context (buffers, state,
+ * address and register callbacks), up to MODBUS_MAX_CLIENTS ports at once.
+ *
+ * The slave address is checked as soon as the first byte arrives: frames for other
+ * slaves are not buffered nor decoded, only the line activity is tracked until the
+ * inter-frame silence.
+ *
+ * Requests that can not be served (unknown function, invalid quantity or value,
+ * registers out of range) are answered with a MODBUS exception response.
+ *
+ * Diagnostic counters (bus messages, CRC errors, exceptions...) are kept for each
+ * client and can be read with MODBUS_GetCounters() or function 8 (diagnostics).
+ *
+ * Broadcast frames (address 0) are accepted for the write functions (5, 6, 15 & 16):
+ * they are applied but never answered, as all slaves receive them.
+ *
+ * Holding registers are accessed through the application callbacks, or served from
+ * a register map: a sorted table of address ranges with their storage, access rights
+ * and write hooks, looked up with a binary search. A range can be a double-buffered
+ * register bank, so blocks are read from a whole update of the application.
+ *
+ * With MODBUS_FC3_CACHE the last function 3 response is kept, CRC included, and
+ * served again with a single Send while the same block is polled and no register
+ * was written (by a request, or by the application calling MODBUS_MarkRegistersDirty()).
+ * Only blocks read from the storage of the register map are kept: the values the
+ * callbacks and the banks give may change without the client knowing.
+ *
+ * The line settings (baudrate, parity and stop bits) are given to MODBUS_Init().
+ * With auto-baud the client tries the standard rates in turn: frames are delimited
+ * with the silence of the rate being tried and each one failing its CRC check moves
+ * to the next rate, until a valid frame locks it.
+ *
+ * With MODBUS_ASCII a client can use the ASCII transport instead: the frame is
+ * received as text up to its LF, decoded into recv_buf with its LRC checked, and
+ * handed to the same function handlers. Their RTU response is encoded back to text
+ * (the LRC replaces the CRC). Hexadecimal digits are converted four at a time in
+ * a 32-bit word, without tables nor a branch per digit.
  *
  */
 
 #include <stdbool.h>
+#include <string.h>
 #include "cmsis_compiler.h"
 #include "Driver_USART.h"
 #include "modbus_client.h"
-
-#define MAX_RECV_BUFF (254+9)
-
+#include "modbus_crc.h"
+
+/* Responses are built over their request */
+#if MODBUS_MAX_RECV_BUFF < MODBUS_MAX_SEND_BUFF
+#error "recv_buf must hold the largest response"
+#endif
+
+/* Function 3 answer is 5 bytes + 2 bytes per register, so 125 registers fill the ADU */
+#define MAX_READ_REGS (125)
+/* Function 16 request is 9 bytes + 2 bytes per register */
+#define MAX_WRITE_REGS (123)
+/* Function 23 request is 13 bytes + 2 bytes per register to write */
+#define MAX_RW_WRITE_REGS (121)
+/* Limits from MODBUS specification for functions 1, 2 & 15 */
+#define MAX_READ_BITS (2000)
+#define MAX_WRITE_BITS (1968)
+
+/* Function 8 sub-functions */
+#define DIAG_RETURN_QUERY_DATA (0x00)
+#define DIAG_RESTART_COMM (0x01)
+#define DIAG_RETURN_REGISTER (0x02)
+#define DIAG_FORCE_LISTEN_ONLY (0x04)
+#define DIAG_CLEAR_COUNTERS (0x0A)
+#define DIAG_BUS_MESSAGES (0x0B)
+#define DIAG_BUS_COMM_ERRORS (0x0C)
+#define DIAG_EXCEPTIONS (0x0D)
+#define DIAG_SLAVE_MESSAGES (0x0E)
+#define DIAG_NO_RESPONSE (0x0F)
+#define DIAG_NAK (0x10)
+#define DIAG_BUSY (0x11)
+#define DIAG_CHAR_OVERRUNS (0x12)
+#define DIAG_CLEAR_OVERRUNS (0x14)
+
+#define COIL_ON (0xFF00)
+#define COIL_OFF (0x0000)
+
+#define READ_COILS (1)
+#define READ_DISCRETE_INPUTS (2)
 #define READ_HOLDING_REGS (3)
+#define READ_INPUT_REGS (4)
+#define WRITE_SINGLE_COIL (5)
 #define WRITE_SINGLE_REG (6)
+#define DIAGNOSTICS (8)
+#define WRITE_MULT_COILS (15)
 #define WRITE_MULTS_REGS (16)
-
-static ARM_DRIVER_USART *usart_drv;
-static uint8_t recv_buf[MAX_RECV_BUFF];
-static uint8_t send_buf[15];
-
-static volatile bool data_received = false;
+#define READ_WRITE_MULT_REGS (23)
+
+#if (MODBUS_MAX_CLIENTS < 1) || (MODBUS_MAX_CLIENTS > 4)
+#error "MODBUS_MAX_CLIENTS must be between 1 and 4"
+#endif
+
+/* Rates tried by auto-baud, the slowest first */
+static const uint32_t autobaud_rates[] = { 1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200, 230400 };
+
+#define NUM_AUTOBAUD_RATES (sizeof(autobaud_rates) / sizeof(autobaud_rates[0]))
+
+#if MODBUS_ASCII
+/* 0x80 in each byte of x (all below 0x80) greater than m and lower than n */
+#define BYTES_BETWEEN(x, m, n) \
+    (((0x01010101UL * (127 + (n)) - ((x) & 0x7F7F7F7FUL)) & ~(x) & (((x) & 0x7F7F7F7FUL) + 0x01010101UL * (127 - (m)))) \
+     & 0x80808080UL)
+#endif
+
+/* Clients attached to each event callback */
+static MODBUS_CLIENT *clients[MODBUS_MAX_CLIENTS];
+
+static void usart_event_0(uint32_t event);
+#if (MODBUS_MAX_CLIENTS > 1)
+static void usart_event_1(uint32_t event);
+#endif
+#if (MODBUS_MAX_CLIENTS > 2)
+static void usart_event_2(uint32_t event);
+#endif
+#if (MODBUS_MAX_CLIENTS > 3)
+static void usart_event_3(uint32_t event);
+#endif
+
+static const ARM_USART_SignalEvent_t usart_events[MODBUS_MAX_CLIENTS] = {
+    usart_event_0,
+#if (MODBUS_MAX_CLIENTS > 1)
+    usart_event_1,
+#endif
+#if (MODBUS_MAX_CLIENTS > 2)
+    usart_event_2,
+#endif
+#if (MODBUS_MAX_CLIENTS > 3)
+    usart_event_3,
+#endif
+};
 
 typedef struct {
     uint8_t address;
@@ -69,6 +208,17 @@ typedef struct {
     uint8_t crc_hi;
 } __attribute__((packed)) write_single_register_t;
 
+typedef struct {
+    uint8_t address;
+    uint8_t function;
+    uint8_t sub_function_hi;
+    uint8_t sub_function_lo;
+    uint8_t data_hi;
+    uint8_t data_lo;
+    uint8_t crc_lo;
+    uint8_t crc_hi;
+} __attribute__((packed)) diagnostics_t;
+
 typedef struct {
     uint8_t address;
     uint8_t function;
@@ -91,299 +241,1876 @@ typedef struct {
     uint8_t crc_hi;
 } __attribute__((packed)) write_multiple_register_response_t;
 
+typedef struct {
+    uint8_t address;
+    uint8_t function;
+    uint8_t read_start_addr_hi;
+    uint8_t read_start_addr_lo;
+    uint8_t read_regs_num_hi;
+    uint8_t read_regs_num_lo;
+    uint8_t write_start_addr_hi;
+    uint8_t write_start_addr_lo;
+    uint8_t write_regs_num_hi;
+    uint8_t write_regs_num_lo;
+    uint8_t byte_count;
+    uint8_t data[];
+} __attribute__((packed)) read_write_multiple_registers_t;
+
+typedef struct {
+    uint8_t address;
+    uint8_t function;
+    uint8_t start_addr_hi;
+    uint8_t start_addr_lo;
+    uint8_t bits_num_hi;
+    uint8_t bits_num_lo;
+    uint8_t crc_lo;
+    uint8_t crc_hi;
+} __attribute__((packed)) read_bits_t;
+
+typedef struct {
+    uint8_t address;
+    uint8_t function;
+    uint8_t byte_count;
+    uint8_t data[];
+} __attribute__((packed)) read_bits_response_t;
+
+typedef struct {
+    uint8_t address;
+    uint8_t function;
+    uint8_t start_addr_hi;
+    uint8_t start_addr_lo;
+    uint8_t bits_num_hi;
+    uint8_t bits_num_lo;
+    uint8_t byte_count;
+    uint8_t data[];
+} __attribute__((packed)) write_multiple_coils_t;
+
+typedef struct {
+    uint8_t address;
+    uint8_t function;
+    uint8_t start_addr_hi;
+    uint8_t start_addr_lo;
+    uint8_t bits_num_hi;
+    uint8_t bits_num_lo;
+    uint8_t crc_lo;
+    uint8_t crc_hi;
+} __attribute__((packed)) write_multiple_coils_response_t;
+
 /* Extern functions */
-extern uint16_t read_register(uint16_t addr);
-extern void write_register(uint16_t addr, uint16_t data);
 extern uint32_t getSysTicks(void);
+extern uint32_t getSysMicros(void);
 
 /* Forward declarations */
-void usart_event(uint32_t event);
-bool process_function_3(uint8_t * buff);
-bool process_function_6(uint8_t * buff);
-bool process_function_16(uint8_t * buff);
-
-/* Function (c) 2020 by Witte Software (https://www.modbustools.com/modbus.html#crc) */
-uint16_t CRC16(const uint8_t * nData, uint16_t wLength);
-
-bool MODBUS_Init(ARM_DRIVER_USART * driver_usart)
+void usart_event(MODBUS_CLIENT * client, uint32_t event);
+MODBUS_EXCEPTION process_function_1(MODBUS_CLIENT * client, uint8_t * buff);
+MODBUS_EXCEPTION process_function_2(MODBUS_CLIENT * client, uint8_t * buff);
+MODBUS_EXCEPTION process_function_3(MODBUS_CLIENT * client, uint8_t * buff);
+MODBUS_EXCEPTION process_function_4(MODBUS_CLIENT * client, uint8_t * buff);
+MODBUS_EXCEPTION process_function_5(MODBUS_CLIENT * client, uint8_t * buff);
+MODBUS_EXCEPTION process_function_6(MODBUS_CLIENT * client, uint8_t * buff);
+MODBUS_EXCEPTION process_function_8(MODBUS_CLIENT * client, uint8_t * buff);
+MODBUS_EXCEPTION process_function_15(MODBUS_CLIENT * client, uint8_t * buff);
+MODBUS_EXCEPTION process_function_16(MODBUS_CLIENT * client, uint8_t * buff);
+MODBUS_EXCEPTION process_function_23(MODBUS_CLIENT * client, uint8_t * buff);
+static MODBUS_EXCEPTION send_registers(MODBUS_CLIENT * client, uint8_t address, uint8_t function,
+                                       uint16_t addr_start, uint16_t num_registers);
+static MODBUS_EXCEPTION send_bits(MODBUS_CLIENT * client, uint8_t * buff, const uint32_t * bits, uint16_t num_bits);
+static uint32_t get_bits(const uint32_t * bits, uint32_t pos, uint32_t num);
+static void set_bits(uint32_t * bits, uint32_t pos, uint32_t value, uint32_t num);
+static bool arm_reception(MODBUS_CLIENT * client);
+static bool set_line(MODBUS_CLIENT * client, uint32_t baudrate);
+static bool send_response(MODBUS_CLIENT * client, const void *data, uint32_t num);
+static void send_exception(MODBUS_CLIENT * client, uint8_t function, MODBUS_EXCEPTION exception);
+static void skip_frame(MODBUS_CLIENT * client);
+static bool new_frame_started(const MODBUS_CLIENT * client, uint32_t num);
+static void carry_bytes(MODBUS_CLIENT * client, const uint8_t * data, uint32_t num);
+static MODBUS_POLL_STATUS poll_skipping(MODBUS_CLIENT * client);
+static MODBUS_POLL_STATUS process_frame(MODBUS_CLIENT * client, uint32_t frame_len);
+static MODBUS_POLL_STATUS detect_baudrate(MODBUS_CLIENT * client, uint32_t frame_len);
+static bool for_other_slave(const MODBUS_CLIENT * client);
+#if MODBUS_ASCII
+static MODBUS_POLL_STATUS poll_ascii(MODBUS_CLIENT * client);
+static int32_t decode_ascii(MODBUS_CLIENT * client, uint32_t num);
+static uint32_t encode_ascii(MODBUS_CLIENT * client, const uint8_t * data, uint32_t num);
+static bool hex_decode(uint32_t chars, uint32_t * value);
+static uint32_t hex_encode(uint32_t value);
+#endif
+static bool read_registers_adapter(uint16_t addr, uint16_t num, uint16_t * data);
+static MODBUS_EXCEPTION read_holding_registers(MODBUS_CLIENT * client, uint16_t addr, uint16_t num, uint16_t * data);
+static bool read_bank(const MODBUS_REGISTER_BANK * bank, uint16_t first, uint16_t num, uint16_t * data);
+static bool write_holding_registers(MODBUS_CLIENT * client, uint16_t addr, uint16_t num, const uint16_t * data);
+static int find_range(const MODBUS_CLIENT * client, uint16_t addr);
+static bool check_map_access(const MODBUS_CLIENT * client, uint16_t addr, uint16_t num, uint8_t access);
+static bool write_registers_adapter(uint16_t addr, uint16_t num, const uint16_t * data);
+#if MODBUS_FC3_CACHE
+static bool is_cacheable(const MODBUS_CLIENT * client, uint16_t addr, uint16_t num);
+#endif
+
+bool MODBUS_Init(MODBUS_CLIENT * client, ARM_DRIVER_USART * driver_usart, const MODBUS_LINE_CONFIG * line)
 {
+    static const MODBUS_LINE_CONFIG default_line = MODBUS_LINE_CONFIG_DEFAULT;
     bool ret_val = true;
+    uint32_t i;
+    int slot;
 
-    if (driver_usart != NULL) {
-        usart_drv = driver_usart;
+    if ((client != NULL) && (driver_usart != NULL)) {
+        client->usart_drv = driver_usart;
     } else {
         return false;
     }
 
-    if (usart_drv->Initialize(usart_event) != ARM_DRIVER_OK) {
-        ret_val = false;
+    if (line == NULL) {
+        line = &default_line;
+    }
+    if (((line->baudrate == 0) && (line->autobaud == false))
+        || ((line->parity != ARM_USART_PARITY_NONE) && (line->parity != ARM_USART_PARITY_EVEN)
+            && (line->parity != ARM_USART_PARITY_ODD))
+        || ((line->stop_bits != ARM_USART_STOP_BITS_1) && (line->stop_bits != ARM_USART_STOP_BITS_2))) {
+        return false;
     }
+    if ((line->transport != MODBUS_TRANSPORT_RTU)
+        && ((line->transport != MODBUS_TRANSPORT_ASCII) || (MODBUS_ASCII == 0) || (line->autobaud == true))) {
+        return false;
+    }
+    /* ASCII characters are 10 bits long: 7E1, 7O1 or 7N2, never 7N1 */
+    if ((line->transport == MODBUS_TRANSPORT_ASCII) && (line->parity == ARM_USART_PARITY_NONE)
+        && (line->stop_bits != ARM_USART_STOP_BITS_2)) {
+        return false;
+    }
+    client->line = *line;
+
+    /* Attach the client to a free event callback (or the one it already had) */
+    for (slot = 0; slot < MODBUS_MAX_CLIENTS; slot++) {
+        if (clients[slot] == client) {
+            break;
+        }
+    }
+    if (slot == MODBUS_MAX_CLIENTS) {
+        for (slot = 0; slot < MODBUS_MAX_CLIENTS; slot++) {
+            if (clients[slot] == NULL) {
+                break;
+            }
+        }
+    }
+    if (slot == MODBUS_MAX_CLIENTS) {
+        return false;
+    }
+    clients[slot] = client;
+    client->state = MODBUS_STATE_IDLE;
+    client->rx_overflow = false;
 
-    if (usart_drv->Control(ARM_USART_MODE_ASYNCHRONOUS |
-                           ARM_USART_DATA_BITS_8 |
-                           ARM_USART_PARITY_NONE | ARM_USART_STOP_BITS_1 | ARM_USART_FLOW_CONTROL_NONE, 9600)
-        != ARM_DRIVER_OK) {
+    if (client->read_registers_cb == NULL) {
+        client->read_registers_cb = read_registers_adapter;
+    }
+    if (client->write_registers_cb == NULL) {
+        client->write_registers_cb = write_registers_adapter;
+    }
+
+    if (client->usart_drv->Initialize(usart_events[slot]) != ARM_DRIVER_OK) {
         ret_val = false;
     }
 
-    if (usart_drv->Control(ARM_USART_CONTROL_TX, 1) != ARM_DRIVER_OK) {
+    /* Wait for the last stop bit when the driver can tell, otherwise for the data sent */
+    if (client->usart_drv->GetCapabilities().event_tx_complete) {
+        client->tx_done_event = ARM_USART_EVENT_TX_COMPLETE;
+    } else {
+        client->tx_done_event = ARM_USART_EVENT_SEND_COMPLETE;
+    }
+
+    if (client->line.autobaud == true) {
+        /* Start with the given rate (i.e. the one found last time) if it is a standard one */
+        client->autobaud_index = 0;
+        for (i = 0; i < NUM_AUTOBAUD_RATES; i++) {
+            if (autobaud_rates[i] == client->line.baudrate) {
+                client->autobaud_index = i;
+            }
+        }
+        client->line.baudrate = autobaud_rates[client->autobaud_index];
+    }
+
+    if (set_line(client, client->line.baudrate) == false) {
         ret_val = false;
     }
 
-    if (usart_drv->Control(ARM_USART_CONTROL_RX, 1) != ARM_DRIVER_OK) {
+    /* Drive the RS-485 DE line if asked to, plain RS-232/TTL ports refuse it and only an enable must succeed */
+    if ((client->usart_drv->Control(ARM_USART_CONTROL_RS485, (client->line.rs485 == true) ? 1 : 0) != ARM_DRIVER_OK)
+        && (client->line.rs485 == true)) {
         ret_val = false;
     }
 
     return ret_val;
 }
 
-bool do_MODBUS_Client(uint32_t timeout)
+uint32_t MODBUS_GetBaudrate(const MODBUS_CLIENT * client)
 {
+    return (client->line.autobaud == true) ? 0 : client->line.baudrate;
+}
 
-    uint32_t ticks_now;
-    uint32_t pending_bytes;
-    uint8_t function;
+void MODBUS_SetRegisterCallbacks(MODBUS_CLIENT * client, MODBUS_ReadRegisters_t read_regs,
+                                 MODBUS_WriteRegisters_t write_regs)
+{
+    client->read_registers_cb = (read_regs != NULL) ? read_regs : read_registers_adapter;
+    client->write_registers_cb = (write_regs != NULL) ? write_regs : write_registers_adapter;
+}
 
-    /* Try to receive first 6 bytes, a MODBUS pkt is always larger than that */
-    usart_drv->Receive(recv_buf, 6);
+bool MODBUS_SetRegisterMap(MODBUS_CLIENT * client, const MODBUS_REGISTER_RANGE * map, uint16_t num_ranges)
+{
+    int i;
 
-    /* Wait for 'timeout' time, if nothing received, return, otherwise, continue */
+    if ((map != NULL) && (num_ranges > 0)) {
+        for (i = 0; i < num_ranges; i++) {
+            if ((map[i].num == 0) || (((uint32_t) map[i].start + map[i].num) > 0x10000)) {
+                return false;
+            }
+            if ((map[i].bank == NULL) && (map[i].storage == NULL)) {
+                return false;
+            }
+            /* Banks are only written by their producer */
+            if ((map[i].bank != NULL) && ((map[i].num > map[i].bank->num) || (map[i].access != MODBUS_ACCESS_READ))) {
+                return false;
+            }
+            /* Sorted and not overlapping, for the binary search */
+            if ((i > 0) && (map[i].start < ((uint32_t) map[i - 1].start + map[i - 1].num))) {
+                return false;
+            }
+        }
+    } else {
+        map = NULL;
+        num_ranges = 0;
+    }
 
-    ticks_now = getSysTicks();
-    data_received = false;
-    while ((data_received == false) && ((getSysTicks() - ticks_now) < timeout)) {
-        __WFE();
+    client->register_map = map;
+    client->num_ranges = num_ranges;
+    return true;
+}
+
+void MODBUS_Bank_Init(MODBUS_REGISTER_BANK * bank, uint16_t * buffer0, uint16_t * buffer1, uint16_t num)
+{
+    bank->buffers[0] = buffer0;
+    bank->buffers[1] = buffer1;
+    bank->num = num;
+    bank->published = 0;
+    bank->writing = 0;
+}
+
+uint16_t *MODBUS_Bank_BeginUpdate(MODBUS_REGISTER_BANK * bank)
+{
+    /* Readers of the back copy (front one two updates ago) must know it changes from now on */
+    bank->writing = bank->published + 1;
+    __DMB();
+
+    return bank->buffers[bank->writing & 1];
+}
+
+void MODBUS_Bank_Publish(MODBUS_REGISTER_BANK * bank)
+{
+    /* All the new values are stored before they are visible */
+    __DMB();
+    bank->published = bank->writing;
+}
+
+void MODBUS_MarkRegistersDirty(MODBUS_CLIENT * client)
+{
+#if MODBUS_FC3_CACHE
+    client->generation++;
+#else
+    (void) client;
+#endif
+}
+
+void MODBUS_SetAddress(MODBUS_CLIENT * client, uint8_t address)
+{
+    client->own_address = address;
+}
+
+void MODBUS_SetCoils(MODBUS_CLIENT * client, uint32_t * coils, uint16_t num_coils)
+{
+    client->coils = coils;
+    client->num_coils = (coils != NULL) ? num_coils : 0;
+}
+
+void MODBUS_SetDiscreteInputs(MODBUS_CLIENT * client, const uint32_t * inputs, uint16_t num_inputs)
+{
+    client->discrete_inputs = inputs;
+    client->num_discrete_inputs = (inputs != NULL) ? num_inputs : 0;
+}
+
+void MODBUS_SetInputRegisters(MODBUS_CLIENT * client, const volatile uint16_t * registers, uint16_t num_registers)
+{
+    client->input_registers = registers;
+    client->num_input_registers = (registers != NULL) ? num_registers : 0;
+}
+
+void MODBUS_GetCounters(const MODBUS_CLIENT * client, MODBUS_COUNTERS * counters)
+{
+    *counters = client->counters;
+}
+
+void MODBUS_ClearCounters(MODBUS_CLIENT * client)
+{
+    memset(&client->counters, 0, sizeof(client->counters));
+}
+
+MODBUS_POLL_STATUS MODBUS_Poll(MODBUS_CLIENT * client)
+{
+    uint32_t count;
+    uint32_t frame_len;
+    bool ended = false;
+    MODBUS_POLL_STATUS status;
+
+    /* A driver overflow is only flagged by the event callback, the counters are updated from Poll alone */
+    if (client->rx_overflow == true) {
+        client->rx_overflow = false;
+        client->counters.char_overruns++;
     }
 
-    if (data_received == false) {
-        return false;
+    if (client->state == MODBUS_STATE_SENDING) {
+        if ((getSysTicks() - client->tx_ticks) < client->tx_timeout) {
+            return MODBUS_POLL_BUSY;
+        }
+
+        /* The end of transmission never came (TX error, DE line stuck...), give up the
+         * response. Idle first so a late event does not arm reception meanwhile */
+        client->state = MODBUS_STATE_IDLE;
+        client->usart_drv->Control(ARM_USART_ABORT_SEND, 0);
+        client->usart_drv->Control(ARM_USART_ABORT_RECEIVE, 0);
+    }
+
+    if (client->state == MODBUS_STATE_IDLE) {
+        if (arm_reception(client) == false) {
+            return MODBUS_POLL_IDLE;
+        }
     }
 
-    function = recv_buf[1];
+    if (client->state == MODBUS_STATE_SKIPPING) {
+        return poll_skipping(client);
+    }
 
-    /* Check what function is required */
-    switch (function) {
-    case READ_HOLDING_REGS:
-    case WRITE_SINGLE_REG:
-        pending_bytes = 0;
-        break;
-    case WRITE_MULTS_REGS:{
-            write_multiple_register_t *aux = (write_multiple_register_t *) recv_buf;
-            pending_bytes = 1 + ((aux->regs_num_hi << 8) | aux->regs_num_lo) * 2;
-            break;
+#if MODBUS_ASCII
+    if (client->line.transport == MODBUS_TRANSPORT_ASCII) {
+        return poll_ascii(client);
+    }
+#endif
+
+    /* Check the address with the first byte, then fold the new bytes into the CRC,
+     * unless they follow t3.5 of silence: the frame ended before them */
+    count = client->rx_offset + client->usart_drv->GetRxCount();
+    if (count != client->rx_count) {
+        if ((client->rx_count == 0) && (client->line.autobaud == false) && for_other_slave(client)) {
+            skip_frame(client);
+            return MODBUS_POLL_BUSY;
+        }
+        if ((client->rx_count > 0) && new_frame_started(client, count - client->rx_count)) {
+            carry_bytes(client, &client->recv_buf[client->rx_count], count - client->rx_count);
+            ended = true;
+        } else {
+            client->rx_crc = CRC16_Update(client->rx_crc, &client->recv_buf[client->rx_count],
+                                          count - client->rx_count);
+            client->rx_count = count;
+            client->rx_us = getSysMicros();
         }
-    default:
-        return false;
     }
 
-    /* Continue receiving */
-    pending_bytes += 2;         /* take into account the CRC */
+    if (client->rx_count == 0) {
+        return MODBUS_POLL_IDLE;
+    }
 
-    usart_drv->Receive(&recv_buf[6], pending_bytes);
+    /* Or when no byte started within t3.5 (or the buffer is full) */
+    if (ended == false) {
+        if ((client->data_received == false)
+            && ((getSysMicros() - client->rx_us) < (client->silence_us + client->char_us))) {
+            return MODBUS_POLL_BUSY;
+        }
 
-    ticks_now = getSysTicks();
-    data_received = false;
-    while ((data_received == false) && ((getSysTicks() - ticks_now) < timeout)) {
-        __WFE();
+        if (client->data_received == false) {
+            client->usart_drv->Control(ARM_USART_ABORT_RECEIVE, 0);
+        } else {
+            /* Longer than any valid frame */
+            client->counters.char_overruns++;
+        }
     }
+    frame_len = client->rx_count;
+    client->state = MODBUS_STATE_IDLE;
 
-    if (data_received == false) {
-        return false;
+    if (client->line.autobaud == true) {
+        status = detect_baudrate(client, frame_len);
+    } else {
+        status = process_frame(client, frame_len);
     }
 
-    /* Entire packet received, process it */
-    bool ret_val;
-    switch (function) {
-    case READ_HOLDING_REGS:
-        ret_val = process_function_3(recv_buf);
-        break;
-    case WRITE_SINGLE_REG:
-        ret_val = process_function_6(recv_buf);
-        break;
-    case WRITE_MULTS_REGS:
-        ret_val = process_function_16(recv_buf);
-        break;
-    default:
-        ret_val = false;
+    client->counters.bus_messages++;
+    if (status == MODBUS_POLL_DROPPED) {
+        client->counters.bus_comm_errors++;
     }
 
-    return ret_val;
+    /* Nothing sent, wait for the next frame right now */
+    if (client->state == MODBUS_STATE_IDLE) {
+        arm_reception(client);
+    }
+
+    return status;
 }
 
-void usart_event(uint32_t event)
+bool do_MODBUS_Client(MODBUS_CLIENT * client, uint32_t timeout)
 {
+    uint32_t ticks_now;
+    MODBUS_POLL_STATUS status;
 
-    if (event == ARM_USART_EVENT_RECEIVE_COMPLETE) {
-        data_received = true;
-    }
+    /* Wait for 'timeout' time for a frame to start, then until it is complete */
+    ticks_now = getSysTicks();
+    do {
+        status = MODBUS_Poll(client);
+        if ((status == MODBUS_POLL_DONE) || (status == MODBUS_POLL_DROPPED) || (status == MODBUS_POLL_IGNORED)
+            || (status == MODBUS_POLL_EXCEPTION)) {
+            break;
+        }
+        if ((status == MODBUS_POLL_IDLE) && ((getSysTicks() - ticks_now) >= timeout)) {
+            break;
+        }
+        __WFE();
+    } while (1);
+
+    return (status == MODBUS_POLL_DONE);
 }
 
-bool process_function_3(uint8_t * buff)
+/**
+ * Arms the reception of a whole frame into recv_buf, after the bytes carried from
+ * the previous reception if any
+ * @return true on success, false otherwise
+ */
+static bool arm_reception(MODBUS_CLIENT * client)
 {
-    uint16_t num_registers;
-    uint16_t addr_start;
-    int i;
+    int32_t ret;
+
+    client->data_received = false;
+    client->rx_offset = client->carry_len;
+    client->rx_count = client->carry_len;
+    client->carry_len = 0;
+    memcpy(client->recv_buf, client->skip_buf, client->rx_count);
+    client->rx_crc = CRC16_Update(CRC16_Init(), client->recv_buf, client->rx_count);
+
+#if MODBUS_ASCII
+    if (client->line.transport == MODBUS_TRANSPORT_ASCII) {
+        ret = client->usart_drv->Receive(client->ascii_buf, MODBUS_ASCII_MAX_BUFF);
+    } else {
+        ret = client->usart_drv->Receive(&client->recv_buf[client->rx_offset],
+                                         MODBUS_MAX_RECV_BUFF - client->rx_offset);
+    }
+#else
+    ret = client->usart_drv->Receive(&client->recv_buf[client->rx_offset], MODBUS_MAX_RECV_BUFF - client->rx_offset);
+#endif
+    if (ret != ARM_DRIVER_OK) {
+        return false;
+    }
 
-    read_holding_register_t *pkt = (read_holding_register_t *) buff;
-    read_holding_register_response_t *pkt_resp = (read_holding_register_response_t *) send_buf;
+    client->state = MODBUS_STATE_RECEIVING;
 
-    /* Check CRC */
-    uint16_t crc = CRC16((uint8_t *) pkt, 6);
-    uint16_t pkt_crc = (pkt->crc_hi << 8) | pkt->crc_lo;
-    if (crc != pkt_crc) {
-        return false;
+    /* A carried frame for another slave is skipped as soon as armed */
+    if ((client->rx_count > 0) && (client->line.autobaud == false) && for_other_slave(client)) {
+        skip_frame(client);
     }
+    return true;
+}
 
-    pkt_resp->address = pkt->address;
-    pkt_resp->function = pkt->function;
-    num_registers = (pkt->regs_num_hi << 8) | pkt->regs_num_lo;
-    addr_start = (pkt->start_addr_hi << 8) | pkt->start_addr_lo;
+/**
+ * Configures the USART with the line settings at the given rate, and the
+ * frame delimiting silence of that rate
+ * @param baudrate bits per second
+ * @return true on success, false otherwise
+ */
+static bool set_line(MODBUS_CLIENT * client, uint32_t baudrate)
+{
+    bool ret_val = true;
+    uint32_t data_bits;
 
-    pkt_resp->byte_count = num_registers * 2;
-    uint16_t aux;
-    for (i = 0; i < num_registers; i++) {
-        aux = read_register(addr_start + i);
-        pkt_resp->data[i * 2] = aux >> 8;
-        pkt_resp->data[(i * 2) + 1] = aux & 0x00FF;
+    data_bits = (client->line.transport == MODBUS_TRANSPORT_ASCII) ? ARM_USART_DATA_BITS_7 : ARM_USART_DATA_BITS_8;
+
+    if (client->usart_drv->Control(ARM_USART_MODE_ASYNCHRONOUS | data_bits | client->line.parity |
+                                   client->line.stop_bits | ARM_USART_FLOW_CONTROL_NONE, baudrate) != ARM_DRIVER_OK) {
+        ret_val = false;
     }
 
-    /* Insert CRC to the response packet */
-    uint16_t crc_res_pkt = CRC16((uint8_t *) pkt_resp, 3 + (num_registers * 2));
-    pkt_resp->data[i * 2] = crc_res_pkt & 0x00FF;
-    pkt_resp->data[(i * 2) + 1] = crc_res_pkt >> 8;
+    client->silence_us = MODBUS_SilenceMicros(baudrate);
+    client->char_us = MODBUS_CharMicros(baudrate);
+    client->carry_len = 0;
 
-    int32_t ret_val = usart_drv->Send(pkt_resp, 5 + (num_registers * 2));
+    /* Reconfiguring the USART may disable its interrupts */
+    if (client->usart_drv->Control(ARM_USART_CONTROL_TX, 1) != ARM_DRIVER_OK) {
+        ret_val = false;
+    }
 
-    if (ret_val == ARM_DRIVER_OK) {
-        return true;
-    } else {
-        return false;
+    if (client->usart_drv->Control(ARM_USART_CONTROL_RX, 1) != ARM_DRIVER_OK) {
+        ret_val = false;
     }
+
+    return ret_val;
 }
 
-bool process_function_6(uint8_t * buff)
+/**
+ * Sends a response, reception is armed again when the transmission ends
+ * @param data response
+ * @param num response length
+ * @return true on success, false otherwise
+ */
+static bool send_response(MODBUS_CLIENT * client, const void *data, uint32_t num)
 {
-    uint16_t wr_data;
-    uint16_t addr_start;
-    write_single_register_t *pkt = (write_single_register_t *) buff;
+    /* Broadcast requests are applied but never answered */
+    if ((client->recv_buf[0] == MODBUS_ADDRESS_BROADCAST) || (client->listen_only == true)) {
+        client->counters.no_response++;
+        return true;
+    }
 
-    /* Check CRC */
-    uint16_t crc = CRC16((uint8_t *) pkt, 6);
-    uint16_t pkt_crc = (pkt->crc_hi << 8) | pkt->crc_lo;
-    if (crc != pkt_crc) {
-        return false;
+#if MODBUS_ASCII
+    /* Same response as text, without its CRC */
+    if (client->line.transport == MODBUS_TRANSPORT_ASCII) {
+        num = encode_ascii(client, data, num - 2);
+        data = client->ascii_buf;
     }
+#endif
 
-    addr_start = (pkt->start_addr_hi << 8) | pkt->start_addr_lo;
-    wr_data = (pkt->wr_data_hi << 8) | pkt->wr_data_lo;
+    /* Twice the frame time (11 bits per character) as margin, plus t3.5 and tick rounding */
+    client->tx_ticks = getSysTicks();
+    client->tx_timeout = (((num * 22000UL) + client->line.baudrate - 1) / client->line.baudrate)
+        + MODBUS_SilenceTicks(client->line.baudrate);
 
-    write_register(addr_start, wr_data);
+    /* Bytes received meanwhile collided with the response */
+    client->carry_len = 0;
 
-    int32_t ret_val = usart_drv->Send(buff, 8);
+    /* Set before sending, the end of transmission event may come at any time */
+    client->state = MODBUS_STATE_SENDING;
 
-    if (ret_val == ARM_DRIVER_OK) {
-        return true;
-    } else {
+    if (client->usart_drv->Send(data, num) != ARM_DRIVER_OK) {
+        client->state = MODBUS_STATE_IDLE;
         return false;
     }
 
+    return true;
 }
 
-bool process_function_16(uint8_t * buff)
+/**
+ * Answers the request in recv_buf with an exception response
+ * @param client client context
+ * @param function function code of the request
+ * @param exception exception code
+ */
+static void send_exception(MODBUS_CLIENT * client, uint8_t function, MODBUS_EXCEPTION exception)
 {
-    uint16_t addr_start;
-    uint16_t num_registers;
-    int i;
-    uint16_t wr_data;
+    uint8_t *pkt_resp = client->recv_buf;
+    uint16_t crc_res_pkt;
 
-    write_multiple_register_t *pkt = (write_multiple_register_t *) buff;
+    pkt_resp[0] = client->recv_buf[0];
+    pkt_resp[1] = function | 0x80;
+    pkt_resp[2] = exception;
 
-    write_multiple_register_response_t *pkt_resp = (write_multiple_register_response_t *) send_buf;
+    crc_res_pkt = CRC16(pkt_resp, 3);
+    pkt_resp[3] = crc_res_pkt & 0x00FF;
+    pkt_resp[4] = crc_res_pkt >> 8;
 
-    addr_start = (pkt->start_addr_hi << 8) | pkt->start_addr_lo;
-    num_registers = (pkt->regs_num_hi << 8) | pkt->regs_num_lo;
+    send_response(client, pkt_resp, 5);
+}
 
-    /* Check CRC */
-    /* Variable length packet, need to calculate index CRC */
-    int index = pkt->byte_count + 7;
-    uint16_t crc = CRC16((uint8_t *) pkt, index);
-    uint16_t pkt_crc = buff[index] | (buff[index + 1] << 8);
+/**
+ * Stops buffering the current frame (addressed to another slave), the reception
+ * continues in skip_buf only to track the line activity
+ */
+static void skip_frame(MODBUS_CLIENT * client)
+{
+    client->usart_drv->Control(ARM_USART_ABORT_RECEIVE, 0);
 
-    if (crc != pkt_crc) {
-        return false;
-    }
+    client->data_received = false;
+    client->rx_count = 0;
+    client->rx_us = getSysMicros();
+    client->state = MODBUS_STATE_SKIPPING;
 
-    for (i = 0; i < num_registers; i++) {
-        wr_data = (pkt->data[i * 2] << 8) | pkt->data[(i * 2) + 1];
-        write_register(addr_start + i, wr_data);
-    }
+    client->usart_drv->Receive(client->skip_buf, sizeof(client->skip_buf));
+}
 
-    pkt_resp->address = pkt->address;
-    pkt_resp->function = pkt->function;
-    pkt_resp->start_addr_hi = pkt->start_addr_hi;
-    pkt_resp->start_addr_lo = pkt->start_addr_lo;
-    pkt_resp->regs_num_hi = pkt->regs_num_hi;
-    pkt_resp->regs_num_lo = pkt->regs_num_lo;
+/**
+ * Tracks the line while a foreign frame is on it
+ * @return MODBUS_POLL_BUSY until the inter-frame silence, MODBUS_POLL_IGNORED then
+ */
+static MODBUS_POLL_STATUS poll_skipping(MODBUS_CLIENT * client)
+{
+    uint32_t count;
 
-    /* Insert CRC to the response packet */
-    uint16_t crc_res_pkt = CRC16((uint8_t *) pkt_resp, 6);
-    pkt_resp->crc_lo = crc_res_pkt & 0x00FF;
-    pkt_resp->crc_hi = crc_res_pkt >> 8;
+    count = client->usart_drv->GetRxCount();
+    if ((count > client->rx_count) && new_frame_started(client, count - client->rx_count)) {
+        /* The foreign frame ended before these bytes */
+        carry_bytes(client, &client->skip_buf[client->rx_count], count - client->rx_count);
+    } else {
+        if ((count != client->rx_count) || (client->data_received == true)) {
+            client->rx_count = count;
+            client->rx_us = getSysMicros();
+            if (client->data_received == true) {
+                /* skip_buf full, keep discarding */
+                client->data_received = false;
+                client->rx_count = 0;
+                client->usart_drv->Receive(client->skip_buf, sizeof(client->skip_buf));
+            }
+        }
 
-    int32_t ret_val = usart_drv->Send(pkt_resp, 8);
+        if ((getSysMicros() - client->rx_us) < (client->silence_us + client->char_us)) {
+            return MODBUS_POLL_BUSY;
+        }
 
-    if (ret_val == ARM_DRIVER_OK) {
-        return true;
-    } else {
-        return false;
+        client->usart_drv->Control(ARM_USART_ABORT_RECEIVE, 0);
     }
+
+    client->state = MODBUS_STATE_IDLE;
+    client->counters.bus_messages++;
+
+    /* The next frame may follow right after the silence, do not wait for the next poll */
+    arm_reception(client);
+
+    return MODBUS_POLL_IGNORED;
+}
+
+/**
+ * Tells if new bytes follow an inter-frame silence. They came back to back, as the
+ * bytes of a frame do, so the silence before them is the time since the previous
+ * bytes were seen less their own transmission time.
+ * @param num number of new bytes
+ * @return true if they start a new frame
+ */
+static bool new_frame_started(const MODBUS_CLIENT * client, uint32_t num)
+{
+    return ((getSysMicros() - client->rx_us) >= (client->silence_us + (num * client->char_us)));
+}
+
+/**
+ * Stops the reception at the end of the current frame and keeps the new bytes,
+ * that start the next one, for the next reception
+ * @param data new bytes, in recv_buf or skip_buf
+ * @param num number of new bytes
+ */
+static void carry_bytes(MODBUS_CLIENT * client, const uint8_t * data, uint32_t num)
+{
+    client->usart_drv->Control(ARM_USART_ABORT_RECEIVE, 0);
+
+    /* Normally one byte, MODBUS_Poll() runs as each byte arrives */
+    if (num > sizeof(client->skip_buf)) {
+        num = sizeof(client->skip_buf);
+    }
+    memmove(client->skip_buf, data, num);
+    client->carry_len = num;
+    client->rx_us = getSysMicros();
+}
+
+/**
+ * Checks the address of the frame in recv_buf
+ * @return true if addressed to another slave (not to this one nor broadcast)
+ */
+static bool for_other_slave(const MODBUS_CLIENT * client)
+{
+    return (client->own_address != MODBUS_ADDRESS_ANY) && (client->recv_buf[0] != client->own_address)
+        && (client->recv_buf[0] != MODBUS_ADDRESS_BROADCAST);
+}
+
+#if MODBUS_ASCII
+/**
+ * Receives a MODBUS ASCII frame, it ends with LF. Partial frames are dropped after
+ * MODBUS_ASCII_TIMEOUT without characters, or when they fill ascii_buf
+ * @return client status, see MODBUS_POLL_STATUS
+ */
+static MODBUS_POLL_STATUS poll_ascii(MODBUS_CLIENT * client)
+{
+    uint32_t count;
+    uint32_t end;
+    int32_t frame_len;
+    MODBUS_POLL_STATUS status;
+
+    count = client->usart_drv->GetRxCount();
+    if (count != client->rx_count) {
+        /* Only the new characters are searched for the LF */
+        for (end = client->rx_count; (end < count) && (client->ascii_buf[end] != '\n'); end++) {
+        }
+        client->rx_count = count;
+        client->rx_us = getSysMicros();
+        if (end == count) {
+            return MODBUS_POLL_BUSY;
+        }
+
+        client->usart_drv->Control(ARM_USART_ABORT_RECEIVE, 0);
+        client->state = MODBUS_STATE_IDLE;
+
+        frame_len = decode_ascii(client, end + 1);
+        if (frame_len < 0) {
+            status = MODBUS_POLL_DROPPED;
+        } else if (for_other_slave(client)) {
+            status = MODBUS_POLL_IGNORED;
+        } else {
+            /* As an RTU frame of the same length, for the function handlers */
+            client->rx_count = frame_len;
+            status = process_frame(client, frame_len);
+        }
+    } else if (client->rx_count == 0) {
+        return MODBUS_POLL_IDLE;
+    } else if ((client->data_received == false) && ((getSysMicros() - client->rx_us) < (MODBUS_ASCII_TIMEOUT * 1000UL))) {
+        return MODBUS_POLL_BUSY;
+    } else {
+        /* Broken frame */
+        if (client->data_received == false) {
+            client->usart_drv->Control(ARM_USART_ABORT_RECEIVE, 0);
+        } else {
+            client->counters.char_overruns++;
+        }
+        client->state = MODBUS_STATE_IDLE;
+        status = MODBUS_POLL_DROPPED;
+    }
+
+    client->counters.bus_messages++;
+    if (status == MODBUS_POLL_DROPPED) {
+        client->counters.bus_comm_errors++;
+    }
+
+    /* Nothing sent, wait for the next frame right now */
+    if (client->state == MODBUS_STATE_IDLE) {
+        arm_reception(client);
+    }
+
+    return status;
+}
+
+/**
+ * Decodes the MODBUS ASCII frame in ascii_buf into recv_buf and checks its LRC
+ * @param num characters received, up to the LF
+ * @return length of the frame as RTU (the 1 byte LRC counts as the 2 bytes CRC), -1 if not valid
+ */
+static int32_t decode_ascii(MODBUS_CLIENT * client, uint32_t num)
+{
+    const uint8_t *chars;
+    uint32_t start;
+    uint32_t len;
+    uint32_t i;
+    uint32_t word;
+    uint32_t value;
+    uint8_t lrc = 0;
+
+    if ((num < 2) || (client->ascii_buf[num - 2] != '\r')) {
+        return -1;
+    }
+
+    /* A ':' starts the frame again, even in the middle of another one */
+    start = num - 2;
+    while ((start > 0) && (client->ascii_buf[start - 1] != ':')) {
+        start--;
+    }
+    if (start == 0) {
+        return -1;
+    }
+
+    /* At least address, function code and LRC. As RTU (one more byte) it must fit
+     * recv_buf, which also leaves room for the padding of an odd last byte */
+    len = (num - 2) - start;
+    if (((len & 1) != 0) || (len < 6) || ((len / 2) >= MODBUS_MAX_RECV_BUFF)) {
+        return -1;
+    }
+    len /= 2;
+    chars = &client->ascii_buf[start];
+
+    /* Four digits (two bytes) at a time, an odd last byte is padded with "00" */
+    for (i = 0; i < len; i += 2) {
+        word = chars[i * 2] | (chars[(i * 2) + 1] << 8);
+        if ((i + 1) < len) {
+            word |= (chars[(i * 2) + 2] << 16) | ((uint32_t) chars[(i * 2) + 3] << 24);
+        } else {
+            word |= 0x30300000;
+        }
+        if (hex_decode(word, &value) == false) {
+            return -1;
+        }
+        client->recv_buf[i] = value & 0x00FF;
+        client->recv_buf[i + 1] = value >> 8;
+        lrc += value + (value >> 8);
+    }
+
+    /* The LRC is the two's complement of the sum of the other bytes */
+    if (lrc != 0) {
+        return -1;
+    }
+
+    return len + 1;
+}
+
+/**
+ * Encodes a response as a MODBUS ASCII frame in ascii_buf
+ * @param data response, without CRC
+ * @param num response length
+ * @return frame length in characters
+ */
+static uint32_t encode_ascii(MODBUS_CLIENT * client, const uint8_t * data, uint32_t num)
+{
+    uint8_t *chars = &client->ascii_buf[1];
+    uint32_t i;
+    uint32_t word;
+    uint8_t lrc = 0;
+
+    client->ascii_buf[0] = ':';
+
+    /* Two bytes (four digits) at a time, the LRC completes an odd length */
+    for (i = 0; (i + 1) < num; i += 2) {
+        lrc += data[i] + data[i + 1];
+        word = hex_encode(data[i] | (data[i + 1] << 8));
+        chars[i * 2] = word;
+        chars[(i * 2) + 1] = word >> 8;
+        chars[(i * 2) + 2] = word >> 16;
+        chars[(i * 2) + 3] = word >> 24;
+    }
+
+    if (i < num) {
+        lrc += data[i];
+        lrc = -lrc;
+        word = hex_encode(data[i] | (lrc << 8));
+        chars[i * 2] = word;
+        chars[(i * 2) + 1] = word >> 8;
+        chars[(i * 2) + 2] = word >> 16;
+        chars[(i * 2) + 3] = word >> 24;
+    } else {
+        lrc = -lrc;
+        word = hex_encode(lrc);
+        chars[i * 2] = word;
+        chars[(i * 2) + 1] = word >> 8;
+    }
+
+    /* ':', response and LRC digits, CR LF */
+    num = (num + 1) * 2;
+    chars[num] = '\r';
+    chars[num + 1] = '\n';
+
+    return num + 3;
+}
+
+/**
+ * Converts four hexadecimal digits (upper or lower case) to two bytes
+ * @param chars digits, the first one in the lowest byte
+ * @param value first byte in the lowest byte
+ * @return true on success, false if a character is not a hexadecimal digit
+ */
+static bool hex_decode(uint32_t chars, uint32_t * value)
+{
+    uint32_t digits;
+    uint32_t letters;
+    uint32_t nibbles;
+
+    if ((chars & 0x80808080) != 0) {
+        return false;
+    }
+
+    /* Each character must be '0' to '9', or 'a' to 'f' once in lower case */
+    digits = BYTES_BETWEEN(chars, '0' - 1, '9' + 1);
+    letters = BYTES_BETWEEN(chars | 0x20202020, 'a' - 1, 'f' + 1);
+    if ((digits | letters) != 0x80808080) {
+        return false;
+    }
+
+    /* The low nibble of a letter is 1 to 6 */
+    nibbles = (chars & 0x0F0F0F0F) + ((letters >> 7) * 9);
+
+    /* High and low nibbles of each byte together */
+    nibbles = ((nibbles & 0x000F000F) << 4) | ((nibbles >> 8) & 0x000F000F);
+    *value = (nibbles & 0x00FF) | ((nibbles >> 8) & 0xFF00);
+
+    return true;
+}
+
+/**
+ * Converts two bytes to four hexadecimal digits (upper case)
+ * @param value first byte in the lowest byte
+ * @return digits, the first one in the lowest byte
+ */
+static uint32_t hex_encode(uint32_t value)
+{
+    uint32_t nibbles;
+
+    /* One nibble per byte, high nibble first */
+    value = (value & 0x00FF) | ((value & 0xFF00) << 8);
+    nibbles = ((value >> 4) & 0x000F000F) | ((value & 0x000F000F) << 8);
+
+    /* Nibbles above 9 skip the 7 characters between '9' and 'A' */
+    return nibbles + 0x30303030 + ((((nibbles + 0x06060606) >> 4) & 0x01010101) * 7);
+}
+#endif
+
+/**
+ * Checks a frame received while detecting the rate: the first valid one locks
+ * the rate and is processed, otherwise the next rate is tried
+ * @param frame_len frame length
+ * @return MODBUS_POLL_DROPPED if not valid, as process_frame() otherwise
+ */
+static MODBUS_POLL_STATUS detect_baudrate(MODBUS_CLIENT * client, uint32_t frame_len)
+{
+    if ((frame_len < 4) || (client->rx_crc != CRC16_RESIDUE)) {
+        /* Garbage at this rate, listen at the next one */
+        client->autobaud_index = (client->autobaud_index + 1) % NUM_AUTOBAUD_RATES;
+        client->line.baudrate = autobaud_rates[client->autobaud_index];
+        set_line(client, client->line.baudrate);
+        return MODBUS_POLL_DROPPED;
+    }
+
+    client->line.autobaud = false;
+
+    /* Its address was not checked when the first byte arrived */
+    if (for_other_slave(client)) {
+        return MODBUS_POLL_IGNORED;
+    }
+
+    return process_frame(client, frame_len);
+}
+
+/**
+ * Validates a received frame and answers it
+ * @param frame_len frame length
+ * @return MODBUS_POLL_DONE if answered, MODBUS_POLL_DROPPED otherwise
+ */
+static MODBUS_POLL_STATUS process_frame(MODBUS_CLIENT * client, uint32_t frame_len)
+{
+    uint8_t function;
+
+    if (frame_len < 4) {
+        return MODBUS_POLL_DROPPED;
+    }
+
+    function = client->recv_buf[1];
+
+    /* Check the frame length matches the requested function, drop it otherwise */
+    switch (function) {
+    case READ_COILS:
+    case READ_DISCRETE_INPUTS:
+    case READ_HOLDING_REGS:
+    case READ_INPUT_REGS:
+    case WRITE_SINGLE_COIL:
+    case WRITE_SINGLE_REG:
+        if (frame_len != 8) {
+            return MODBUS_POLL_DROPPED;
+        }
+        break;
+    case DIAGNOSTICS:
+        /* Return query data echoes any amount of data */
+        if (frame_len < 8) {
+            return MODBUS_POLL_DROPPED;
+        }
+        break;
+    case WRITE_MULT_COILS:{
+            write_multiple_coils_t *aux = (write_multiple_coils_t *) client->recv_buf;
+            if ((frame_len < 9) || (frame_len != (9U + aux->byte_count))) {
+                return MODBUS_POLL_DROPPED;
+            }
+            break;
+        }
+    case WRITE_MULTS_REGS:{
+            write_multiple_register_t *aux = (write_multiple_register_t *) client->recv_buf;
+            if ((frame_len < 9) || (frame_len != (9U + aux->byte_count))) {
+                return MODBUS_POLL_DROPPED;
+            }
+            break;
+        }
+    case READ_WRITE_MULT_REGS:{
+            read_write_multiple_registers_t *aux = (read_write_multiple_registers_t *) client->recv_buf;
+            if ((frame_len < 13) || (frame_len != (13U + aux->byte_count))) {
+                return MODBUS_POLL_DROPPED;
+            }
+            break;
+        }
+    default:
+        /* Unknown length, the CRC check below delimits it */
+        break;
+    }
+
+    /* CRC over the whole frame, including its CRC field, leaves the residue. ASCII
+     * frames had their LRC checked when decoded */
+    if ((client->line.transport == MODBUS_TRANSPORT_RTU) && (client->rx_crc != CRC16_RESIDUE)) {
+        return MODBUS_POLL_DROPPED;
+    }
+
+    /* Only write functions can be broadcast, there is no way to answer a read */
+    if (client->recv_buf[0] == MODBUS_ADDRESS_BROADCAST) {
+        switch (function) {
+        case WRITE_SINGLE_COIL:
+        case WRITE_SINGLE_REG:
+        case WRITE_MULT_COILS:
+        case WRITE_MULTS_REGS:
+            break;
+        default:
+            return MODBUS_POLL_IGNORED;
+        }
+    }
+
+    /* In listen only mode only a restart communications request is processed */
+    if ((client->listen_only == true) && ((function != DIAGNOSTICS) || (client->recv_buf[2] != 0)
+                                          || (client->recv_buf[3] != DIAG_RESTART_COMM))) {
+        client->counters.no_response++;
+        return MODBUS_POLL_IGNORED;
+    }
+
+    client->counters.slave_messages++;
+
+    /* Entire packet received, process it */
+    MODBUS_EXCEPTION ret_val;
+    switch (function) {
+    case READ_COILS:
+        ret_val = process_function_1(client, client->recv_buf);
+        break;
+    case READ_DISCRETE_INPUTS:
+        ret_val = process_function_2(client, client->recv_buf);
+        break;
+    case READ_HOLDING_REGS:
+        ret_val = process_function_3(client, client->recv_buf);
+        break;
+    case READ_INPUT_REGS:
+        ret_val = process_function_4(client, client->recv_buf);
+        break;
+    case WRITE_SINGLE_COIL:
+        ret_val = process_function_5(client, client->recv_buf);
+        break;
+    case WRITE_SINGLE_REG:
+        ret_val = process_function_6(client, client->recv_buf);
+        break;
+    case DIAGNOSTICS:
+        ret_val = process_function_8(client, client->recv_buf);
+        break;
+    case WRITE_MULT_COILS:
+        ret_val = process_function_15(client, client->recv_buf);
+        break;
+    case WRITE_MULTS_REGS:
+        ret_val = process_function_16(client, client->recv_buf);
+        break;
+    case READ_WRITE_MULT_REGS:
+        ret_val = process_function_23(client, client->recv_buf);
+        break;
+    default:
+        ret_val = MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
+    }
+
+    if (ret_val != MODBUS_EXCEPTION_NONE) {
+        client->counters.exceptions++;
+        send_exception(client, function, ret_val);
+        return MODBUS_POLL_EXCEPTION;
+    }
+
+    return MODBUS_POLL_DONE;
+}
+
+MODBUS_EXCEPTION process_function_23(MODBUS_CLIENT * client, uint8_t * buff)
+{
+    uint16_t read_addr_start;
+    uint16_t read_num_registers;
+    uint16_t write_addr_start;
+    uint16_t write_num_registers;
+    int i;
+    uint16_t wr_data;
+    uint16_t *regs;
+
+    read_write_multiple_registers_t *pkt = (read_write_multiple_registers_t *) buff;
+
+    read_addr_start = (pkt->read_start_addr_hi << 8) | pkt->read_start_addr_lo;
+    read_num_registers = (pkt->read_regs_num_hi << 8) | pkt->read_regs_num_lo;
+    write_addr_start = (pkt->write_start_addr_hi << 8) | pkt->write_start_addr_lo;
+    write_num_registers = (pkt->write_regs_num_hi << 8) | pkt->write_regs_num_lo;
+
+    if ((read_num_registers == 0) || (read_num_registers > MAX_READ_REGS)) {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+    }
+
+    if ((write_num_registers == 0) || (write_num_registers > MAX_RW_WRITE_REGS)
+        || (pkt->byte_count != (write_num_registers * 2))) {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+    }
+
+    /* Nothing is written if the read would fail. The callbacks can only tell when reading */
+    if ((((uint32_t) read_addr_start + read_num_registers) > 0x10000)
+        || ((client->register_map != NULL)
+            && (check_map_access(client, read_addr_start, read_num_registers, MODBUS_ACCESS_READ) == false))) {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    }
+
+    /* Convert the data to host order in place, in the aligned word at byte_count.
+     * Each write only touches bytes already consumed, header fields stay intact */
+    regs = (uint16_t *) &buff[10];
+    for (i = 0; i < write_num_registers; i++) {
+        wr_data = (pkt->data[i * 2] << 8) | pkt->data[(i * 2) + 1];
+        regs[i] = wr_data;
+    }
+
+    /* MODBUS specifies the write is done before the read */
+    if (write_holding_registers(client, write_addr_start, write_num_registers, regs) == false) {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    }
+
+    return send_registers(client, pkt->address, pkt->function, read_addr_start, read_num_registers);
+}
+
+/**
+ * Reads up to 32 bits from a bit-packed array
+ * @param bits bit-packed array, bit n is bit (n % 32) of word (n / 32)
+ * @param pos first bit to read
+ * @param num number of bits to read (1 to 32), pos + num must be inside the array
+ * @return bits read, first one in bit 0, unused bits are zero
+ */
+static uint32_t get_bits(const uint32_t * bits, uint32_t pos, uint32_t num)
+{
+    uint32_t word = pos >> 5;
+    uint32_t shift = pos & 0x1F;
+    uint32_t value;
+
+    value = bits[word] >> shift;
+    if ((shift != 0) && ((shift + num) > 32)) {
+        value |= bits[word + 1] << (32 - shift);
+    }
+
+    if (num < 32) {
+        value &= (1UL << num) - 1;
+    }
+    return value;
+}
+
+/**
+ * Writes up to 32 bits into a bit-packed array
+ * @param bits bit-packed array, bit n is bit (n % 32) of word (n / 32)
+ * @param pos first bit to write
+ * @param value bits to write, first one in bit 0
+ * @param num number of bits to write (1 to 32), pos + num must be inside the array
+ */
+static void set_bits(uint32_t * bits, uint32_t pos, uint32_t value, uint32_t num)
+{
+    uint32_t word = pos >> 5;
+    uint32_t shift = pos & 0x1F;
+    uint32_t mask = (num < 32) ? ((1UL << num) - 1) : 0xFFFFFFFF;
+
+    value &= mask;
+    bits[word] = (bits[word] & ~(mask << shift)) | (value << shift);
+    if ((shift + num) > 32) {
+        bits[word + 1] = (bits[word + 1] & ~(mask >> (32 - shift))) | (value >> (32 - shift));
+    }
+}
+
+/* Per register callbacks, the application may define them instead of the block ones.
+ * Weak references: they are NULL if not defined, and the accesses then fail */
+extern __WEAK uint16_t read_register(uint16_t addr);
+extern __WEAK void write_register(uint16_t addr, uint16_t data);
+
+static bool read_registers_adapter(uint16_t addr, uint16_t num, uint16_t * data)
+{
+    int i;
+
+    if (read_register == NULL) {
+        return false;
+    }
+
+    for (i = 0; i < num; i++) {
+        data[i] = read_register(addr + i);
+    }
+    return true;
+}
+
+static bool write_registers_adapter(uint16_t addr, uint16_t num, const uint16_t * data)
+{
+    int i;
+
+    if (write_register == NULL) {
+        return false;
+    }
+
+    for (i = 0; i < num; i++) {
+        write_register(addr + i, data[i]);
+    }
+    return true;
+}
+
+/**
+ * Finds the range of the register map holding a register
+ * @return index of the range, -1 if the register is not in the map
+ */
+static int find_range(const MODBUS_CLIENT * client, uint16_t addr)
+{
+    const MODBUS_REGISTER_RANGE *range;
+    int low = 0;
+    int high = client->num_ranges;
+    int mid;
+
+    while (low < high) {
+        mid = (low + high) / 2;
+        range = &client->register_map[mid];
+        if (addr < range->start) {
+            high = mid;
+        } else if (addr >= ((uint32_t) range->start + range->num)) {
+            low = mid + 1;
+        } else {
+            return mid;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Checks a block of registers is covered by adjacent ranges of the map with the given access
+ * @return true if the whole block can be accessed
+ */
+static bool check_map_access(const MODBUS_CLIENT * client, uint16_t addr, uint16_t num, uint8_t access)
+{
+    const MODBUS_REGISTER_RANGE *range;
+    uint32_t pos = addr;
+    uint32_t end = (uint32_t) addr + num;
+    int first;
+    int i;
+
+    first = find_range(client, addr);
+    if (first < 0) {
+        return false;
+    }
+
+    for (i = first; i < client->num_ranges; i++) {
+        range = &client->register_map[i];
+        /* The block continues in the next range only if there is no gap */
+        if ((i != first) && (range->start != pos)) {
+            return false;
+        }
+        if ((range->access & access) == 0) {
+            return false;
+        }
+        pos = (uint32_t) range->start + range->num;
+        if (pos >= end) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Reads a block of holding registers from the register map or the callback
+ * @return MODBUS_EXCEPTION_NONE on success, the exception to answer otherwise
+ */
+static MODBUS_EXCEPTION read_holding_registers(MODBUS_CLIENT * client, uint16_t addr, uint16_t num, uint16_t * data)
+{
+    const MODBUS_REGISTER_RANGE *range;
+    uint32_t pos = addr;
+    uint32_t count;
+    int i;
+
+    if (client->register_map == NULL) {
+        if (client->read_registers_cb(addr, num, data) == false) {
+            return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+        }
+        return MODBUS_EXCEPTION_NONE;
+    }
+
+    if (check_map_access(client, addr, num, MODBUS_ACCESS_READ) == false) {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    }
+
+    for (i = find_range(client, addr); num > 0; i++) {
+        range = &client->register_map[i];
+        count = (uint32_t) range->start + range->num - pos;
+        if (count > num) {
+            count = num;
+        }
+        if (range->bank != NULL) {
+            if (read_bank(range->bank, pos - range->start, count, data) == false) {
+                client->counters.busy++;
+                return MODBUS_EXCEPTION_SLAVE_DEVICE_BUSY;
+            }
+        } else {
+            memcpy(data, &range->storage[pos - range->start], count * sizeof(uint16_t));
+        }
+        data += count;
+        pos += count;
+        num -= count;
+    }
+
+    return MODBUS_EXCEPTION_NONE;
+}
+
+#if MODBUS_FC3_CACHE
+/**
+ * Tells if a function 3 response can be kept: the block read only comes from map
+ * storage, whose changes are all reported by MODBUS_MarkRegistersDirty()
+ * @return false if the callbacks or a bank gave any of its registers
+ */
+static bool is_cacheable(const MODBUS_CLIENT * client, uint16_t addr, uint16_t num)
+{
+    const MODBUS_REGISTER_RANGE *range;
+    uint32_t end = (uint32_t) addr + num;
+    int i;
+
+    if (client->register_map == NULL) {
+        return false;
+    }
+
+    /* The block was read, so the ranges from its first register cover it */
+    for (i = find_range(client, addr); i < client->num_ranges; i++) {
+        range = &client->register_map[i];
+        if (range->bank != NULL) {
+            return false;
+        }
+        if (((uint32_t) range->start + range->num) >= end) {
+            break;
+        }
+    }
+
+    return true;
+}
+#endif
+
+/**
+ * Copies a block of registers from the front copy of a bank, all from the same update
+ * @param first first register in the bank
+ * @return true on success, false if the producer kept overwriting the copy being read
+ */
+static bool read_bank(const MODBUS_REGISTER_BANK * bank, uint16_t first, uint16_t num, uint16_t * data)
+{
+    uint32_t published;
+    int i;
+
+    for (i = 0; i < MODBUS_BANK_RETRIES; i++) {
+        published = bank->published;
+        __DMB();
+        memcpy(data, &bank->buffers[published & 1][first], num * sizeof(uint16_t));
+        __DMB();
+
+        /* The copy read is only overwritten by the update after the next one */
+        if ((bank->writing - published) <= 1) {
+            return true;
+        }
+    }
+
+    return false;
 }
 
-uint16_t CRC16(const uint8_t * nData, uint16_t wLength)
-{
-    static const uint16_t wCRCTable[] = {
-        0X0000, 0XC0C1, 0XC181, 0X0140, 0XC301, 0X03C0, 0X0280, 0XC241,
-        0XC601, 0X06C0, 0X0780, 0XC741, 0X0500, 0XC5C1, 0XC481, 0X0440,
-        0XCC01, 0X0CC0, 0X0D80, 0XCD41, 0X0F00, 0XCFC1, 0XCE81, 0X0E40,
-        0X0A00, 0XCAC1, 0XCB81, 0X0B40, 0XC901, 0X09C0, 0X0880, 0XC841,
-        0XD801, 0X18C0, 0X1980, 0XD941, 0X1B00, 0XDBC1, 0XDA81, 0X1A40,
-        0X1E00, 0XDEC1, 0XDF81, 0X1F40, 0XDD01, 0X1DC0, 0X1C80, 0XDC41,
-        0X1400, 0XD4C1, 0XD581, 0X1540, 0XD701, 0X17C0, 0X1680, 0XD641,
-        0XD201, 0X12C0, 0X1380, 0XD341, 0X1100, 0XD1C1, 0XD081, 0X1040,
-        0XF001, 0X30C0, 0X3180, 0XF141, 0X3300, 0XF3C1, 0XF281, 0X3240,
-        0X3600, 0XF6C1, 0XF781, 0X3740, 0XF501, 0X35C0, 0X3480, 0XF441,
-        0X3C00, 0XFCC1, 0XFD81, 0X3D40, 0XFF01, 0X3FC0, 0X3E80, 0XFE41,
-        0XFA01, 0X3AC0, 0X3B80, 0XFB41, 0X3900, 0XF9C1, 0XF881, 0X3840,
-        0X2800, 0XE8C1, 0XE981, 0X2940, 0XEB01, 0X2BC0, 0X2A80, 0XEA41,
-        0XEE01, 0X2EC0, 0X2F80, 0XEF41, 0X2D00, 0XEDC1, 0XEC81, 0X2C40,
-        0XE401, 0X24C0, 0X2580, 0XE541, 0X2700, 0XE7C1, 0XE681, 0X2640,
-        0X2200, 0XE2C1, 0XE381, 0X2340, 0XE101, 0X21C0, 0X2080, 0XE041,
-        0XA001, 0X60C0, 0X6180, 0XA141, 0X6300, 0XA3C1, 0XA281, 0X6240,
-        0X6600, 0XA6C1, 0XA781, 0X6740, 0XA501, 0X65C0, 0X6480, 0XA441,
-        0X6C00, 0XACC1, 0XAD81, 0X6D40, 0XAF01, 0X6FC0, 0X6E80, 0XAE41,
-        0XAA01, 0X6AC0, 0X6B80, 0XAB41, 0X6900, 0XA9C1, 0XA881, 0X6840,
-        0X7800, 0XB8C1, 0XB981, 0X7940, 0XBB01, 0X7BC0, 0X7A80, 0XBA41,
-        0XBE01, 0X7EC0, 0X7F80, 0XBF41, 0X7D00, 0XBDC1, 0XBC81, 0X7C40,
-        0XB401, 0X74C0, 0X7580, 0XB541, 0X7700, 0XB7C1, 0XB681, 0X7640,
-        0X7200, 0XB2C1, 0XB381, 0X7340, 0XB101, 0X71C0, 0X7080, 0XB041,
-        0X5000, 0X90C1, 0X9181, 0X5140, 0X9301, 0X53C0, 0X5280, 0X9241,
-        0X9601, 0X56C0, 0X5780, 0X9741, 0X5500, 0X95C1, 0X9481, 0X5440,
-        0X9C01, 0X5CC0, 0X5D80, 0X9D41, 0X5F00, 0X9FC1, 0X9E81, 0X5E40,
-        0X5A00, 0X9AC1, 0X9B81, 0X5B40, 0X9901, 0X59C0, 0X5880, 0X9841,
-        0X8801, 0X48C0, 0X4980, 0X8941, 0X4B00, 0X8BC1, 0X8A81, 0X4A40,
-        0X4E00, 0X8EC1, 0X8F81, 0X4F40, 0X8D01, 0X4DC0, 0X4C80, 0X8C41,
-        0X4400, 0X84C1, 0X8581, 0X4540, 0X8701, 0X47C0, 0X4680, 0X8641,
-        0X8201, 0X42C0, 0X4380, 0X8341, 0X4100, 0X81C1, 0X8081, 0X4040
-    };
-
-    uint8_t nTemp;
-    uint16_t wCRCWord = 0xFFFF;
-
-    while (wLength--) {
-        nTemp = *nData++ ^ wCRCWord;
-        wCRCWord >>= 8;
-        wCRCWord ^= wCRCTable[nTemp];
-    }
-    return wCRCWord;
+/**
+ * Writes a block of holding registers to the register map or the callback. With
+ * a map nothing is written unless the whole block can be.
+ * @return true on success, false if the block is not valid
+ */
+static bool write_holding_registers(MODBUS_CLIENT * client, uint16_t addr, uint16_t num, const uint16_t * data)
+{
+    const MODBUS_REGISTER_RANGE *range;
+    uint32_t pos = addr;
+    uint32_t count;
+    int i;
+
+    MODBUS_MarkRegistersDirty(client);
+
+    if (client->register_map == NULL) {
+        return client->write_registers_cb(addr, num, data);
+    }
+
+    if (check_map_access(client, addr, num, MODBUS_ACCESS_WRITE) == false) {
+        return false;
+    }
+
+    for (i = find_range(client, addr); num > 0; i++) {
+        range = &client->register_map[i];
+        count = (uint32_t) range->start + range->num - pos;
+        if (count > num) {
+            count = num;
+        }
+        memcpy(&range->storage[pos - range->start], data, count * sizeof(uint16_t));
+        if (range->on_write != NULL) {
+            range->on_write(pos, count);
+        }
+        data += count;
+        pos += count;
+        num -= count;
+    }
+
+    return true;
+}
+
+void usart_event(MODBUS_CLIENT * client, uint32_t event)
+{
+
+    if (event & ARM_USART_EVENT_RECEIVE_COMPLETE) {
+        client->data_received = true;
+    }
+
+    if (event & ARM_USART_EVENT_RX_OVERFLOW) {
+        client->rx_overflow = true;
+    }
+
+    /* Line turned around, be ready for the next request */
+    if ((event & client->tx_done_event) && (client->state == MODBUS_STATE_SENDING)) {
+        arm_reception(client);
+    }
+}
+
+/* CMSIS event callbacks carry no context, one callback per client slot */
+static void usart_event_0(uint32_t event)
+{
+    usart_event(clients[0], event);
+}
+
+#if (MODBUS_MAX_CLIENTS > 1)
+static void usart_event_1(uint32_t event)
+{
+    usart_event(clients[1], event);
+}
+#endif
+
+#if (MODBUS_MAX_CLIENTS > 2)
+static void usart_event_2(uint32_t event)
+{
+    usart_event(clients[2], event);
+}
+#endif
+
+#if (MODBUS_MAX_CLIENTS > 3)
+static void usart_event_3(uint32_t event)
+{
+    usart_event(clients[3], event);
+}
+#endif
+
+MODBUS_EXCEPTION process_function_1(MODBUS_CLIENT * client, uint8_t * buff)
+{
+    return send_bits(client, buff, client->coils, client->num_coils);
+}
+
+MODBUS_EXCEPTION process_function_2(MODBUS_CLIENT * client, uint8_t * buff)
+{
+    return send_bits(client, buff, client->discrete_inputs, client->num_discrete_inputs);
+}
+
+/**
+ * Builds and sends a response with a block of bits (functions 1 & 2)
+ * @param client client context
+ * @param buff request
+ * @param bits bit-packed array to read
+ * @param num_bits number of bits in the array
+ * @return MODBUS_EXCEPTION_NONE on success, the exception to answer otherwise
+ */
+static MODBUS_EXCEPTION send_bits(MODBUS_CLIENT * client, uint8_t * buff, const uint32_t * bits, uint16_t num_bits)
+{
+    uint16_t num;
+    uint16_t addr_start;
+    uint32_t chunk;
+    uint32_t value;
+    uint32_t i;
+    uint32_t j;
+
+    read_bits_t *pkt = (read_bits_t *) buff;
+    read_bits_response_t *pkt_resp = (read_bits_response_t *) buff;
+
+    addr_start = (pkt->start_addr_hi << 8) | pkt->start_addr_lo;
+    num = (pkt->bits_num_hi << 8) | pkt->bits_num_lo;
+
+    if (bits == NULL) {
+        return MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
+    }
+
+    if ((num == 0) || (num > MAX_READ_BITS)) {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+    }
+
+    if ((addr_start + num) > num_bits) {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    }
+
+    pkt_resp->address = pkt->address;
+    pkt_resp->function = pkt->function;
+    pkt_resp->byte_count = (num + 7) / 8;
+
+    /* Pack 32 bits at a time, the last byte is padded with zeros */
+    for (i = 0; i < num; i += 32) {
+        chunk = ((num - i) < 32) ? (num - i) : 32;
+        value = get_bits(bits, addr_start + i, chunk);
+        for (j = 0; j < chunk; j += 8) {
+            pkt_resp->data[(i + j) / 8] = value >> j;
+        }
+    }
+
+    /* Insert CRC to the response packet */
+    uint16_t crc_res_pkt = CRC16((uint8_t *) pkt_resp, 3 + pkt_resp->byte_count);
+    pkt_resp->data[pkt_resp->byte_count] = crc_res_pkt & 0x00FF;
+    pkt_resp->data[pkt_resp->byte_count + 1] = crc_res_pkt >> 8;
+
+    if (send_response(client, pkt_resp, 5 + pkt_resp->byte_count) == false) {
+        return MODBUS_EXCEPTION_SLAVE_DEVICE_FAILURE;
+    }
+
+    return MODBUS_EXCEPTION_NONE;
+}
+
+MODBUS_EXCEPTION process_function_3(MODBUS_CLIENT * client, uint8_t * buff)
+{
+    uint16_t num_registers;
+    uint16_t addr_start;
+#if MODBUS_FC3_CACHE
+    MODBUS_EXCEPTION exception;
+    uint32_t generation;
+#endif
+
+    read_holding_register_t *pkt = (read_holding_register_t *) buff;
+
+    num_registers = (pkt->regs_num_hi << 8) | pkt->regs_num_lo;
+    addr_start = (pkt->start_addr_hi << 8) | pkt->start_addr_lo;
+
+#if MODBUS_FC3_CACHE
+    generation = client->generation;
+
+    /* Same block polled again and nothing written since: send the previous response */
+    if ((client->cache_len != 0) && (client->cache_generation == generation) && (client->cache_address == pkt->address)
+        && (client->cache_addr == addr_start) && (client->cache_num == num_registers)) {
+        if (send_response(client, client->cache_buf, client->cache_len) == false) {
+            return MODBUS_EXCEPTION_SLAVE_DEVICE_FAILURE;
+        }
+        return MODBUS_EXCEPTION_NONE;
+    }
+
+    exception = send_registers(client, pkt->address, pkt->function, addr_start, num_registers);
+
+    /* Not kept if the registers changed while being read */
+    if ((exception == MODBUS_EXCEPTION_NONE) && (generation == client->generation)
+        && is_cacheable(client, addr_start, num_registers)) {
+        client->cache_len = 5 + (num_registers * 2);
+        memcpy(client->cache_buf, client->recv_buf, client->cache_len);
+        client->cache_address = pkt->address;
+        client->cache_addr = addr_start;
+        client->cache_num = num_registers;
+        client->cache_generation = generation;
+    }
+
+    return exception;
+#else
+    return send_registers(client, pkt->address, pkt->function, addr_start, num_registers);
+#endif
+}
+
+MODBUS_EXCEPTION process_function_4(MODBUS_CLIENT * client, uint8_t * buff)
+{
+    uint16_t num_registers;
+    uint16_t addr_start;
+    uint16_t aux;
+    int i;
+
+    read_holding_register_t *pkt = (read_holding_register_t *) buff;
+    read_holding_register_response_t *pkt_resp = (read_holding_register_response_t *) buff;
+
+    num_registers = (pkt->regs_num_hi << 8) | pkt->regs_num_lo;
+    addr_start = (pkt->start_addr_hi << 8) | pkt->start_addr_lo;
+
+    if (client->input_registers == NULL) {
+        return MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
+    }
+
+    if ((num_registers == 0) || (num_registers > MAX_READ_REGS)) {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+    }
+
+    if ((addr_start + num_registers) > client->num_input_registers) {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    }
+
+    pkt_resp->address = pkt->address;
+    pkt_resp->function = pkt->function;
+    pkt_resp->byte_count = num_registers * 2;
+
+    /* Serialize straight from the application buffer to big endian */
+    const volatile uint16_t *regs = &client->input_registers[addr_start];
+    for (i = 0; i < num_registers; i++) {
+        aux = regs[i];
+        pkt_resp->data[i * 2] = aux >> 8;
+        pkt_resp->data[(i * 2) + 1] = aux & 0x00FF;
+    }
+
+    /* Insert CRC to the response packet */
+    uint16_t crc_res_pkt = CRC16((uint8_t *) pkt_resp, 3 + (num_registers * 2));
+    pkt_resp->data[i * 2] = crc_res_pkt & 0x00FF;
+    pkt_resp->data[(i * 2) + 1] = crc_res_pkt >> 8;
+
+    if (send_response(client, pkt_resp, 5 + (num_registers * 2)) == false) {
+        return MODBUS_EXCEPTION_SLAVE_DEVICE_FAILURE;
+    }
+
+    return MODBUS_EXCEPTION_NONE;
+}
+
+/**
+ * Builds and sends a response with a block of registers (functions 3 & 23)
+ * @param client client context
+ * @param address slave address for the response
+ * @param function function code for the response
+ * @param addr_start first register to read
+ * @param num_registers number of registers to read
+ * @return MODBUS_EXCEPTION_NONE on success, the exception to answer otherwise
+ */
+static MODBUS_EXCEPTION send_registers(MODBUS_CLIENT * client, uint8_t address, uint8_t function,
+                                       uint16_t addr_start, uint16_t num_registers)
+{
+    int i;
+    MODBUS_EXCEPTION exception;
+    read_holding_register_response_t *pkt_resp = (read_holding_register_response_t *) client->recv_buf;
+
+    /* The whole answer must fit in recv_buf */
+    if ((num_registers == 0) || (num_registers > MAX_READ_REGS)) {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+    }
+
+    pkt_resp->address = address;
+    pkt_resp->function = function;
+
+    /* Registers are read as a block in the aligned word following byte_count and then
+     * swapped in place to big endian one byte backwards (each write only touches bytes
+     * already consumed) */
+    uint16_t *regs = (uint16_t *) &client->recv_buf[4];
+    exception = read_holding_registers(client, addr_start, num_registers, regs);
+    if (exception != MODBUS_EXCEPTION_NONE) {
+        return exception;
+    }
+
+    pkt_resp->byte_count = num_registers * 2;
+    uint16_t aux;
+    for (i = 0; i < num_registers; i++) {
+        aux = regs[i];
+        pkt_resp->data[i * 2] = aux >> 8;
+        pkt_resp->data[(i * 2) + 1] = aux & 0x00FF;
+    }
+
+    /* Insert CRC to the response packet */
+    uint16_t crc_res_pkt = CRC16((uint8_t *) pkt_resp, 3 + (num_registers * 2));
+    pkt_resp->data[i * 2] = crc_res_pkt & 0x00FF;
+    pkt_resp->data[(i * 2) + 1] = crc_res_pkt >> 8;
+
+    if (send_response(client, pkt_resp, 5 + (num_registers * 2)) == false) {
+        return MODBUS_EXCEPTION_SLAVE_DEVICE_FAILURE;
+    }
+
+    return MODBUS_EXCEPTION_NONE;
+}
+
+MODBUS_EXCEPTION process_function_5(MODBUS_CLIENT * client, uint8_t * buff)
+{
+    uint16_t value;
+    uint16_t addr_start;
+    write_single_register_t *pkt = (write_single_register_t *) buff;
+
+    addr_start = (pkt->start_addr_hi << 8) | pkt->start_addr_lo;
+    value = (pkt->wr_data_hi << 8) | pkt->wr_data_lo;
+
+    if (client->coils == NULL) {
+        return MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
+    }
+
+    if ((value != COIL_ON) && (value != COIL_OFF)) {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+    }
+
+    if (addr_start >= client->num_coils) {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    }
+
+    set_bits(client->coils, addr_start, (value == COIL_ON) ? 1 : 0, 1);
+
+    if (send_response(client, buff, 8) == false) {
+        return MODBUS_EXCEPTION_SLAVE_DEVICE_FAILURE;
+    }
+
+    return MODBUS_EXCEPTION_NONE;
+}
+
+MODBUS_EXCEPTION process_function_6(MODBUS_CLIENT * client, uint8_t * buff)
+{
+    uint16_t wr_data;
+    uint16_t addr_start;
+    write_single_register_t *pkt = (write_single_register_t *) buff;
+
+    addr_start = (pkt->start_addr_hi << 8) | pkt->start_addr_lo;
+    wr_data = (pkt->wr_data_hi << 8) | pkt->wr_data_lo;
+
+    if (write_holding_registers(client, addr_start, 1, &wr_data) == false) {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    }
+
+    if (send_response(client, buff, 8) == false) {
+        return MODBUS_EXCEPTION_SLAVE_DEVICE_FAILURE;
+    }
+
+    return MODBUS_EXCEPTION_NONE;
+}
+
+MODBUS_EXCEPTION process_function_8(MODBUS_CLIENT * client, uint8_t * buff)
+{
+    uint16_t sub_function;
+    uint16_t data;
+    uint16_t value;
+    diagnostics_t *pkt = (diagnostics_t *) buff;
+
+    sub_function = (pkt->sub_function_hi << 8) | pkt->sub_function_lo;
+    data = (pkt->data_hi << 8) | pkt->data_lo;
+
+    /* The request is echoed back */
+    if (sub_function == DIAG_RETURN_QUERY_DATA) {
+        if (send_response(client, buff, client->rx_count) == false) {
+            return MODBUS_EXCEPTION_SLAVE_DEVICE_FAILURE;
+        }
+        return MODBUS_EXCEPTION_NONE;
+    }
+
+    if (client->rx_count != 8) {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+    }
+
+    if (sub_function == DIAG_RESTART_COMM) {
+        if ((data != 0x0000) && (data != 0xFF00)) {
+            return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+        }
+    } else if (data != 0x0000) {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+    }
+
+    switch (sub_function) {
+    case DIAG_RESTART_COMM:
+        client->listen_only = false;
+        MODBUS_ClearCounters(client);
+        value = data;
+        break;
+    case DIAG_RETURN_REGISTER:
+        value = 0;
+        break;
+    case DIAG_FORCE_LISTEN_ONLY:
+        /* No response for this one */
+        client->listen_only = true;
+        value = data;
+        break;
+    case DIAG_CLEAR_COUNTERS:
+        MODBUS_ClearCounters(client);
+        value = data;
+        break;
+    case DIAG_BUS_MESSAGES:
+        value = client->counters.bus_messages;
+        break;
+    case DIAG_BUS_COMM_ERRORS:
+        value = client->counters.bus_comm_errors;
+        break;
+    case DIAG_EXCEPTIONS:
+        value = client->counters.exceptions;
+        break;
+    case DIAG_SLAVE_MESSAGES:
+        value = client->counters.slave_messages;
+        break;
+    case DIAG_NO_RESPONSE:
+        value = client->counters.no_response;
+        break;
+    case DIAG_NAK:
+        value = client->counters.nak;
+        break;
+    case DIAG_BUSY:
+        value = client->counters.busy;
+        break;
+    case DIAG_CHAR_OVERRUNS:
+        value = client->counters.char_overruns;
+        break;
+    case DIAG_CLEAR_OVERRUNS:
+        client->counters.char_overruns = 0;
+        value = data;
+        break;
+    default:
+        return MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
+    }
+
+    /* Response built in place, same layout as the request */
+    pkt->data_hi = value >> 8;
+    pkt->data_lo = value & 0x00FF;
+
+    uint16_t crc_res_pkt = CRC16(buff, 6);
+    pkt->crc_lo = crc_res_pkt & 0x00FF;
+    pkt->crc_hi = crc_res_pkt >> 8;
+
+    if (send_response(client, buff, 8) == false) {
+        return MODBUS_EXCEPTION_SLAVE_DEVICE_FAILURE;
+    }
+
+    return MODBUS_EXCEPTION_NONE;
+}
+
+MODBUS_EXCEPTION process_function_15(MODBUS_CLIENT * client, uint8_t * buff)
+{
+    uint16_t num;
+    uint16_t addr_start;
+    uint32_t chunk;
+    uint32_t value;
+    uint32_t i;
+    uint32_t j;
+
+    write_multiple_coils_t *pkt = (write_multiple_coils_t *) buff;
+    write_multiple_coils_response_t *pkt_resp = (write_multiple_coils_response_t *) buff;
+
+    addr_start = (pkt->start_addr_hi << 8) | pkt->start_addr_lo;
+    num = (pkt->bits_num_hi << 8) | pkt->bits_num_lo;
+
+    if (client->coils == NULL) {
+        return MODBUS_EXCEPTION_ILLEGAL_FUNCTION;
+    }
+
+    if ((num == 0) || (num > MAX_WRITE_BITS) || (pkt->byte_count != ((num + 7) / 8))) {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+    }
+
+    if ((addr_start + num) > client->num_coils) {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    }
+
+    /* Unpack 32 bits at a time */
+    for (i = 0; i < num; i += 32) {
+        chunk = ((num - i) < 32) ? (num - i) : 32;
+        value = 0;
+        for (j = 0; j < chunk; j += 8) {
+            value |= (uint32_t) pkt->data[(i + j) / 8] << j;
+        }
+        set_bits(client->coils, addr_start + i, value, chunk);
+    }
+
+    /* The response is the request header, only the CRC replaces byte_count */
+    uint16_t crc_res_pkt = CRC16((uint8_t *) pkt_resp, 6);
+    pkt_resp->crc_lo = crc_res_pkt & 0x00FF;
+    pkt_resp->crc_hi = crc_res_pkt >> 8;
+
+    if (send_response(client, pkt_resp, 8) == false) {
+        return MODBUS_EXCEPTION_SLAVE_DEVICE_FAILURE;
+    }
+
+    return MODBUS_EXCEPTION_NONE;
+}
+
+MODBUS_EXCEPTION process_function_16(MODBUS_CLIENT * client, uint8_t * buff)
+{
+    uint16_t addr_start;
+    uint16_t num_registers;
+    int i;
+    uint16_t wr_data;
+    uint16_t *regs;
+
+    write_multiple_register_t *pkt = (write_multiple_register_t *) buff;
+
+    write_multiple_register_response_t *pkt_resp = (write_multiple_register_response_t *) buff;
+
+    addr_start = (pkt->start_addr_hi << 8) | pkt->start_addr_lo;
+    num_registers = (pkt->regs_num_hi << 8) | pkt->regs_num_lo;
+
+    if ((num_registers == 0) || (num_registers > MAX_WRITE_REGS) || (pkt->byte_count != (num_registers * 2))) {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE;
+    }
+
+    /* Convert the data to host order in place, in the aligned word at byte_count.
+     * Each write only touches bytes already consumed, header fields stay intact */
+    regs = (uint16_t *) &buff[6];
+    for (i = 0; i < num_registers; i++) {
+        wr_data = (pkt->data[i * 2] << 8) | pkt->data[(i * 2) + 1];
+        regs[i] = wr_data;
+    }
+
+    if (write_holding_registers(client, addr_start, num_registers, regs) == false) {
+        return MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    }
+
+    /* The response is the request header, kept intact by the conversion above */
+    uint16_t crc_res_pkt = CRC16((uint8_t *) pkt_resp, 6);
+    pkt_resp->crc_lo = crc_res_pkt & 0x00FF;
+    pkt_resp->crc_hi = crc_res_pkt >> 8;
+
+    if (send_response(client, pkt_resp, 8) == false) {
+        return MODBUS_EXCEPTION_SLAVE_DEVICE_FAILURE;
+    }
 
+    return MODBUS_EXCEPTION_NONE;
 }
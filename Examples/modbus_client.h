@@ -21,18 +21,355 @@
  */
 
 #include <stdbool.h>
+#include "cmsis_compiler.h"
 #include "Driver_USART.h"
+#include "modbus_line.h"
+
+/* USART driver specific control (see the EFM32 and STM32 drivers): RS-485 transceiver driver
+ * enable, released by the driver as soon as the last stop bit is sent */
+#ifndef ARM_USART_CONTROL_RS485
+#define ARM_USART_CONTROL_RS485 (0x80UL << ARM_USART_CONTROL_Pos)
+#endif
+
+/* Maximum number of clients (serial ports) served at once, up to 4 */
+#ifndef MODBUS_MAX_CLIENTS
+#define MODBUS_MAX_CLIENTS (2)
+#endif
+
+/* Keep the last function 3 response to answer repeated polls of the same block
+ * without reading the registers again (1 to enable, costs a response buffer per client).
+ * Only for blocks in register map storage, never the callbacks or banks */
+#ifndef MODBUS_FC3_CACHE
+#define MODBUS_FC3_CACHE (0)
+#endif
+
+/* MODBUS ASCII transport support (1 to enable, costs a buffer of twice the frame size per client) */
+#ifndef MODBUS_ASCII
+#define MODBUS_ASCII (0)
+#endif
+
+/* A MODBUS ASCII frame is dropped after this time without characters, in getSysTicks() units */
+#ifndef MODBUS_ASCII_TIMEOUT
+#define MODBUS_ASCII_TIMEOUT (1000)
+#endif
+
+#define MODBUS_MAX_RECV_BUFF (254+9)   /* Largest request, responses are built in the same buffer */
+#define MODBUS_MAX_SEND_BUFF (256)      /* Maximum RTU ADU size */
+#define MODBUS_ASCII_MAX_BUFF (1 + (2 * MODBUS_MAX_RECV_BUFF) + 2)     /* ':', two hex digits per byte, CR LF */
+
+/* MODBUS_Poll() result */
+typedef enum {
+    MODBUS_POLL_IDLE,           /* Nothing received */
+    MODBUS_POLL_BUSY,           /* A frame is being received */
+    MODBUS_POLL_DONE,           /* A request was processed and answered */
+    MODBUS_POLL_DROPPED,        /* A frame was received but dropped */
+    MODBUS_POLL_IGNORED,        /* A frame for another slave (or a broadcast read) was skipped */
+    MODBUS_POLL_EXCEPTION,      /* A request was answered with an exception */
+} MODBUS_POLL_STATUS;
+
+/* MODBUS exception codes */
+typedef enum {
+    MODBUS_EXCEPTION_NONE = 0,
+    MODBUS_EXCEPTION_ILLEGAL_FUNCTION = 1,
+    MODBUS_EXCEPTION_ILLEGAL_DATA_ADDRESS = 2,
+    MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE = 3,
+    MODBUS_EXCEPTION_SLAVE_DEVICE_FAILURE = 4,
+    MODBUS_EXCEPTION_SLAVE_DEVICE_BUSY = 6,
+} MODBUS_EXCEPTION;
+
+/* Slave address value to answer every frame, whatever its address */
+#define MODBUS_ADDRESS_ANY (0)
+
+/* Slave address of broadcast frames, applied by all slaves and never answered */
+#define MODBUS_ADDRESS_BROADCAST (0)
+
+/* Client state */
+typedef enum {
+    MODBUS_STATE_IDLE,          /* Reception not armed */
+    MODBUS_STATE_RECEIVING,     /* Reception armed, waiting for bytes or silence */
+    MODBUS_STATE_SKIPPING,      /* Frame for another slave, waiting for silence */
+    MODBUS_STATE_SENDING,       /* Sending a response, reception armed when it ends */
+} MODBUS_CLIENT_STATE;
+
+/**
+ * Reads a block of consecutive holding registers
+ * @param addr first register address
+ * @param num number of registers to read
+ * @param data buffer to fill with the register values (host order)
+ * @return true on success, false if the block is not valid (answered with an illegal data address exception)
+ */
+typedef bool (*MODBUS_ReadRegisters_t)(uint16_t addr, uint16_t num, uint16_t * data);
+
+/**
+ * Writes a block of consecutive holding registers. The whole block is passed
+ * at once, so the application can apply it atomically.
+ * @param addr first register address
+ * @param num number of registers to write
+ * @param data register values (host order)
+ * @return true on success, false if the block is not valid (answered with an illegal data address exception)
+ */
+typedef bool (*MODBUS_WriteRegisters_t)(uint16_t addr, uint16_t num, const uint16_t * data);
+
+/* Access rights of a register range */
+#define MODBUS_ACCESS_READ (0x01)
+#define MODBUS_ACCESS_WRITE (0x02)
+#define MODBUS_ACCESS_READ_WRITE (MODBUS_ACCESS_READ | MODBUS_ACCESS_WRITE)
+
+/**
+ * Called once a request has written to a register range
+ * @param addr first register written
+ * @param num number of registers written (all inside the range)
+ */
+typedef void (*MODBUS_RegistersWritten_t)(uint16_t addr, uint16_t num);
+
+/* Times a block is read again from a register bank that changed while being read */
+#ifndef MODBUS_BANK_RETRIES
+#define MODBUS_BANK_RETRIES (4)
+#endif
+
+/**
+ * Double-buffered registers published by the application as a whole, so MODBUS
+ * reads never mix values from two updates (i.e. both halves of a 32-bit value
+ * come from the same update). The producer fills the back copy between
+ * MODBUS_Bank_BeginUpdate() and MODBUS_Bank_Publish(), readers copy the front one.
+ * No interrupts are disabled: a read is retried if the producer starts to overwrite
+ * its copy (two updates published while it was reading).
+ */
+typedef struct {
+    uint16_t *buffers[2];       /* The two copies, in host order */
+    uint16_t num;               /* Registers in each copy */
+    volatile uint32_t published;        /* Updates published, buffers[published & 1] is the front copy */
+    volatile uint32_t writing;  /* Update being written (published + 1 while writing, published otherwise) */
+} MODBUS_REGISTER_BANK;
+
+/* Consecutive holding registers backed by application storage, an entry of a register map */
+typedef struct {
+    uint16_t start;             /* First register address */
+    uint16_t num;               /* Number of registers */
+    uint16_t *storage;          /* Register values in host order, storage[0] is register 'start' */
+    uint8_t access;             /* MODBUS_ACCESS_ flags, other accesses are answered with an exception */
+    MODBUS_RegistersWritten_t on_write; /* Optional, NULL if not needed */
+    MODBUS_REGISTER_BANK *bank; /* Instead of storage, register 'start' is the first of the bank. Read only */
+} MODBUS_REGISTER_RANGE;
+
+/* Diagnostic counters (MODBUS function 8), 16 bits wide and wrapping as the specification defines */
+typedef struct {
+    uint16_t bus_messages;      /* Frames detected on the bus, for any slave */
+    uint16_t bus_comm_errors;   /* Frames dropped (CRC error or bad length) */
+    uint16_t exceptions;        /* Exception responses */
+    uint16_t slave_messages;    /* Requests for this slave (or broadcast) processed */
+    uint16_t no_response;       /* Requests processed without answer (broadcast, listen only mode) */
+    uint16_t nak;               /* Negative acknowledges, this client never sends them */
+    uint16_t busy;              /* Slave busy exceptions (a register bank kept changing while being read) */
+    uint16_t char_overruns;     /* Frames longer than the reception buffer, or driver overflows */
+} MODBUS_COUNTERS;
+
+/**
+ * MODBUS client context, one per serial port. The application allocates it
+ * (zero initialized, i.e. static) and only accesses it through the MODBUS_ functions.
+ */
+typedef struct {
+    ARM_DRIVER_USART *usart_drv;
+    /* Aligned, register blocks are exchanged with the application inside it. The
+     * request is received and then overwritten with its response */
+    uint8_t recv_buf[MODBUS_MAX_RECV_BUFF] __ALIGNED(4);
+#if MODBUS_ASCII
+    uint8_t ascii_buf[MODBUS_ASCII_MAX_BUFF];   /* MODBUS ASCII frame, decoded into recv_buf and encoded from it */
+#endif
+    uint8_t skip_buf[16];       /* Foreign frames are received here and discarded, and the carried bytes kept */
+    MODBUS_ReadRegisters_t read_registers_cb;
+    MODBUS_WriteRegisters_t write_registers_cb;
+    const MODBUS_REGISTER_RANGE *register_map; /* Sorted by address, NULL to use the callbacks */
+    uint16_t num_ranges;
+    uint32_t *coils;            /* Bit-packed coils, NULL if not supported */
+    uint16_t num_coils;
+    const uint32_t *discrete_inputs;    /* Bit-packed discrete inputs, NULL if not supported */
+    uint16_t num_discrete_inputs;
+    const volatile uint16_t *input_registers;   /* Input registers in host order, NULL if not supported */
+    uint16_t num_input_registers;
+    uint8_t own_address;        /* MODBUS_ADDRESS_ANY answers all frames */
+    volatile MODBUS_CLIENT_STATE state;
+    volatile bool data_received;
+    volatile bool rx_overflow;  /* Driver overflow, counted by MODBUS_Poll() */
+    MODBUS_LINE_CONFIG line;    /* Current settings, line.autobaud is set while the rate is not known */
+    uint8_t autobaud_index;     /* Rate being tried while detecting it */
+    uint32_t silence_us;        /* Inter-frame silence (t3.5) in getSysMicros() units */
+    uint32_t char_us;           /* Character time in getSysMicros() units */
+    uint32_t tx_done_event;     /* Driver event signaling the line is free after a Send */
+    uint32_t rx_count;          /* Bytes received so far */
+    uint32_t rx_us;             /* Time the last received bytes were seen, in getSysMicros() units */
+    uint32_t rx_offset;         /* Bytes carried into recv_buf before the reception was armed */
+    uint32_t carry_len;         /* Bytes in skip_buf that start the next frame */
+    uint16_t rx_crc;            /* CRC of the received frame, computed while bytes arrive */
+    uint32_t tx_ticks;          /* Time the response Send started */
+    uint32_t tx_timeout;        /* Ticks the response may take before the transmission is given up */
+    bool listen_only;           /* Set by function 8, no responses until restarted */
+    MODBUS_COUNTERS counters;
+#if MODBUS_FC3_CACHE
+    uint8_t cache_buf[MODBUS_MAX_SEND_BUFF] __ALIGNED(4);      /* Last function 3 response, CRC included */
+    uint32_t cache_len;         /* 0 if empty */
+    uint8_t cache_address;      /* Request the response belongs to */
+    uint16_t cache_addr;
+    uint16_t cache_num;
+    uint32_t cache_generation;  /* Value of 'generation' when the response was built */
+    volatile uint32_t generation;       /* Incremented each time holding registers change */
+#endif
+} MODBUS_CLIENT;
 
 /**
  * Initializes MODBUS client
+ * With line->autobaud the standard rates (1200 to 230400 bps) are tried in turn,
+ * moving to the next one each time a frame fails its CRC check. The first valid
+ * frame locks the rate and is processed. Parity and stop bits are not detected.
+ * MODBUS_TRANSPORT_ASCII needs MODBUS_ASCII, frames are then decoded to binary
+ * and served by the same function handlers as RTU ones. The line then runs with
+ * 7 data bits and must be set to even or odd parity (7E1, 7O1, 7E2, 7O2) or to
+ * no parity and 2 stop bits (7N2); 7N1 is rejected. The USART driver has to
+ * support the chosen framing too. With line->rs485 the driver must accept
+ * ARM_USART_CONTROL_RS485, i.e. have its DE pin wired.
+ * @param client client context for this serial port
  * @param driver_usart CMSIS UART driver to use
- * @return true on success, false otherwise
+ * @param line serial line settings, NULL for MODBUS_LINE_CONFIG_DEFAULT (9600 8N1)
+ * @return true on success, false otherwise (i.e. more than MODBUS_MAX_CLIENTS clients, invalid settings,
+ *         RS-485 asked on a port without DE)
+ */
+bool MODBUS_Init(MODBUS_CLIENT * client, ARM_DRIVER_USART * driver_usart, const MODBUS_LINE_CONFIG * line);
+
+/**
+ * Gets the line rate, i.e. to store the detected one and use it from next boot
+ * @param client client context
+ * @return bits per second, 0 while auto-baud has not found the master's rate
+ */
+uint32_t MODBUS_GetBaudrate(const MODBUS_CLIENT * client);
+
+/**
+ * Sets the callbacks used to access holding registers. By default (or passing NULL)
+ * the MODBUS client calls, one register at a time, the application functions:
+ *   uint16_t read_register(uint16_t addr);
+ *   void write_register(uint16_t addr, uint16_t data);
+ * If the application does not define them, the accesses are answered with an
+ * illegal data address exception.
+ * @param client client context
+ * @param read_regs callback to read a block of registers
+ * @param write_regs callback to write a block of registers
  */
-bool MODBUS_Init(ARM_DRIVER_USART * driver_usart);
+void MODBUS_SetRegisterCallbacks(MODBUS_CLIENT * client, MODBUS_ReadRegisters_t read_regs,
+                                 MODBUS_WriteRegisters_t write_regs);
 
 /**
- * Waits for a MODBUS request and process it
- * @param timeout time to wait until return
+ * Sets a register map to serve the holding registers, instead of the callbacks.
+ * Each request is looked up with a binary search, a block may span adjacent ranges.
+ * Registers not in the map, or without the access needed, are answered with an
+ * illegal data address exception.
+ * @param client client context
+ * @param map ranges sorted by address, not overlapping. The client keeps the pointer. NULL to use the callbacks
+ * @param num_ranges number of ranges in the map
+ * @return true on success, false if the map is not valid (it is not set)
+ */
+bool MODBUS_SetRegisterMap(MODBUS_CLIENT * client, const MODBUS_REGISTER_RANGE * map, uint16_t num_ranges);
+
+/**
+ * Initializes a register bank, buffer0 is the front copy until the first update
+ * @param bank register bank
+ * @param buffer0 first copy of the registers
+ * @param buffer1 second copy of the registers
+ * @param num registers in each copy
+ */
+void MODBUS_Bank_Init(MODBUS_REGISTER_BANK * bank, uint16_t * buffer0, uint16_t * buffer1, uint16_t num);
+
+/**
+ * Starts an update of a register bank. Only one producer may update a bank.
+ * @param bank register bank
+ * @return back copy to fill, every register must be written (it holds an older update)
+ */
+uint16_t *MODBUS_Bank_BeginUpdate(MODBUS_REGISTER_BANK * bank);
+
+/**
+ * Publishes the update started with MODBUS_Bank_BeginUpdate(): MODBUS reads see
+ * all the new values at once. Function 3 responses reading a bank are never cached
+ * (MODBUS_FC3_CACHE), so this can be called from an interrupt without the client.
+ * @param bank register bank
+ */
+void MODBUS_Bank_Publish(MODBUS_REGISTER_BANK * bank);
+
+/**
+ * Tells the MODBUS client the application changed holding registers in the map
+ * storage, so a cached function 3 response is not served again (see MODBUS_FC3_CACHE).
+ * Writes done by MODBUS requests are tracked by the client. Can be called from
+ * interrupt context. Does nothing if the cache is disabled.
+ * @param client client context
+ */
+void MODBUS_MarkRegistersDirty(MODBUS_CLIENT * client);
+
+/**
+ * Sets the slave address. Frames addressed to other slaves are skipped as soon
+ * as their first byte is received. Broadcast writes are always applied.
+ * @param client client context
+ * @param address slave address (1 to 247), MODBUS_ADDRESS_ANY (default) to answer all frames
+ */
+void MODBUS_SetAddress(MODBUS_CLIENT * client, uint8_t address);
+
+/**
+ * Sets the coils served by functions 1, 5 & 15. The MODBUS client reads and
+ * writes them directly in the array.
+ * @param client client context
+ * @param coils bit-packed array, coil n is bit (n % 32) of word (n / 32). NULL to disable
+ * @param num_coils number of coils in the array
+ */
+void MODBUS_SetCoils(MODBUS_CLIENT * client, uint32_t * coils, uint16_t num_coils);
+
+/**
+ * Sets the discrete inputs served by function 2
+ * @param client client context
+ * @param inputs bit-packed array, input n is bit (n % 32) of word (n / 32). NULL to disable
+ * @param num_inputs number of inputs in the array
+ */
+void MODBUS_SetDiscreteInputs(MODBUS_CLIENT * client, const uint32_t * inputs, uint16_t num_inputs);
+
+/**
+ * Sets the input registers served by function 4. They are read from the buffer
+ * each time a request arrives, so it can be the live buffer where the application
+ * (or a DMA/driver transfer) stores its samples.
+ * @param client client context
+ * @param registers input registers in host byte order. NULL to disable
+ * @param num_registers number of registers in the buffer
+ */
+void MODBUS_SetInputRegisters(MODBUS_CLIENT * client, const volatile uint16_t * registers, uint16_t num_registers);
+
+/**
+ * Advances the MODBUS client without blocking: keeps reception armed, detects
+ * the end of a frame (3.5 characters of silence, or CR LF in ASCII) and answers
+ * it. Call it from the main loop each time the MCU wakes up (USART events and SysTick).
+ * RTU frames are timed with getSysMicros(), a free running microseconds counter the
+ * application provides as it does getSysTicks(): bytes preceded by t3.5 of silence
+ * start a new frame, and a frame is processed once t3.5 plus the time of a byte have
+ * passed without any.
+ * A response whose end of transmission is not signaled in time (twice its length
+ * at the current rate, plus t3.5) is aborted and reception is armed again.
+ * @param client client context
+ * @return client status, see MODBUS_POLL_STATUS
+ */
+MODBUS_POLL_STATUS MODBUS_Poll(MODBUS_CLIENT * client);
+
+/**
+ * Waits for a MODBUS request and process it. The request is delimited by
+ * a line silence of 3.5 characters, malformed frames are dropped.
+ * Blocking wrapper around MODBUS_Poll().
+ * @param client client context
+ * @param timeout time to wait for the request to start
  * @return true on success, false otherwise
  */
-bool do_MODBUS_Client(uint32_t timeout);
+bool do_MODBUS_Client(MODBUS_CLIENT * client, uint32_t timeout);
+
+/**
+ * Gets a copy of the diagnostic counters
+ * @param client client context
+ * @param counters filled with the current counters
+ */
+void MODBUS_GetCounters(const MODBUS_CLIENT * client, MODBUS_COUNTERS * counters);
+
+/**
+ * Clears the diagnostic counters
+ * @param client client context
+ */
+void MODBUS_ClearCounters(MODBUS_CLIENT * client);
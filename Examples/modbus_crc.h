@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2020 Màrius Montón <marius.monton@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the License); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an AS IS BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Project:   CMSIS Driver implementation for STM32 devices
+ *
+ * MODBUS CRC16 (polynomial 0xA001 reflected, initial value 0xFFFF).
+ *
+ * The CRC can be computed incrementally: CRC16_Init(), then CRC16_Update() for
+ * each chunk of data as it arrives and CRC16_Final() at the end. Running the CRC
+ * over a whole frame including its CRC field gives CRC16_RESIDUE if it is valid.
+ *
+ * The kernel used by CRC16_Update() is selected at compile time defining
+ * CRC16_IMPLEMENTATION to one of:
+ * - CRC16_IMPL_TABLE: byte at a time, 256 entries table (512 bytes of flash). Default.
+ * - CRC16_IMPL_NIBBLE: nibble at a time, 16 entries table (32 bytes of flash),
+ *   for flash constrained parts (i.e. EFM32 Tiny Gecko).
+ * - CRC16_IMPL_SLICE4: slicing-by-4, 4 bytes per step (2 KB of tables in flash).
+ * - CRC16_IMPL_SLICE8: slicing-by-8, 8 bytes per step (4 KB of tables in flash).
+ * All tables are constant, so every kernel is reentrant and needs no initialization.
+ * Defining CRC16_ALL_IMPLEMENTATIONS builds every kernel (used by the benchmark).
+ */
+
+#ifndef MODBUS_CRC_H
+#define MODBUS_CRC_H
+
+#include <stdint.h>
+
+#define CRC16_INIT_VALUE (0xFFFF)
+#define CRC16_RESIDUE (0x0000)
+
+#define CRC16_IMPL_TABLE (0)
+#define CRC16_IMPL_NIBBLE (1)
+#define CRC16_IMPL_SLICE4 (2)
+#define CRC16_IMPL_SLICE8 (3)
+
+#ifndef CRC16_IMPLEMENTATION
+#define CRC16_IMPLEMENTATION CRC16_IMPL_TABLE
+#endif
+
+/**
+ * Starts a new CRC computation
+ * @return initial CRC value
+ */
+static inline uint16_t CRC16_Init(void)
+{
+    return CRC16_INIT_VALUE;
+}
+
+/**
+ * Accumulates data into a running CRC
+ * @param crc running CRC value
+ * @param nData data to add
+ * @param wLength number of bytes to add
+ * @return updated CRC value
+ */
+uint16_t CRC16_Update(uint16_t crc, const uint8_t * nData, uint32_t wLength);
+
+/* CRC16_Update() kernels, same parameters and result as CRC16_Update() */
+#if defined(CRC16_ALL_IMPLEMENTATIONS) || (CRC16_IMPLEMENTATION == CRC16_IMPL_TABLE)
+uint16_t CRC16_Update_Table(uint16_t crc, const uint8_t * nData, uint32_t wLength);
+#endif
+#if defined(CRC16_ALL_IMPLEMENTATIONS) || (CRC16_IMPLEMENTATION == CRC16_IMPL_NIBBLE)
+uint16_t CRC16_Update_Nibble(uint16_t crc, const uint8_t * nData, uint32_t wLength);
+#endif
+#if defined(CRC16_ALL_IMPLEMENTATIONS) || (CRC16_IMPLEMENTATION == CRC16_IMPL_SLICE4)
+uint16_t CRC16_Update_Slice4(uint16_t crc, const uint8_t * nData, uint32_t wLength);
+#endif
+#if defined(CRC16_ALL_IMPLEMENTATIONS) || (CRC16_IMPLEMENTATION == CRC16_IMPL_SLICE8)
+uint16_t CRC16_Update_Slice8(uint16_t crc, const uint8_t * nData, uint32_t wLength);
+#endif
+
+/**
+ * Finishes a CRC computation
+ * @param crc running CRC value
+ * @return CRC value to insert in the frame (low byte first)
+ */
+static inline uint16_t CRC16_Final(uint16_t crc)
+{
+    return crc;
+}
+
+/**
+ * Computes the CRC of a whole buffer
+ * @param nData data buffer
+ * @param wLength number of bytes
+ * @return CRC value
+ */
+uint16_t CRC16(const uint8_t * nData, uint16_t wLength);
+
+#endif
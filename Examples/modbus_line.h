@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2020 Màrius Montón <marius.monton@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the License); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an AS IS BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Project:   CMSIS Driver implementation for STM32 devices
+ *
+ * MODBUS serial line settings and timing, shared by the client and the master.
+ */
+
+#ifndef MODBUS_LINE_H
+#define MODBUS_LINE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "Driver_USART.h"
+
+/* Framing of the requests and responses */
+typedef enum {
+    MODBUS_TRANSPORT_RTU,       /* Binary frames delimited by silence, CRC. 8 data bits */
+    MODBUS_TRANSPORT_ASCII,     /* ':', hexadecimal digits and LRC, ended by CR LF. 7 data bits (MODBUS_ASCII) */
+} MODBUS_TRANSPORT;
+
+/* Serial line settings, the data bits are the ones of the transport */
+typedef struct {
+    uint32_t baudrate;          /* Bits per second, first rate tried with auto-baud (0 for the slowest) */
+    uint32_t parity;            /* ARM_USART_PARITY_NONE, ARM_USART_PARITY_EVEN or ARM_USART_PARITY_ODD */
+    uint32_t stop_bits;         /* ARM_USART_STOP_BITS_1 or ARM_USART_STOP_BITS_2 (required by ASCII without parity) */
+    bool autobaud;              /* Detect the master's rate: the first frame with a valid CRC sets it. RTU client only */
+    MODBUS_TRANSPORT transport;
+    bool rs485;                 /* Drive the RS-485 transceiver DE line (ARM_USART_CONTROL_RS485), init fails if the port cannot */
+} MODBUS_LINE_CONFIG;
+
+/* Line settings used when MODBUS_Init() or MODBUS_Master_Init() are given none */
+#define MODBUS_LINE_CONFIG_DEFAULT {9600, ARM_USART_PARITY_NONE, ARM_USART_STOP_BITS_1, false, MODBUS_TRANSPORT_RTU, false}
+
+/**
+ * Computes t3.5, the inter-frame silence, for the given baudrate. Above 19200 bps
+ * MODBUS fixes it to 1750 us.
+ * @param baudrate bits per second
+ * @return silence in microseconds
+ */
+static inline uint32_t MODBUS_SilenceMicros(uint32_t baudrate)
+{
+    if (baudrate > 19200) {
+        return 1750;
+    }
+
+    /* 3.5 characters of 11 bits each */
+    return (38500000UL + baudrate - 1) / baudrate;
+}
+
+/**
+ * Computes the time a character takes on the line (11 bits: start, 8 data, parity
+ * or 2nd stop, stop)
+ * @param baudrate bits per second
+ * @return character time in microseconds
+ */
+static inline uint32_t MODBUS_CharMicros(uint32_t baudrate)
+{
+    return (11000000UL + baudrate - 1) / baudrate;
+}
+
+/**
+ * Computes the inter-frame silence for the given baudrate, in getSysTicks() (1 ms)
+ * units, for the timing that does not need to be exact. A byte is only seen once
+ * complete, so the silence after the last one lasts until the next byte is complete:
+ * one more character time. One extra tick is added because a tick difference of N
+ * only guarantees N - 1 ms.
+ * @param baudrate bits per second
+ * @return silence in ticks
+ */
+static inline uint32_t MODBUS_SilenceTicks(uint32_t baudrate)
+{
+    uint32_t t35_us = MODBUS_SilenceMicros(baudrate) + MODBUS_CharMicros(baudrate);
+
+    return ((t35_us + 999) / 1000) + 1;
+}
+
+#endif
@@ -0,0 +1,635 @@
+/*
+ * Copyright (c) 2020 Màrius Montón <marius.monton@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the License); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an AS IS BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Project:   CMSIS Driver implementation for STM32 devices
+ *
+ * This example implements a MODBUS RTU master using CMSIS UART Driver. The
+ * application queues transactions (reads and writes of holding registers, functions
+ * 3 & 16) to any slave, and MODBUS_Master_Poll() sends them one at a time.
+ *
+ * When a request is built, the queued transactions to the same slave and of the
+ * same type are merged into it while their register ranges join (adjacent, or
+ * overlapping for reads) and the request stays inside the MODBUS limits. The scan
+ * stops at the first transaction to that slave that can not be merged, so accesses
+ * to a slave are never reordered.
+ *
+ * Timing: a request is only sent after 3.5 characters of line silence, reception
+ * is armed from the end of transmission event, and the response is closed as soon
+ * as its expected length is received. Requests without response within the
+ * timeout, or with a malformed response, are retried. Broadcasts get no response,
+ * the master waits the turnaround delay instead. A request whose end of
+ * transmission event never comes (TX error, DE line stuck...) is aborted after
+ * twice its frame time and retried like a malformed response.
+ *
+ * Raw transactions carry any request PDU and get back the response PDU, for
+ * gateways. They are never merged and their response ends on t3.5 of silence.
+ *
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include "cmsis_compiler.h"
+#include "Driver_USART.h"
+#include "modbus_master.h"
+#include "modbus_crc.h"
+
+/* MODBUS limits for functions 3 & 16 */
+#define MAX_READ_REGS (125)
+#define MAX_WRITE_REGS (123)
+
+#define READ_HOLDING_REGS (3)
+#define WRITE_MULTS_REGS (16)
+
+#define EXCEPTION_FLAG (0x80)
+#define EXCEPTION_RESPONSE_LEN (5)
+
+extern uint32_t getSysTicks(void);
+
+static MODBUS_MASTER *masters[MODBUS_MAX_MASTERS];
+
+static void master_event(MODBUS_MASTER * master, uint32_t event);
+static void master_event_0(uint32_t event);
+#if (MODBUS_MAX_MASTERS > 1)
+static void master_event_1(uint32_t event);
+#endif
+
+static const ARM_USART_SignalEvent_t master_events[MODBUS_MAX_MASTERS] = {
+    master_event_0,
+#if (MODBUS_MAX_MASTERS > 1)
+    master_event_1,
+#endif
+};
+
+static bool can_merge(const MODBUS_MASTER * master, const MODBUS_TRANSACTION * trans);
+static void build_request(MODBUS_MASTER * master);
+static void send_request(MODBUS_MASTER * master);
+static void arm_reception(MODBUS_MASTER * master);
+static void poll_response(MODBUS_MASTER * master);
+static void check_response(MODBUS_MASTER * master);
+static void retry_or_finish(MODBUS_MASTER * master, MODBUS_TRANSACTION_STATUS status);
+static void finish_batch(MODBUS_MASTER * master, MODBUS_TRANSACTION_STATUS status, uint8_t exception);
+
+bool MODBUS_Master_Init(MODBUS_MASTER * master, ARM_DRIVER_USART * driver_usart, const MODBUS_LINE_CONFIG * line)
+{
+    static const MODBUS_LINE_CONFIG default_line = MODBUS_LINE_CONFIG_DEFAULT;
+    bool ret_val = true;
+    int slot;
+
+    if ((master != NULL) && (driver_usart != NULL)) {
+        master->usart_drv = driver_usart;
+    } else {
+        return false;
+    }
+
+    /* The master talks RTU at a known rate */
+    if (line == NULL) {
+        line = &default_line;
+    }
+    if ((line->baudrate == 0) || (line->autobaud == true) || (line->transport != MODBUS_TRANSPORT_RTU)
+        || ((line->parity != ARM_USART_PARITY_NONE) && (line->parity != ARM_USART_PARITY_EVEN)
+            && (line->parity != ARM_USART_PARITY_ODD))
+        || ((line->stop_bits != ARM_USART_STOP_BITS_1) && (line->stop_bits != ARM_USART_STOP_BITS_2))) {
+        return false;
+    }
+    master->line = *line;
+
+    /* Attach the master to a free event callback (or the one it already had) */
+    for (slot = 0; slot < MODBUS_MAX_MASTERS; slot++) {
+        if (masters[slot] == master) {
+            break;
+        }
+    }
+    if (slot == MODBUS_MAX_MASTERS) {
+        for (slot = 0; slot < MODBUS_MAX_MASTERS; slot++) {
+            if (masters[slot] == NULL) {
+                break;
+            }
+        }
+    }
+    if (slot == MODBUS_MAX_MASTERS) {
+        return false;
+    }
+    masters[slot] = master;
+    master->state = MODBUS_MASTER_IDLE;
+    master->queue_head = NULL;
+    master->queue_tail = NULL;
+    master->batch_len = 0;
+
+    master->response_timeout = MODBUS_MASTER_RESPONSE_TIMEOUT;
+    master->turnaround_delay = MODBUS_MASTER_TURNAROUND_DELAY;
+    master->retries = MODBUS_MASTER_RETRIES;
+
+    if (master->usart_drv->Initialize(master_events[slot]) != ARM_DRIVER_OK) {
+        ret_val = false;
+    }
+
+    if (master->usart_drv->Control(ARM_USART_MODE_ASYNCHRONOUS | ARM_USART_DATA_BITS_8 | master->line.parity |
+                                   master->line.stop_bits | ARM_USART_FLOW_CONTROL_NONE, master->line.baudrate)
+        != ARM_DRIVER_OK) {
+        ret_val = false;
+    }
+
+    master->silence_ticks = MODBUS_SilenceTicks(master->line.baudrate);
+    master->line_ticks = getSysTicks();
+
+    /* Wait for the last stop bit when the driver can tell, otherwise for the data sent */
+    if (master->usart_drv->GetCapabilities().event_tx_complete) {
+        master->tx_done_event = ARM_USART_EVENT_TX_COMPLETE;
+    } else {
+        master->tx_done_event = ARM_USART_EVENT_SEND_COMPLETE;
+    }
+
+    if (master->usart_drv->Control(ARM_USART_CONTROL_TX, 1) != ARM_DRIVER_OK) {
+        ret_val = false;
+    }
+
+    if (master->usart_drv->Control(ARM_USART_CONTROL_RX, 1) != ARM_DRIVER_OK) {
+        ret_val = false;
+    }
+
+    /* Drive the RS-485 DE line if asked to, plain RS-232/TTL ports refuse it and only an enable must succeed */
+    if ((master->usart_drv->Control(ARM_USART_CONTROL_RS485, (master->line.rs485 == true) ? 1 : 0) != ARM_DRIVER_OK)
+        && (master->line.rs485 == true)) {
+        ret_val = false;
+    }
+
+    return ret_val;
+}
+
+void MODBUS_Master_SetTiming(MODBUS_MASTER * master, uint32_t response_timeout, uint32_t turnaround_delay,
+                             uint8_t retries)
+{
+    master->response_timeout = response_timeout;
+    master->turnaround_delay = turnaround_delay;
+    master->retries = retries;
+}
+
+bool MODBUS_Master_Submit(MODBUS_MASTER * master, MODBUS_TRANSACTION * trans)
+{
+    uint16_t max_regs;
+
+    if (trans == NULL) {
+        return false;
+    }
+
+    if (trans->type == MODBUS_TRANS_RAW) {
+        if ((trans->slave > 247) || (trans->pdu == NULL) || (trans->pdu_len == 0)
+            || (trans->pdu_len > MODBUS_MAX_PDU)) {
+            return false;
+        }
+    } else if (trans->data == NULL) {
+        return false;
+    } else if (trans->type == MODBUS_TRANS_READ) {
+        /* Nobody answers a broadcast read */
+        if (trans->slave == 0) {
+            return false;
+        }
+        max_regs = MAX_READ_REGS;
+    } else if (trans->type == MODBUS_TRANS_WRITE) {
+        max_regs = MAX_WRITE_REGS;
+    } else {
+        return false;
+    }
+
+    if ((trans->type != MODBUS_TRANS_RAW) && ((trans->slave > 247) || (trans->num == 0) || (trans->num > max_regs)
+                                              || (((uint32_t) trans->addr + trans->num) > 0x10000))) {
+        return false;
+    }
+
+    trans->status = MODBUS_TRANS_QUEUED;
+    trans->exception = 0;
+    trans->next = NULL;
+
+    if (master->queue_tail == NULL) {
+        master->queue_head = trans;
+    } else {
+        master->queue_tail->next = trans;
+    }
+    master->queue_tail = trans;
+
+    return true;
+}
+
+bool MODBUS_Master_Poll(MODBUS_MASTER * master)
+{
+    switch (master->state) {
+    case MODBUS_MASTER_SENDING:
+        if ((getSysTicks() - master->tx_ticks) < master->tx_timeout) {
+            return true;
+        }
+        /* The end of transmission never came, give up the request. Idle first so a
+         * late event does not arm reception meanwhile */
+        master->state = MODBUS_MASTER_IDLE;
+        master->usart_drv->Control(ARM_USART_ABORT_SEND, 0);
+        master->line_ticks = getSysTicks();
+        retry_or_finish(master, MODBUS_TRANS_ERROR);
+        return true;
+    case MODBUS_MASTER_RECEIVING:
+        poll_response(master);
+        return true;
+    case MODBUS_MASTER_TURNAROUND:
+        if ((getSysTicks() - master->line_ticks) >= master->turnaround_delay) {
+            master->state = MODBUS_MASTER_IDLE;
+            finish_batch(master, MODBUS_TRANS_DONE, 0);
+        }
+        return true;
+    default:
+        break;
+    }
+
+    /* Nothing in progress (or a request to resend) */
+    if (master->batch_len == 0) {
+        if (master->queue_head == NULL) {
+            return false;
+        }
+        build_request(master);
+    }
+
+    /* A frame only starts after t3.5 of silence */
+    if ((getSysTicks() - master->line_ticks) >= master->silence_ticks) {
+        send_request(master);
+    }
+
+    return true;
+}
+
+/**
+ * Checks if a queued transaction can join the request being built
+ * @return true if it can be merged
+ */
+static bool can_merge(const MODBUS_MASTER * master, const MODBUS_TRANSACTION * trans)
+{
+    uint32_t batch_end = master->batch_addr + master->batch_num;
+    uint32_t trans_end = trans->addr + trans->num;
+    uint32_t start;
+    uint32_t end;
+
+    if ((master->batch_len >= MODBUS_MASTER_MAX_MERGE) || (trans->type == MODBUS_TRANS_RAW)) {
+        return false;
+    }
+
+    if (master->batch_function == READ_HOLDING_REGS) {
+        /* Reads may overlap, each one takes its part of the response */
+        if ((trans->addr > batch_end) || (trans_end < master->batch_addr)) {
+            return false;
+        }
+        start = (trans->addr < master->batch_addr) ? trans->addr : master->batch_addr;
+        end = (trans_end > batch_end) ? trans_end : batch_end;
+        return ((end - start) <= MAX_READ_REGS);
+    }
+
+    /* Writes must be exactly adjacent, the order of overlapping ones matters */
+    if ((trans->addr != batch_end) && (trans_end != master->batch_addr)) {
+        return false;
+    }
+    return ((master->batch_num + trans->num) <= MAX_WRITE_REGS);
+}
+
+/**
+ * Takes the first queued transaction, merges the following ones it can and
+ * builds the request in send_buf
+ */
+static void build_request(MODBUS_MASTER * master)
+{
+    MODBUS_TRANSACTION *trans;
+    MODBUS_TRANSACTION *prev;
+    uint8_t *pkt = master->send_buf;
+    uint32_t trans_end;
+    uint32_t batch_end;
+    uint16_t aux;
+    uint16_t crc_req_pkt;
+    int i;
+    int j;
+
+    trans = master->queue_head;
+    master->queue_head = trans->next;
+    if (master->queue_head == NULL) {
+        master->queue_tail = NULL;
+    }
+
+    master->batch[0] = trans;
+    master->batch_len = 1;
+    master->batch_slave = trans->slave;
+    master->retries_left = master->retries;
+
+    if (trans->type == MODBUS_TRANS_RAW) {
+        pkt[0] = trans->slave;
+        memcpy(&pkt[1], trans->pdu, trans->pdu_len);
+        master->batch_function = trans->pdu[0];
+        master->request_len = 1 + trans->pdu_len;
+
+        crc_req_pkt = CRC16(pkt, master->request_len);
+        pkt[master->request_len] = crc_req_pkt & 0x00FF;
+        pkt[master->request_len + 1] = crc_req_pkt >> 8;
+        master->request_len += 2;
+        return;
+    }
+
+    master->batch_function = (trans->type == MODBUS_TRANS_READ) ? READ_HOLDING_REGS : WRITE_MULTS_REGS;
+    master->batch_addr = trans->addr;
+    master->batch_num = trans->num;
+
+    /* Merge the following transactions to the same slave, up to the first one that does not fit */
+    prev = NULL;
+    trans = master->queue_head;
+    while (trans != NULL) {
+        if (trans->slave != master->batch_slave) {
+            prev = trans;
+            trans = trans->next;
+            continue;
+        }
+
+        if ((trans->type != master->batch[0]->type) || (can_merge(master, trans) == false)) {
+            break;
+        }
+
+        /* Unlink it and widen the request range */
+        if (prev == NULL) {
+            master->queue_head = trans->next;
+        } else {
+            prev->next = trans->next;
+        }
+        if (master->queue_tail == trans) {
+            master->queue_tail = prev;
+        }
+
+        trans_end = trans->addr + trans->num;
+        batch_end = master->batch_addr + master->batch_num;
+        if (trans->addr < master->batch_addr) {
+            master->batch_addr = trans->addr;
+        }
+        if (trans_end > batch_end) {
+            batch_end = trans_end;
+        }
+        master->batch_num = batch_end - master->batch_addr;
+        master->batch[master->batch_len++] = trans;
+
+        trans = trans->next;
+    }
+
+    pkt[0] = master->batch_slave;
+    pkt[1] = master->batch_function;
+    pkt[2] = master->batch_addr >> 8;
+    pkt[3] = master->batch_addr & 0x00FF;
+    pkt[4] = master->batch_num >> 8;
+    pkt[5] = master->batch_num & 0x00FF;
+
+    if (master->batch_function == READ_HOLDING_REGS) {
+        master->request_len = 6;
+    } else {
+        /* Gather the registers of each transaction in its place */
+        pkt[6] = master->batch_num * 2;
+        for (i = 0; i < master->batch_len; i++) {
+            trans = master->batch[i];
+            uint8_t *data = &pkt[7 + ((trans->addr - master->batch_addr) * 2)];
+            for (j = 0; j < trans->num; j++) {
+                aux = trans->data[j];
+                data[j * 2] = aux >> 8;
+                data[(j * 2) + 1] = aux & 0x00FF;
+            }
+        }
+        master->request_len = 7 + (master->batch_num * 2);
+    }
+
+    crc_req_pkt = CRC16(pkt, master->request_len);
+    pkt[master->request_len] = crc_req_pkt & 0x00FF;
+    pkt[master->request_len + 1] = crc_req_pkt >> 8;
+    master->request_len += 2;
+}
+
+/**
+ * Sends (or resends) the request in send_buf
+ */
+static void send_request(MODBUS_MASTER * master)
+{
+    /* Twice the frame time (11 bits per character) as margin, plus t3.5 and tick rounding */
+    master->tx_ticks = getSysTicks();
+    master->tx_timeout = (((master->request_len * 22000UL) + master->line.baudrate - 1) / master->line.baudrate)
+        + master->silence_ticks + 1;
+
+    /* Set before sending, the end of transmission event may come at any time */
+    master->state = MODBUS_MASTER_SENDING;
+
+    if (master->usart_drv->Send(master->send_buf, master->request_len) != ARM_DRIVER_OK) {
+        master->state = MODBUS_MASTER_IDLE;
+        retry_or_finish(master, MODBUS_TRANS_ERROR);
+    }
+}
+
+/**
+ * Arms the reception of the response, called when the request is sent
+ */
+static void arm_reception(MODBUS_MASTER * master)
+{
+    master->rx_count = 0;
+    master->rx_crc = CRC16_Init();
+
+    if (master->batch[0]->type == MODBUS_TRANS_READ) {
+        master->expected_len = 5 + (master->batch_num * 2);
+    } else if (master->batch[0]->type == MODBUS_TRANS_WRITE) {
+        master->expected_len = 8;
+    } else {
+        /* Unknown, closed by the line silence */
+        master->expected_len = sizeof(master->recv_buf);
+    }
+
+    /* If Receive fails nothing arrives and the request times out */
+    master->state = MODBUS_MASTER_RECEIVING;
+    master->usart_drv->Receive(master->recv_buf, sizeof(master->recv_buf));
+}
+
+/**
+ * Collects the response bytes and closes it when its expected length is received,
+ * or on timeout
+ */
+static void poll_response(MODBUS_MASTER * master)
+{
+    uint32_t count;
+    uint32_t end;
+
+    count = master->usart_drv->GetRxCount();
+    if (count > master->rx_count) {
+        /* An exception response is shorter */
+        if ((count >= 2) && (master->recv_buf[1] & EXCEPTION_FLAG)) {
+            master->expected_len = EXCEPTION_RESPONSE_LEN;
+        }
+        end = (count < master->expected_len) ? count : master->expected_len;
+        if (end > master->rx_count) {
+            master->rx_crc = CRC16_Update(master->rx_crc, &master->recv_buf[master->rx_count], end - master->rx_count);
+            master->rx_count = end;
+        }
+        master->line_ticks = getSysTicks();
+    }
+
+    if (master->rx_count == 0) {
+        if ((getSysTicks() - master->line_ticks) >= master->response_timeout) {
+            master->usart_drv->Control(ARM_USART_ABORT_RECEIVE, 0);
+            master->state = MODBUS_MASTER_IDLE;
+            retry_or_finish(master, MODBUS_TRANS_TIMEOUT);
+        }
+        return;
+    }
+
+    if (master->rx_count < master->expected_len) {
+        if ((getSysTicks() - master->line_ticks) < master->silence_ticks) {
+            return;
+        }
+
+        /* Response ended before its length, the normal end for raw transactions */
+        master->usart_drv->Control(ARM_USART_ABORT_RECEIVE, 0);
+        master->state = MODBUS_MASTER_IDLE;
+        if ((master->batch[0]->type == MODBUS_TRANS_RAW) && (master->rx_count >= EXCEPTION_RESPONSE_LEN)) {
+            check_response(master);
+        } else {
+            retry_or_finish(master, MODBUS_TRANS_ERROR);
+        }
+        return;
+    }
+
+    master->usart_drv->Control(ARM_USART_ABORT_RECEIVE, 0);
+    master->state = MODBUS_MASTER_IDLE;
+    check_response(master);
+}
+
+/**
+ * Validates a complete response and completes the transactions of the request
+ */
+static void check_response(MODBUS_MASTER * master)
+{
+    const uint8_t *pkt = master->recv_buf;
+    MODBUS_TRANSACTION *trans;
+    int i;
+    int j;
+
+    if ((master->rx_crc != CRC16_RESIDUE) || (pkt[0] != master->batch_slave)) {
+        retry_or_finish(master, MODBUS_TRANS_ERROR);
+        return;
+    }
+
+    /* Response PDU handed back as is, exceptions included */
+    if (master->batch[0]->type == MODBUS_TRANS_RAW) {
+        if ((pkt[1] & ~EXCEPTION_FLAG) != master->batch_function) {
+            retry_or_finish(master, MODBUS_TRANS_ERROR);
+            return;
+        }
+        trans = master->batch[0];
+        trans->pdu_len = master->rx_count - 3;
+        memcpy(trans->pdu, &pkt[1], trans->pdu_len);
+        if (pkt[1] & EXCEPTION_FLAG) {
+            finish_batch(master, MODBUS_TRANS_EXCEPTION, pkt[2]);
+        } else {
+            finish_batch(master, MODBUS_TRANS_DONE, 0);
+        }
+        return;
+    }
+
+    if (pkt[1] == (master->batch_function | EXCEPTION_FLAG)) {
+        finish_batch(master, MODBUS_TRANS_EXCEPTION, pkt[2]);
+        return;
+    }
+
+    if (pkt[1] != master->batch_function) {
+        retry_or_finish(master, MODBUS_TRANS_ERROR);
+        return;
+    }
+
+    if (master->batch_function == READ_HOLDING_REGS) {
+        if (pkt[2] != (master->batch_num * 2)) {
+            retry_or_finish(master, MODBUS_TRANS_ERROR);
+            return;
+        }
+
+        /* Scatter the registers to each transaction */
+        for (i = 0; i < master->batch_len; i++) {
+            trans = master->batch[i];
+            const uint8_t *data = &pkt[3 + ((trans->addr - master->batch_addr) * 2)];
+            for (j = 0; j < trans->num; j++) {
+                trans->data[j] = (data[j * 2] << 8) | data[(j * 2) + 1];
+            }
+        }
+    } else {
+        /* Echo of the start address and number of registers */
+        for (i = 2; i < 6; i++) {
+            if (pkt[i] != master->send_buf[i]) {
+                retry_or_finish(master, MODBUS_TRANS_ERROR);
+                return;
+            }
+        }
+    }
+
+    finish_batch(master, MODBUS_TRANS_DONE, 0);
+}
+
+/**
+ * Resends the request if retries are left, completes its transactions otherwise
+ * @param status final status when no retries are left
+ */
+static void retry_or_finish(MODBUS_MASTER * master, MODBUS_TRANSACTION_STATUS status)
+{
+    if (master->retries_left > 0) {
+        master->retries_left--;
+        return;
+    }
+
+    finish_batch(master, status, 0);
+}
+
+/**
+ * Completes all the transactions of the request in progress
+ */
+static void finish_batch(MODBUS_MASTER * master, MODBUS_TRANSACTION_STATUS status, uint8_t exception)
+{
+    MODBUS_TRANSACTION *trans;
+    int i;
+
+    for (i = 0; i < master->batch_len; i++) {
+        trans = master->batch[i];
+        trans->exception = exception;
+        trans->status = status;
+        if (trans->done_cb != NULL) {
+            trans->done_cb(trans);
+        }
+    }
+
+    master->batch_len = 0;
+}
+
+static void master_event(MODBUS_MASTER * master, uint32_t event)
+{
+    /* Request sent, wait for the response (or let the slaves process a broadcast) */
+    if ((event & master->tx_done_event) && (master->state == MODBUS_MASTER_SENDING)) {
+        master->line_ticks = getSysTicks();
+        if (master->batch_slave == 0) {
+            master->state = MODBUS_MASTER_TURNAROUND;
+        } else {
+            arm_reception(master);
+        }
+    }
+}
+
+/* CMSIS event callbacks carry no context, one callback per master slot */
+static void master_event_0(uint32_t event)
+{
+    master_event(masters[0], event);
+}
+
+#if (MODBUS_MAX_MASTERS > 1)
+static void master_event_1(uint32_t event)
+{
+    master_event(masters[1], event);
+}
+#endif
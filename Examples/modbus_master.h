@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2020 Màrius Montón <marius.monton@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the License); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an AS IS BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Project:   CMSIS Driver implementation for STM32 devices
+ *
+ * This example implements a MODBUS RTU master using CMSIS UART Driver
+ */
+
+#include <stdbool.h>
+#include "cmsis_compiler.h"
+#include "Driver_USART.h"
+#include "modbus_line.h"
+
+/* USART driver specific control (see the EFM32 and STM32 drivers): RS-485 transceiver driver
+ * enable, released by the driver as soon as the last stop bit is sent */
+#ifndef ARM_USART_CONTROL_RS485
+#define ARM_USART_CONTROL_RS485 (0x80UL << ARM_USART_CONTROL_Pos)
+#endif
+
+/* Maximum number of masters (serial ports) at once, up to 2 */
+#ifndef MODBUS_MAX_MASTERS
+#define MODBUS_MAX_MASTERS (1)
+#endif
+
+#if (MODBUS_MAX_MASTERS < 1) || (MODBUS_MAX_MASTERS > 2)
+#error "MODBUS_MAX_MASTERS must be between 1 and 2"
+#endif
+
+/* Maximum number of queued transactions merged into a single request */
+#ifndef MODBUS_MASTER_MAX_MERGE
+#define MODBUS_MASTER_MAX_MERGE (8)
+#endif
+
+#define MODBUS_MASTER_MAX_BUFF (256)    /* Maximum RTU ADU size */
+
+/* Default timing, in getSysTicks() units */
+#define MODBUS_MASTER_RESPONSE_TIMEOUT (100)    /* From the end of the request to the first byte of the response */
+#define MODBUS_MASTER_TURNAROUND_DELAY (100)    /* Time given to the slaves to process a broadcast */
+#define MODBUS_MASTER_RETRIES (2)       /* Retries after a timeout or a malformed response */
+
+/* Transaction status */
+typedef enum {
+    MODBUS_TRANS_QUEUED,        /* Waiting in the queue or in progress */
+    MODBUS_TRANS_DONE,          /* Completed, read data is available */
+    MODBUS_TRANS_EXCEPTION,     /* The slave answered with an exception */
+    MODBUS_TRANS_TIMEOUT,       /* No response after all retries */
+    MODBUS_TRANS_ERROR,         /* Malformed responses (CRC, length...) after all retries, or send error */
+} MODBUS_TRANSACTION_STATUS;
+
+/* Transaction type */
+typedef enum {
+    MODBUS_TRANS_READ,          /* Read holding registers (function 3) */
+    MODBUS_TRANS_WRITE,         /* Write multiple registers (function 16) */
+    MODBUS_TRANS_RAW,           /* Any request PDU, sent as is and answered with the response PDU (gateways) */
+} MODBUS_TRANSACTION_TYPE;
+
+#define MODBUS_MAX_PDU (253)
+
+struct MODBUS_TRANSACTION;
+
+/**
+ * Called when a transaction ends, from MODBUS_Master_Poll() context
+ * @param trans the finished transaction, see its status field
+ */
+typedef void (*MODBUS_TransactionDone_t)(struct MODBUS_TRANSACTION * trans);
+
+/**
+ * A read or write of consecutive holding registers of one slave, or a raw request.
+ * The application owns the memory and must not modify it while the status is
+ * MODBUS_TRANS_QUEUED.
+ */
+typedef struct MODBUS_TRANSACTION {
+    MODBUS_TRANSACTION_TYPE type;
+    uint8_t slave;              /* Slave address, 0 broadcasts a write */
+    uint16_t addr;              /* First register */
+    uint16_t num;               /* Number of registers */
+    uint16_t *data;             /* Registers to write or buffer for the read ones (host order) */
+    uint8_t *pdu;               /* MODBUS_TRANS_RAW: request PDU, replaced by the response PDU (MODBUS_MAX_PDU bytes) */
+    uint16_t pdu_len;           /* MODBUS_TRANS_RAW: PDU length (function code included) */
+    MODBUS_TransactionDone_t done_cb;   /* Optional, NULL to poll the status */
+    volatile MODBUS_TRANSACTION_STATUS status;
+    uint8_t exception;          /* Exception code when status is MODBUS_TRANS_EXCEPTION */
+    struct MODBUS_TRANSACTION *next;    /* Queue link, internal */
+} MODBUS_TRANSACTION;
+
+/* Master state */
+typedef enum {
+    MODBUS_MASTER_IDLE,         /* Nothing on the line */
+    MODBUS_MASTER_SENDING,      /* Sending a request */
+    MODBUS_MASTER_RECEIVING,    /* Reception armed, waiting for the response */
+    MODBUS_MASTER_TURNAROUND,   /* Broadcast sent, waiting for the slaves to process it */
+} MODBUS_MASTER_STATE;
+
+/**
+ * MODBUS master context, one per serial port. The application allocates it
+ * (zero initialized, i.e. static) and only accesses it through the MODBUS_Master_ functions.
+ */
+typedef struct {
+    ARM_DRIVER_USART *usart_drv;
+    MODBUS_LINE_CONFIG line;    /* Serial line settings */
+    uint8_t send_buf[MODBUS_MASTER_MAX_BUFF];
+    uint8_t recv_buf[MODBUS_MASTER_MAX_BUFF];
+    MODBUS_TRANSACTION *queue_head;     /* Pending transactions, in submission order */
+    MODBUS_TRANSACTION *queue_tail;
+    MODBUS_TRANSACTION *batch[MODBUS_MASTER_MAX_MERGE]; /* Transactions served by the request in progress */
+    uint8_t batch_len;
+    uint8_t batch_slave;
+    uint8_t batch_function;
+    uint16_t batch_addr;
+    uint16_t batch_num;
+    uint32_t request_len;       /* Request size in send_buf, to resend it */
+    uint32_t expected_len;      /* Expected response size */
+    uint8_t retries_left;
+    volatile MODBUS_MASTER_STATE state;
+    uint32_t silence_ticks;     /* Inter-frame silence (t3.5) in getSysTicks() units */
+    uint32_t response_timeout;
+    uint32_t turnaround_delay;
+    uint8_t retries;
+    uint32_t tx_done_event;     /* Driver event signaling the line is free after a Send */
+    uint32_t tx_ticks;          /* Time the request Send started */
+    uint32_t tx_timeout;        /* Ticks the request may take before the transmission is given up */
+    volatile uint32_t line_ticks;       /* Time of the last activity on the line (sent or received) */
+    uint32_t rx_count;          /* Bytes received so far */
+    uint16_t rx_crc;            /* CRC of the response, computed while bytes arrive */
+} MODBUS_MASTER;
+
+/**
+ * Initializes the MODBUS master and its serial port. The master is RTU only and
+ * needs the rate of the bus: line->transport must be MODBUS_TRANSPORT_RTU and
+ * line->autobaud false. With line->rs485 the driver must accept
+ * ARM_USART_CONTROL_RS485, i.e. have its DE pin wired.
+ * @param master master context
+ * @param driver_usart driver of the serial port to use
+ * @param line serial line settings, NULL for MODBUS_LINE_CONFIG_DEFAULT (9600 8N1)
+ * @return true on success, false otherwise (i.e. invalid settings, RS-485 asked on a port without DE)
+ */
+bool MODBUS_Master_Init(MODBUS_MASTER * master, ARM_DRIVER_USART * driver_usart, const MODBUS_LINE_CONFIG * line);
+
+/**
+ * Sets the master timing, in getSysTicks() units
+ * @param master master context
+ * @param response_timeout time to wait for the first byte of a response
+ * @param turnaround_delay time to wait after a broadcast
+ * @param retries retries after a timeout or a malformed response
+ */
+void MODBUS_Master_SetTiming(MODBUS_MASTER * master, uint32_t response_timeout, uint32_t turnaround_delay,
+                             uint8_t retries);
+
+/**
+ * Queues a transaction. Consecutive transactions to the same slave and of the same
+ * type whose register ranges are adjacent (or overlap, for reads) are sent as a
+ * single request.
+ * @param master master context
+ * @param trans transaction to queue, its type, slave, addr, num, data and done_cb must be set
+ *              (pdu and pdu_len instead of addr, num and data for MODBUS_TRANS_RAW)
+ * @return true if queued, false if not valid
+ */
+bool MODBUS_Master_Submit(MODBUS_MASTER * master, MODBUS_TRANSACTION * trans);
+
+/**
+ * Advances the MODBUS master without blocking: sends the next request once the line
+ * is silent, collects the response, retries and completes the transactions. A request
+ * whose end of transmission is never signaled is aborted after twice its frame time.
+ * Call it from the main loop each time the MCU wakes up (USART events and SysTick).
+ * @param master master context
+ * @return true if there is work in progress or queued, false if idle
+ */
+bool MODBUS_Master_Poll(MODBUS_MASTER * master);
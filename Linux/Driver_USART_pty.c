@@ -0,0 +1,578 @@
+/*
+ * Copyright (c) 2020 Màrius Montón <marius.monton@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the License); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an AS IS BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Project:   CMSIS USART Driver over Linux pseudo terminals
+ *
+ * This library lets the vendor independent code (Examples/) talk through a Linux
+ * pty (or serial port) as if it was a MCU USART.
+ *
+ * - Implemented non-blocking mode for Send, Receive functions
+ * - Implemented ARM_USART_ABORT_SEND and ARM_USART_ABORT_RECEIVE controls
+ * - Signals ARM_USART_EVENT_SEND_COMPLETE and ARM_USART_EVENT_TX_COMPLETE once
+ *   the time the data takes on a real line at the configured baudrate has elapsed
+ *
+ * A thread per instance plays the role of the USART interrupt: events are
+ * signaled from it. Bytes are only read from the device while a reception is
+ * armed, the kernel buffer acts as the USART FIFO meanwhile.
+ *
+ * TODO: Implement transfer function
+ * TODO: Implement ARM_USART_SetModemControl function
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "Driver_USART.h"
+#include "Driver_USART_pty.h"
+
+#define ARM_USART_DRV_VERSION    ARM_DRIVER_VERSION_MAJOR_MINOR(1, 0)   /* driver version */
+
+/* Driver Version */
+static const ARM_DRIVER_VERSION DriverVersion = {
+    ARM_USART_API_VERSION,
+    ARM_USART_DRV_VERSION
+};
+
+/* Driver Capabilities */
+static const ARM_USART_CAPABILITIES DriverCapabilities = {
+    1,                          /* supports UART (Asynchronous) mode */
+    0,                          /* supports Synchronous Master mode */
+    0,                          /* supports Synchronous Slave mode */
+    0,                          /* supports UART Single-wire mode */
+    0,                          /* supports UART IrDA mode */
+    0,                          /* supports UART Smart Card mode */
+    0,                          /* Smart Card Clock generator available */
+    0,                          /* RTS Flow Control available */
+    0,                          /* CTS Flow Control available */
+    1,                          /* Transmit completed event: \ref ARM_USART_EVENT_TX_COMPLETE */
+    0,                          /* Signal receive character timeout event: \ref ARM_USART_EVENT_RX_TIMEOUT */
+    0,                          /* RTS Line: 0=not available, 1=available */
+    0,                          /* CTS Line: 0=not available, 1=available */
+    0,                          /* DTR Line: 0=not available, 1=available */
+    0,                          /* DSR Line: 0=not available, 1=available */
+    0,                          /* DCD Line: 0=not available, 1=available */
+    0,                          /* RI Line: 0=not available, 1=available */
+    0,                          /* Signal CTS change event: \ref ARM_USART_EVENT_CTS */
+    0,                          /* Signal DSR change event: \ref ARM_USART_EVENT_DSR */
+    0,                          /* Signal DCD change event: \ref ARM_USART_EVENT_DCD */
+    0,                          /* Signal RI change event: \ref ARM_USART_EVENT_RI */
+    0                           /* Reserved (must be zero) */
+};
+
+typedef struct {
+    const void *TxBuf;          /* Pointer to Tx buffer */
+    void *RxBuf;                /* Pointer to Rx Buffer */
+    uint32_t TxNum;             /* Items to send */
+    uint32_t RxNum;             /* Items to receive */
+    volatile uint32_t TxCnt;    /* Items sent */
+    volatile uint32_t RxCnt;    /* Items received */
+} USART_TRANSFER_INFO;
+
+typedef struct {
+    int fd;                     /* Device */
+    int hold_fd;                /* Slave side of a created pty, kept open so the device never hangs up */
+    char path[64];
+    pthread_t thread;
+    pthread_mutex_t lock;
+    volatile bool running;
+    uint32_t baudrate;
+    uint32_t char_bits;         /* Bits per character on the line (start, data, parity and stop) */
+    uint64_t tx_done_us;        /* Time the data sent leaves the line */
+    bool rx_enabled;
+    USART_TRANSFER_INFO xfer;
+    ARM_USART_STATUS status;
+    ARM_USART_SignalEvent_t cb_event;
+} PTY_USART_RESOURCES;
+
+static PTY_USART_RESOURCES PTY_Resources[USART_PTY_INSTANCES] = {
+    {.fd = -1,.hold_fd = -1,.lock = PTHREAD_MUTEX_INITIALIZER,.baudrate = 9600,.char_bits = 10},
+    {.fd = -1,.hold_fd = -1,.lock = PTHREAD_MUTEX_INITIALIZER,.baudrate = 9600,.char_bits = 10},
+};
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+static int set_raw(int fd)
+{
+    struct termios tio;
+
+    if (tcgetattr(fd, &tio) != 0) {
+        return -1;
+    }
+    cfmakeraw(&tio);
+    return tcsetattr(fd, TCSANOW, &tio);
+}
+
+const char *USART_PTY_Open(uint32_t instance, const char *path)
+{
+    PTY_USART_RESOURCES *usart;
+    int fd;
+
+    if (instance >= USART_PTY_INSTANCES) {
+        return NULL;
+    }
+    usart = &PTY_Resources[instance];
+
+    if (path == NULL) {
+        fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+        if ((fd < 0) || (grantpt(fd) != 0) || (unlockpt(fd) != 0) || (ptsname(fd) == NULL)) {
+            return NULL;
+        }
+        strncpy(usart->path, ptsname(fd), sizeof(usart->path) - 1);
+        usart->hold_fd = open(usart->path, O_RDWR | O_NOCTTY);
+        if ((usart->hold_fd < 0) || (set_raw(usart->hold_fd) != 0)) {
+            close(fd);
+            return NULL;
+        }
+    } else {
+        fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+        if ((fd < 0) || (set_raw(fd) != 0)) {
+            return NULL;
+        }
+        strncpy(usart->path, path, sizeof(usart->path) - 1);
+    }
+
+    usart->fd = fd;
+    return usart->path;
+}
+
+/**
+ * Receives the pending bytes into the armed reception
+ * @return events to signal
+ */
+static uint32_t PTY_USART_ReadFd(PTY_USART_RESOURCES * usart)
+{
+    uint32_t event = 0;
+    ssize_t n;
+
+    pthread_mutex_lock(&usart->lock);
+    if (usart->status.rx_busy) {
+        n = read(usart->fd, (uint8_t *) usart->xfer.RxBuf + usart->xfer.RxCnt, usart->xfer.RxNum - usart->xfer.RxCnt);
+        if (n > 0) {
+            usart->xfer.RxCnt += n;
+            if (usart->xfer.RxCnt == usart->xfer.RxNum) {
+                usart->status.rx_busy = 0;
+                event = ARM_USART_EVENT_RECEIVE_COMPLETE;
+            }
+        }
+    }
+    pthread_mutex_unlock(&usart->lock);
+
+    return event;
+}
+
+/* Plays the role of the USART interrupt */
+static void *PTY_USART_Thread(void *arg)
+{
+    PTY_USART_RESOURCES *usart = arg;
+    struct pollfd pfd;
+    uint32_t event;
+    uint64_t now;
+
+    while (usart->running) {
+        pfd.fd = usart->fd;
+        pfd.events = (usart->status.rx_busy && usart->rx_enabled) ? POLLIN : 0;
+        if ((poll(&pfd, 1, 1) > 0) && (pfd.revents & POLLIN)) {
+            event = PTY_USART_ReadFd(usart);
+        } else {
+            event = 0;
+        }
+
+        if (pfd.revents & (POLLHUP | POLLERR)) {
+            /* Other end closed, wait for it to come back */
+            usleep(1000);
+        }
+
+        pthread_mutex_lock(&usart->lock);
+        now = now_us();
+        if (usart->status.tx_busy && (now >= usart->tx_done_us)) {
+            usart->status.tx_busy = 0;
+            usart->xfer.TxCnt = usart->xfer.TxNum;
+            event |= ARM_USART_EVENT_SEND_COMPLETE | ARM_USART_EVENT_TX_COMPLETE;
+        }
+        pthread_mutex_unlock(&usart->lock);
+
+        if ((event != 0) && (usart->cb_event != NULL)) {
+            usart->cb_event(event);
+        }
+    }
+
+    return NULL;
+}
+
+static int32_t PTY_USART_Initialize(ARM_USART_SignalEvent_t cb_event, PTY_USART_RESOURCES * usart)
+{
+    if (usart->fd < 0) {
+        return ARM_DRIVER_ERROR;
+    }
+
+    usart->cb_event = cb_event;
+
+    if (usart->running == false) {
+        usart->running = true;
+        if (pthread_create(&usart->thread, NULL, PTY_USART_Thread, usart) != 0) {
+            usart->running = false;
+            return ARM_DRIVER_ERROR;
+        }
+    }
+
+    return ARM_DRIVER_OK;
+}
+
+static int32_t PTY_USART_Uninitialize(PTY_USART_RESOURCES * usart)
+{
+    if (usart->running) {
+        usart->running = false;
+        pthread_join(usart->thread, NULL);
+    }
+    usart->cb_event = NULL;
+
+    return ARM_DRIVER_OK;
+}
+
+static int32_t PTY_USART_PowerControl(ARM_POWER_STATE state, PTY_USART_RESOURCES const *usart)
+{
+    return ARM_DRIVER_OK;
+}
+
+static int32_t PTY_USART_Send(const void *data, uint32_t num, PTY_USART_RESOURCES * usart)
+{
+    const uint8_t *buf = data;
+    uint32_t sent = 0;
+    ssize_t n;
+    uint64_t start;
+
+    if ((data == NULL) || (num == 0)) {
+        return ARM_DRIVER_ERROR_PARAMETER;
+    }
+
+    pthread_mutex_lock(&usart->lock);
+    if (usart->status.tx_busy) {
+        pthread_mutex_unlock(&usart->lock);
+        return ARM_DRIVER_ERROR_BUSY;
+    }
+
+    while (sent < num) {
+        n = write(usart->fd, &buf[sent], num - sent);
+        if (n > 0) {
+            sent += n;
+        } else if ((n < 0) && (errno != EAGAIN) && (errno != EINTR)) {
+            pthread_mutex_unlock(&usart->lock);
+            return ARM_DRIVER_ERROR;
+        }
+    }
+
+    /* The transmission ends when the last character would leave a real line */
+    start = now_us();
+    if (usart->status.tx_busy == 0) {
+        usart->tx_done_us = start;
+    }
+    usart->tx_done_us = start + (((uint64_t) num * usart->char_bits * 1000000) / usart->baudrate);
+    usart->xfer.TxBuf = data;
+    usart->xfer.TxNum = num;
+    usart->xfer.TxCnt = 0;
+    usart->status.tx_busy = 1;
+    pthread_mutex_unlock(&usart->lock);
+
+    return ARM_DRIVER_OK;
+}
+
+static int32_t PTY_USART_Receive(void *data, uint32_t num, PTY_USART_RESOURCES * usart)
+{
+    if ((data == NULL) || (num == 0)) {
+        return ARM_DRIVER_ERROR_PARAMETER;
+    }
+
+    pthread_mutex_lock(&usart->lock);
+    if (usart->status.rx_busy) {
+        pthread_mutex_unlock(&usart->lock);
+        return ARM_DRIVER_ERROR_BUSY;
+    }
+
+    usart->xfer.RxBuf = data;
+    usart->xfer.RxNum = num;
+    usart->xfer.RxCnt = 0;
+    usart->status.rx_busy = 1;
+    pthread_mutex_unlock(&usart->lock);
+
+    return ARM_DRIVER_OK;
+}
+
+static uint32_t PTY_USART_GetTxCount(PTY_USART_RESOURCES const *usart)
+{
+    return usart->xfer.TxCnt;
+}
+
+static uint32_t PTY_USART_GetRxCount(PTY_USART_RESOURCES const *usart)
+{
+    return usart->xfer.RxCnt;
+}
+
+static int32_t PTY_USART_Control(uint32_t control, uint32_t arg, PTY_USART_RESOURCES * usart)
+{
+    uint32_t bits;
+
+    switch (control & ARM_USART_CONTROL_Msk) {
+    case ARM_USART_MODE_ASYNCHRONOUS:
+        if (arg == 0) {
+            return ARM_USART_ERROR_BAUDRATE;
+        }
+
+        /* Only used to time the transmissions */
+        switch (control & ARM_USART_DATA_BITS_Msk) {
+        case ARM_USART_DATA_BITS_5:
+            bits = 5;
+            break;
+        case ARM_USART_DATA_BITS_6:
+            bits = 6;
+            break;
+        case ARM_USART_DATA_BITS_7:
+            bits = 7;
+            break;
+        case ARM_USART_DATA_BITS_9:
+            bits = 9;
+            break;
+        default:
+            bits = 8;
+            break;
+        }
+        if ((control & ARM_USART_PARITY_Msk) != ARM_USART_PARITY_NONE) {
+            bits++;
+        }
+        bits += ((control & ARM_USART_STOP_BITS_Msk) == ARM_USART_STOP_BITS_2) ? 2 : 1;
+
+        pthread_mutex_lock(&usart->lock);
+        usart->baudrate = arg;
+        usart->char_bits = bits + 1;
+        pthread_mutex_unlock(&usart->lock);
+        break;
+    case ARM_USART_CONTROL_TX:
+        break;
+    case ARM_USART_CONTROL_RX:
+        usart->rx_enabled = (arg != 0);
+        break;
+    case ARM_USART_ABORT_SEND:
+        pthread_mutex_lock(&usart->lock);
+        usart->status.tx_busy = 0;
+        pthread_mutex_unlock(&usart->lock);
+        break;
+    case ARM_USART_ABORT_RECEIVE:
+        pthread_mutex_lock(&usart->lock);
+        usart->status.rx_busy = 0;
+        pthread_mutex_unlock(&usart->lock);
+        break;
+    default:
+        return ARM_DRIVER_ERROR_UNSUPPORTED;
+    }
+
+    return ARM_DRIVER_OK;
+}
+
+static ARM_USART_STATUS PTY_USART_GetStatus(PTY_USART_RESOURCES const *usart)
+{
+    return usart->status;
+}
+
+static int32_t PTY_USART_SetModemControl(ARM_USART_MODEM_CONTROL control, PTY_USART_RESOURCES const *usart)
+{
+    return ARM_DRIVER_ERROR_UNSUPPORTED;
+}
+
+static ARM_USART_MODEM_STATUS PTY_USART_GetModemStatus(PTY_USART_RESOURCES const *usart)
+{
+    ARM_USART_MODEM_STATUS modem_status = { 0 };
+
+    return modem_status;
+}
+
+static ARM_DRIVER_VERSION ARM_GetVersion(void)
+{
+    return DriverVersion;
+}
+
+static ARM_USART_CAPABILITIES ARM_GetCapabilities(void)
+{
+    return DriverCapabilities;
+}
+
+static int32_t PTY0_Initialize(ARM_USART_SignalEvent_t cb_event)
+{
+    return PTY_USART_Initialize(cb_event, &PTY_Resources[0]);
+}
+
+static int32_t PTY0_Uninitialize(void)
+{
+    return PTY_USART_Uninitialize(&PTY_Resources[0]);
+}
+
+static int32_t PTY0_PowerControl(ARM_POWER_STATE state)
+{
+    return PTY_USART_PowerControl(state, &PTY_Resources[0]);
+}
+
+static int32_t PTY0_Send(const void *data, uint32_t num)
+{
+    return PTY_USART_Send(data, num, &PTY_Resources[0]);
+}
+
+static int32_t PTY0_Receive(void *data, uint32_t num)
+{
+    return PTY_USART_Receive(data, num, &PTY_Resources[0]);
+}
+
+static int32_t PTY0_Transfer(const void *data_out, void *data_in, uint32_t num)
+{
+    return ARM_DRIVER_ERROR_UNSUPPORTED;
+}
+
+static uint32_t PTY0_GetTxCount(void)
+{
+    return PTY_USART_GetTxCount(&PTY_Resources[0]);
+}
+
+static uint32_t PTY0_GetRxCount(void)
+{
+    return PTY_USART_GetRxCount(&PTY_Resources[0]);
+}
+
+static int32_t PTY0_Control(uint32_t control, uint32_t arg)
+{
+    return PTY_USART_Control(control, arg, &PTY_Resources[0]);
+}
+
+static ARM_USART_STATUS PTY0_GetStatus(void)
+{
+    return PTY_USART_GetStatus(&PTY_Resources[0]);
+}
+
+static int32_t PTY0_SetModemControl(ARM_USART_MODEM_CONTROL control)
+{
+    return PTY_USART_SetModemControl(control, &PTY_Resources[0]);
+}
+
+static ARM_USART_MODEM_STATUS PTY0_GetModemStatus(void)
+{
+    return PTY_USART_GetModemStatus(&PTY_Resources[0]);
+}
+
+static int32_t PTY1_Initialize(ARM_USART_SignalEvent_t cb_event)
+{
+    return PTY_USART_Initialize(cb_event, &PTY_Resources[1]);
+}
+
+static int32_t PTY1_Uninitialize(void)
+{
+    return PTY_USART_Uninitialize(&PTY_Resources[1]);
+}
+
+static int32_t PTY1_PowerControl(ARM_POWER_STATE state)
+{
+    return PTY_USART_PowerControl(state, &PTY_Resources[1]);
+}
+
+static int32_t PTY1_Send(const void *data, uint32_t num)
+{
+    return PTY_USART_Send(data, num, &PTY_Resources[1]);
+}
+
+static int32_t PTY1_Receive(void *data, uint32_t num)
+{
+    return PTY_USART_Receive(data, num, &PTY_Resources[1]);
+}
+
+static int32_t PTY1_Transfer(const void *data_out, void *data_in, uint32_t num)
+{
+    return ARM_DRIVER_ERROR_UNSUPPORTED;
+}
+
+static uint32_t PTY1_GetTxCount(void)
+{
+    return PTY_USART_GetTxCount(&PTY_Resources[1]);
+}
+
+static uint32_t PTY1_GetRxCount(void)
+{
+    return PTY_USART_GetRxCount(&PTY_Resources[1]);
+}
+
+static int32_t PTY1_Control(uint32_t control, uint32_t arg)
+{
+    return PTY_USART_Control(control, arg, &PTY_Resources[1]);
+}
+
+static ARM_USART_STATUS PTY1_GetStatus(void)
+{
+    return PTY_USART_GetStatus(&PTY_Resources[1]);
+}
+
+static int32_t PTY1_SetModemControl(ARM_USART_MODEM_CONTROL control)
+{
+    return PTY_USART_SetModemControl(control, &PTY_Resources[1]);
+}
+
+static ARM_USART_MODEM_STATUS PTY1_GetModemStatus(void)
+{
+    return PTY_USART_GetModemStatus(&PTY_Resources[1]);
+}
+
+ARM_DRIVER_USART Driver_USART_PTY0 = {
+    ARM_GetVersion,
+    ARM_GetCapabilities,
+    PTY0_Initialize,
+    PTY0_Uninitialize,
+    PTY0_PowerControl,
+    PTY0_Send,
+    PTY0_Receive,
+    PTY0_Transfer,
+    PTY0_GetTxCount,
+    PTY0_GetRxCount,
+    PTY0_Control,
+    PTY0_GetStatus,
+    PTY0_SetModemControl,
+    PTY0_GetModemStatus
+};
+
+ARM_DRIVER_USART Driver_USART_PTY1 = {
+    ARM_GetVersion,
+    ARM_GetCapabilities,
+    PTY1_Initialize,
+    PTY1_Uninitialize,
+    PTY1_PowerControl,
+    PTY1_Send,
+    PTY1_Receive,
+    PTY1_Transfer,
+    PTY1_GetTxCount,
+    PTY1_GetRxCount,
+    PTY1_Control,
+    PTY1_GetStatus,
+    PTY1_SetModemControl,
+    PTY1_GetModemStatus
+};
@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2020 Màrius Montón <marius.monton@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the License); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an AS IS BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Project:   CMSIS USART Driver over Linux pseudo terminals
+ */
+
+#include "Driver_USART.h"
+
+#define USART_PTY_INSTANCES (2)
+
+extern ARM_DRIVER_USART Driver_USART_PTY0;
+extern ARM_DRIVER_USART Driver_USART_PTY1;
+
+/**
+ * Opens the device of an instance, before calling its Initialize function
+ * @param instance driver instance (0 for Driver_USART_PTY0...)
+ * @param path device to open (pty slave such as /dev/pts/3, or a serial port),
+ *             NULL to create a new pty
+ * @return path of the device (the one to give to the other end for a new pty), NULL on error
+ */
+const char *USART_PTY_Open(uint32_t instance, const char *path);
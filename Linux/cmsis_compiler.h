@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2020 Màrius Montón <marius.monton@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the License); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an AS IS BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Project:   Host replacement of CMSIS cmsis_compiler.h
+ *
+ * Only the macros used by the vendor independent code (Examples/), so it can be
+ * built for a Linux host. Put this directory first in the include path.
+ */
+
+#ifndef __CMSIS_COMPILER_H
+#define __CMSIS_COMPILER_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define __WEAK __attribute__((weak))
+#define __ALIGNED(x) __attribute__((aligned(x)))
+#define __STATIC_INLINE static inline
+#define __DMB() __sync_synchronize()
+
+/* There are no events to wait for on a host, sleep 100 us instead of spinning */
+#define __WFE() nanosleep(&(const struct timespec) { 0, 100000 }, NULL)
+
+#endif
@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2020 Màrius Montón <marius.monton@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the License); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an AS IS BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Project:   MODBUS CRC16 benchmark for Linux hosts
+ *
+ * Checks every CRC16 kernel gives the same result as the byte table one on
+ * random frames and reports its throughput.
+ *
+ * Build & run (from this directory):
+ *   gcc -O2 -DCRC16_ALL_IMPLEMENTATIONS -I../Examples crc16_bench.c ../Examples/modbus_crc.c -o crc16_bench
+ *   ./crc16_bench
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "modbus_crc.h"
+
+#define FRAMES (4096)
+#define MAX_FRAME_LEN (256)
+#define ROUNDS (200)
+
+typedef uint16_t (*crc16_kernel_t)(uint16_t crc, const uint8_t * nData, uint32_t wLength);
+
+typedef struct {
+    const char *name;
+    crc16_kernel_t kernel;
+} kernel_t;
+
+static const kernel_t kernels[] = {
+    {"table", CRC16_Update_Table},
+    {"nibble", CRC16_Update_Nibble},
+    {"slice4", CRC16_Update_Slice4},
+    {"slice8", CRC16_Update_Slice8},
+};
+
+static uint8_t frames[FRAMES][MAX_FRAME_LEN];
+static uint16_t frame_len[FRAMES];
+
+/* Cycle counter where the architecture has one, nanoseconds otherwise */
+static uint64_t get_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+#endif
+}
+
+static bool check_kernel(const kernel_t * k)
+{
+    int i;
+    uint32_t split;
+    uint16_t crc;
+    uint16_t ref;
+
+    for (i = 0; i < FRAMES; i++) {
+        ref = CRC16_Update_Table(CRC16_Init(), frames[i], frame_len[i]);
+
+        /* Whole frame */
+        crc = k->kernel(CRC16_Init(), frames[i], frame_len[i]);
+        if (crc != ref) {
+            printf("%s: mismatch on frame %d (len %d): %04X != %04X\n", k->name, i, frame_len[i], crc, ref);
+            return false;
+        }
+
+        /* Same frame fed in two chunks, as the receive path does */
+        split = rand() % (frame_len[i] + 1);
+        crc = k->kernel(CRC16_Init(), frames[i], split);
+        crc = k->kernel(crc, &frames[i][split], frame_len[i] - split);
+        if (crc != ref) {
+            printf("%s: incremental mismatch on frame %d (split %u)\n", k->name, i, split);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void bench_kernel(const kernel_t * k)
+{
+    int i;
+    int r;
+    uint64_t start;
+    uint64_t cycles;
+    uint64_t bytes = 0;
+    volatile uint16_t sink = 0;
+
+    /* Warm up caches and slicing tables */
+    for (i = 0; i < FRAMES; i++) {
+        sink ^= k->kernel(CRC16_Init(), frames[i], frame_len[i]);
+    }
+
+    start = get_cycles();
+    for (r = 0; r < ROUNDS; r++) {
+        for (i = 0; i < FRAMES; i++) {
+            sink ^= k->kernel(CRC16_Init(), frames[i], frame_len[i]);
+            bytes += frame_len[i];
+        }
+    }
+    cycles = get_cycles() - start;
+
+    printf("%-8s %10.3f bytes/%s %10.2f %s/frame\n", k->name,
+           (double)bytes / cycles,
+#if defined(__x86_64__) || defined(__i386__)
+           "cycle", (double)cycles / (ROUNDS * FRAMES), "cycles"
+#else
+           "ns", (double)cycles / (ROUNDS * FRAMES), "ns"
+#endif
+        );
+}
+
+int main(void)
+{
+    int i;
+    int j;
+    unsigned int k;
+    bool ok = true;
+
+    srand(1234);
+
+    /* Random frames from 4 bytes (shortest MODBUS frame) to a full ADU */
+    for (i = 0; i < FRAMES; i++) {
+        frame_len[i] = 4 + (rand() % (MAX_FRAME_LEN - 3));
+        for (j = 0; j < frame_len[i]; j++) {
+            frames[i][j] = rand();
+        }
+    }
+
+    for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        if (check_kernel(&kernels[k]) == false) {
+            ok = false;
+        }
+    }
+
+    if (ok == false) {
+        return 1;
+    }
+    printf("All kernels match on %d random frames\n", FRAMES);
+
+    for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        bench_kernel(&kernels[k]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,536 @@
+/*
+ * Copyright (c) 2020 Màrius Montón <marius.monton@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the License); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an AS IS BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Project:   MODBUS client load generator and benchmark for Linux hosts
+ *
+ * Runs the MODBUS client (Examples/modbus_client.c) against a simulated USART
+ * driver on a virtual time line: request bytes arrive one character time apart
+ * at the simulated baudrate and responses take their transmission time, so the
+ * results do not depend on the host speed. The client is polled the way a MCU
+ * does it, when a byte arrives, a transmission ends or the 1 ms tick elapses.
+ *
+ * A mix of function 3, 6 and 16 requests is sent for several register counts, as
+ * a master would (each request t3.5 after the previous response). For each count
+ * it reports:
+ * - requests per second the line can carry
+ * - turnaround, from the last byte of the request to the first of the response
+ *   (p50 and p99, in line time)
+ * - CPU time spent in the client per request (MODBUS_Poll and the driver events),
+ *   in cycles where the architecture has a counter, nanoseconds otherwise
+ *
+ * Build & run (from this directory, CMSIS_5 is a checkout of the CMSIS repository):
+ *   gcc -O2 -I. -I../Examples -I<CMSIS_5>/CMSIS/Driver/Include \
+ *       modbus_bench.c ../Examples/modbus_client.c ../Examples/modbus_crc.c -o modbus_bench
+ *   ./modbus_bench [-b baudrate] [-n requests] [-m read/write_single/write_multiple percentages]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "cmsis_compiler.h"
+#include "Driver_USART.h"
+#include "modbus_client.h"
+#include "modbus_crc.h"
+
+#define NUM_REGISTERS (1000)
+#define SLAVE_ADDRESS (1)
+#define MAX_FRAME (MODBUS_MAX_RECV_BUFF)
+
+#define READ_HOLDING_REGS (3)
+#define WRITE_SINGLE_REG (6)
+#define WRITE_MULTS_REGS (16)
+
+static const uint16_t reg_counts[] = { 1, 4, 16, 64, 123 };
+
+/* Simulated line, times in microseconds */
+typedef struct {
+    uint64_t now;
+    uint32_t baudrate;          /* Set by the client */
+    ARM_USART_SignalEvent_t cb_event;
+
+    /* Request being received by the client */
+    uint8_t req[MAX_FRAME];
+    uint32_t req_len;
+    uint32_t req_sent;          /* Bytes already on the line */
+    uint64_t req_start;
+    uint8_t *rx_buf;
+    uint32_t rx_num;
+    uint32_t rx_cnt;
+    bool rx_busy;
+    uint32_t lost;              /* Bytes arriving without a reception armed */
+
+    /* Response being sent by the client */
+    uint8_t resp[MAX_FRAME];
+    uint32_t resp_len;
+    uint64_t resp_start;
+    uint64_t tx_done;
+    bool tx_busy;
+} SIM_LINE;
+
+static SIM_LINE line;
+static uint16_t my_registers[NUM_REGISTERS];
+
+static uint64_t cpu_cycles;     /* Spent in the client since the last reset */
+
+/* Cycle counter where the architecture has one, nanoseconds otherwise */
+static uint64_t get_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+#endif
+}
+
+/* Milliseconds time base of the MODBUS client, on the virtual time line */
+uint32_t getSysTicks(void)
+{
+    return (uint32_t) (line.now / 1000);
+}
+
+/* Microseconds time base of the MODBUS client, on the virtual time line */
+uint32_t getSysMicros(void)
+{
+    return (uint32_t) line.now;
+}
+
+static uint64_t char_time(void)
+{
+    /* 11 bits per character (start, 8 data, parity or 2nd stop, stop) */
+    return (11000000ULL + line.baudrate - 1) / line.baudrate;
+}
+
+static bool read_registers(uint16_t addr, uint16_t num, uint16_t * data)
+{
+    if ((addr + num) > NUM_REGISTERS) {
+        return false;
+    }
+
+    memcpy(data, &my_registers[addr], num * sizeof(uint16_t));
+    return true;
+}
+
+static bool write_registers(uint16_t addr, uint16_t num, const uint16_t * data)
+{
+    if ((addr + num) > NUM_REGISTERS) {
+        return false;
+    }
+
+    memcpy(&my_registers[addr], data, num * sizeof(uint16_t));
+    return true;
+}
+
+static void signal_event(uint32_t event)
+{
+    uint64_t start = get_cycles();
+
+    line.cb_event(event);
+    cpu_cycles += get_cycles() - start;
+}
+
+static ARM_DRIVER_VERSION SIM_GetVersion(void)
+{
+    ARM_DRIVER_VERSION version = { ARM_USART_API_VERSION, ARM_DRIVER_VERSION_MAJOR_MINOR(1, 0) };
+
+    return version;
+}
+
+static ARM_USART_CAPABILITIES SIM_GetCapabilities(void)
+{
+    ARM_USART_CAPABILITIES capabilities = { 0 };
+
+    capabilities.asynchronous = 1;
+    capabilities.event_tx_complete = 1;
+    return capabilities;
+}
+
+static int32_t SIM_Initialize(ARM_USART_SignalEvent_t cb_event)
+{
+    line.cb_event = cb_event;
+    return ARM_DRIVER_OK;
+}
+
+static int32_t SIM_Uninitialize(void)
+{
+    return ARM_DRIVER_OK;
+}
+
+static int32_t SIM_PowerControl(ARM_POWER_STATE state)
+{
+    return ARM_DRIVER_OK;
+}
+
+static int32_t SIM_Send(const void *data, uint32_t num)
+{
+    if (line.tx_busy) {
+        return ARM_DRIVER_ERROR_BUSY;
+    }
+
+    memcpy(line.resp, data, num);
+    line.resp_len = num;
+    line.resp_start = line.now;
+    line.tx_done = line.now + (num * char_time());
+    line.tx_busy = true;
+    return ARM_DRIVER_OK;
+}
+
+static int32_t SIM_Receive(void *data, uint32_t num)
+{
+    if (line.rx_busy) {
+        return ARM_DRIVER_ERROR_BUSY;
+    }
+
+    line.rx_buf = data;
+    line.rx_num = num;
+    line.rx_cnt = 0;
+    line.rx_busy = true;
+    return ARM_DRIVER_OK;
+}
+
+static int32_t SIM_Transfer(const void *data_out, void *data_in, uint32_t num)
+{
+    return ARM_DRIVER_ERROR_UNSUPPORTED;
+}
+
+static uint32_t SIM_GetTxCount(void)
+{
+    return line.tx_busy ? 0 : line.resp_len;
+}
+
+static uint32_t SIM_GetRxCount(void)
+{
+    return line.rx_cnt;
+}
+
+static int32_t SIM_Control(uint32_t control, uint32_t arg)
+{
+    switch (control & ARM_USART_CONTROL_Msk) {
+    case ARM_USART_MODE_ASYNCHRONOUS:
+        line.baudrate = arg;
+        break;
+    case ARM_USART_ABORT_RECEIVE:
+        line.rx_busy = false;
+        break;
+    case ARM_USART_ABORT_SEND:
+        line.tx_busy = false;
+        break;
+    default:
+        break;
+    }
+
+    return ARM_DRIVER_OK;
+}
+
+static ARM_USART_STATUS SIM_GetStatus(void)
+{
+    ARM_USART_STATUS status = { 0 };
+
+    status.tx_busy = line.tx_busy;
+    status.rx_busy = line.rx_busy;
+    return status;
+}
+
+static int32_t SIM_SetModemControl(ARM_USART_MODEM_CONTROL control)
+{
+    return ARM_DRIVER_ERROR_UNSUPPORTED;
+}
+
+static ARM_USART_MODEM_STATUS SIM_GetModemStatus(void)
+{
+    ARM_USART_MODEM_STATUS modem_status = { 0 };
+
+    return modem_status;
+}
+
+static ARM_DRIVER_USART Driver_USART_SIM = {
+    SIM_GetVersion,
+    SIM_GetCapabilities,
+    SIM_Initialize,
+    SIM_Uninitialize,
+    SIM_PowerControl,
+    SIM_Send,
+    SIM_Receive,
+    SIM_Transfer,
+    SIM_GetTxCount,
+    SIM_GetRxCount,
+    SIM_Control,
+    SIM_GetStatus,
+    SIM_SetModemControl,
+    SIM_GetModemStatus
+};
+
+/**
+ * Builds a random request of the workload into line.req
+ * @param num registers of function 3 and 16 requests
+ * @return function code of the request
+ */
+static uint8_t build_request(uint16_t num, const int *mix)
+{
+    uint8_t *pkt = line.req;
+    uint16_t addr = rand() % (NUM_REGISTERS - num + 1);
+    uint16_t crc;
+    uint32_t len;
+    uint32_t i;
+    int pick = rand() % 100;
+
+    pkt[0] = SLAVE_ADDRESS;
+    pkt[2] = addr >> 8;
+    pkt[3] = addr & 0xFF;
+
+    if (pick < mix[0]) {
+        pkt[1] = READ_HOLDING_REGS;
+        pkt[4] = num >> 8;
+        pkt[5] = num & 0xFF;
+        len = 6;
+    } else if (pick < (mix[0] + mix[1])) {
+        pkt[1] = WRITE_SINGLE_REG;
+        pkt[4] = rand();
+        pkt[5] = rand();
+        len = 6;
+    } else {
+        pkt[1] = WRITE_MULTS_REGS;
+        pkt[4] = num >> 8;
+        pkt[5] = num & 0xFF;
+        pkt[6] = num * 2;
+        for (i = 0; i < (num * 2U); i++) {
+            pkt[7 + i] = rand();
+        }
+        len = 7 + (num * 2);
+    }
+
+    crc = CRC16(pkt, len);
+    pkt[len] = crc & 0x00FF;
+    pkt[len + 1] = crc >> 8;
+    line.req_len = len + 2;
+
+    return pkt[1];
+}
+
+/* Checks the response to the request on the line is well formed */
+static bool check_response(void)
+{
+    const uint8_t *req = line.req;
+    const uint8_t *resp = line.resp;
+
+    if ((line.resp_len < 5) || (CRC16(resp, line.resp_len) != 0) || (resp[0] != req[0]) || (resp[1] != req[1])) {
+        return false;
+    }
+
+    if (req[1] == READ_HOLDING_REGS) {
+        return line.resp_len == (5U + (req[5] * 2U));
+    }
+
+    /* Writes echo the address and the value or number of registers */
+    return (line.resp_len == 8) && (memcmp(&resp[2], &req[2], 4) == 0);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Advances the virtual time line to its next event and signals the client */
+static void advance_line(void)
+{
+    uint64_t next = ((line.now / 1000) + 1) * 1000;     /* SysTick */
+    uint64_t byte_time = line.req_start + ((line.req_sent + 1) * char_time());
+
+    if ((line.req_sent < line.req_len) && (byte_time < next)) {
+        next = byte_time;
+    }
+    if (line.tx_busy && (line.tx_done < next)) {
+        next = line.tx_done;
+    }
+    line.now = next;
+
+    if ((line.req_sent < line.req_len) && (byte_time == line.now)) {
+        if (line.rx_busy && (line.rx_cnt < line.rx_num)) {
+            line.rx_buf[line.rx_cnt++] = line.req[line.req_sent];
+            if (line.rx_cnt == line.rx_num) {
+                line.rx_busy = false;
+                signal_event(ARM_USART_EVENT_RECEIVE_COMPLETE);
+            }
+        } else {
+            line.lost++;
+        }
+        line.req_sent++;
+    }
+
+    if (line.tx_busy && (line.tx_done == line.now)) {
+        line.tx_busy = false;
+        signal_event(ARM_USART_EVENT_SEND_COMPLETE | ARM_USART_EVENT_TX_COMPLETE);
+    }
+}
+
+static void poll_client(MODBUS_CLIENT * client)
+{
+    uint64_t start = get_cycles();
+
+    MODBUS_Poll(client);
+    cpu_cycles += get_cycles() - start;
+}
+
+/**
+ * Runs a workload of requests of 'num' registers
+ * @return false if a response is missing or wrong
+ */
+static bool run_workload(MODBUS_CLIENT * client, uint16_t num, uint32_t requests, const int *mix)
+{
+    uint64_t *turnaround;
+    uint64_t *cycles;
+    uint64_t t35;
+    uint64_t start_time;
+    uint64_t deadline;
+    uint64_t total_cycles = 0;
+    uint32_t errors = 0;
+    uint32_t i;
+
+    turnaround = malloc(requests * sizeof(uint64_t));
+    cycles = malloc(requests * sizeof(uint64_t));
+    if ((turnaround == NULL) || (cycles == NULL)) {
+        return false;
+    }
+
+    /* Silence the master leaves between frames */
+    t35 = (line.baudrate > 19200) ? 1750 : ((38500000ULL + line.baudrate - 1) / line.baudrate);
+
+    start_time = line.now;
+    for (i = 0; i < requests; i++) {
+        build_request(num, mix);
+        line.req_start = line.now + t35;
+        line.req_sent = 0;
+        line.resp_len = 0;
+        cpu_cycles = 0;
+
+        /* Until the response leaves the line (or the client gives up on the request) */
+        deadline = line.req_start + ((line.req_len + MAX_FRAME) * char_time()) + 100000;
+        while ((line.req_sent < line.req_len) || (line.resp_len == 0) || line.tx_busy) {
+            if (line.now >= deadline) {
+                break;
+            }
+            advance_line();
+            poll_client(client);
+        }
+
+        if ((line.resp_len == 0) || !check_response()) {
+            errors++;
+            turnaround[i] = 0;
+        } else {
+            turnaround[i] = line.resp_start - (line.req_start + (line.req_len * char_time()));
+        }
+        cycles[i] = cpu_cycles;
+    }
+
+    qsort(turnaround, requests, sizeof(uint64_t), cmp_u64);
+    qsort(cycles, requests, sizeof(uint64_t), cmp_u64);
+
+    for (i = 0; i < requests; i++) {
+        total_cycles += cycles[i];
+    }
+
+    printf("%5u %10.1f %12.3f %12.3f %12.1f %12.0f %7u\n", num,
+           requests / ((line.now - start_time) / 1e6),
+           turnaround[(requests - 1) / 2] / 1000.0, turnaround[((uint64_t) (requests - 1) * 99) / 100] / 1000.0,
+           (double)total_cycles / requests, (double)cycles[((uint64_t) (requests - 1) * 99) / 100], errors);
+
+    free(turnaround);
+    free(cycles);
+
+    return errors == 0;
+}
+
+int main(int argc, char *argv[])
+{
+    static MODBUS_CLIENT client;
+    MODBUS_LINE_CONFIG line_cfg = MODBUS_LINE_CONFIG_DEFAULT;
+    uint32_t requests = 10000;
+    int mix[3] = { 50, 20, 30 };
+    bool ok = true;
+    unsigned int k;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "b:n:m:")) != -1) {
+        switch (opt) {
+        case 'b':
+            line_cfg.baudrate = atoi(optarg);
+            break;
+        case 'n':
+            requests = atoi(optarg);
+            break;
+        case 'm':
+            if ((sscanf(optarg, "%d/%d/%d", &mix[0], &mix[1], &mix[2]) != 3) || ((mix[0] + mix[1] + mix[2]) != 100)) {
+                fprintf(stderr, "The mix must be three percentages adding 100, such as 50/20/30\n");
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-b baudrate] [-n requests] [-m fc3/fc6/fc16 percentages]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (requests == 0) {
+        return 1;
+    }
+
+    srand(1234);
+    for (i = 0; i < NUM_REGISTERS; i++) {
+        my_registers[i] = i;
+    }
+
+    if (!MODBUS_Init(&client, &Driver_USART_SIM, &line_cfg)) {
+        fprintf(stderr, "Cannot initialize the MODBUS client\n");
+        return 1;
+    }
+    MODBUS_SetRegisterCallbacks(&client, read_registers, write_registers);
+    MODBUS_SetAddress(&client, SLAVE_ADDRESS);
+
+    printf("%u requests per count at %u bps, mix fc3/fc6/fc16 %d/%d/%d %%\n", requests, line.baudrate, mix[0],
+           mix[1], mix[2]);
+#if defined(__x86_64__) || defined(__i386__)
+    printf("%5s %10s %12s %12s %12s %12s %7s\n", "regs", "req/s", "p50 ms", "p99 ms", "cycles/req", "p99 cycles",
+           "errors");
+#else
+    printf("%5s %10s %12s %12s %12s %12s %7s\n", "regs", "req/s", "p50 ms", "p99 ms", "ns/req", "p99 ns", "errors");
+#endif
+
+    for (k = 0; k < sizeof(reg_counts) / sizeof(reg_counts[0]); k++) {
+        if (!run_workload(&client, reg_counts[k], requests, mix)) {
+            ok = false;
+        }
+    }
+
+    if (line.lost > 0) {
+        printf("%u bytes arrived without a reception armed\n", line.lost);
+    }
+
+    return ok ? 0 : 1;
+}
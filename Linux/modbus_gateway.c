@@ -0,0 +1,565 @@
+/*
+ * Copyright (c) 2020 Màrius Montón <marius.monton@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the License); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an AS IS BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Project:   MODBUS TCP to RTU gateway for Linux hosts
+ *
+ * Accepts MODBUS TCP clients and forwards their requests to RTU slaves through
+ * the MODBUS master (Examples/modbus_master.c) running on the pty USART driver.
+ * Requests are queued as raw transactions, so the master keeps the line timing,
+ * the response timeout and the retries, and the slaves see one request at a time.
+ *
+ * - The unit identifier selects the serial port and slave address (1..247 go to
+ *   the first port with the same address by default, -m changes it). Unmapped
+ *   units get exception 0x0A, slaves not answering exception 0x0B.
+ * - Several requests can be in flight per connection, up to MAX_PENDING overall.
+ *   When all are in use the sockets are not read until one completes.
+ * - The latency from request to response is measured for each transaction and
+ *   summarized every second and at exit (Ctrl+C).
+ *
+ * Build & run (from this directory, CMSIS_5 is a checkout of the CMSIS repository):
+ *   gcc -O2 -DMODBUS_MAX_MASTERS=2 -I. -I../Examples -I<CMSIS_5>/CMSIS/Driver/Include \
+ *       modbus_gateway.c Driver_USART_pty.c ../Examples/modbus_master.c ../Examples/modbus_crc.c \
+ *       -lpthread -o modbus_gateway
+ *   ./modbus_gateway -p 5020 -d /dev/ttyUSB0 -b 19200 -P E
+ *
+ * Without -d a pty is created and its path printed, modbus_slave_sim can serve it.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "cmsis_compiler.h"
+#include "Driver_USART_pty.h"
+#include "modbus_master.h"
+
+#define MAX_PORTS (MODBUS_MAX_MASTERS)
+#define MAX_CONNECTIONS (8)
+#define MAX_PENDING (64)
+#define MAX_SAMPLES (1 << 20)
+
+#define MBAP_LEN (7)
+#define MAX_ADU_LEN (MBAP_LEN + MODBUS_MAX_PDU)
+
+#define EXCEPTION_FLAG (0x80)
+#define GATEWAY_PATH_UNAVAILABLE (0x0A)
+#define GATEWAY_TARGET_FAILED (0x0B)
+
+typedef struct {
+    int fd;                     /* -1 if free */
+    uint32_t generation;        /* Tells apart the connections using the same slot */
+    uint8_t rx[MAX_ADU_LEN];
+    uint32_t rx_len;
+} CONNECTION;
+
+/* A request forwarded to a RTU slave */
+typedef struct {
+    MODBUS_TRANSACTION trans;   /* First, the done callback gets its address */
+    uint8_t pdu[MODBUS_MAX_PDU];
+    bool used;
+    int conn;
+    uint32_t generation;
+    uint8_t mbap[MBAP_LEN];
+    uint64_t start_us;
+} PENDING;
+
+typedef struct {
+    bool valid;
+    uint8_t port;
+    uint8_t slave;
+} ROUTE;
+
+typedef struct {
+    uint32_t *samples;
+    uint32_t count;
+    uint32_t max;
+} LATENCY;
+
+static MODBUS_MASTER masters[MAX_PORTS];
+static ARM_DRIVER_USART *const drivers[USART_PTY_INSTANCES] = { &Driver_USART_PTY0, &Driver_USART_PTY1 };
+
+static int num_ports;
+static CONNECTION connections[MAX_CONNECTIONS];
+static PENDING pending[MAX_PENDING];
+static int pending_used;
+static ROUTE routes[256];
+static bool verbose;
+static volatile sig_atomic_t stop;
+
+static LATENCY interval;        /* Since the last summary */
+static LATENCY total;
+static uint32_t interval_errors;
+static uint32_t total_errors;
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+/* Milliseconds time base of the MODBUS master */
+uint32_t getSysTicks(void)
+{
+    return (uint32_t) (now_us() / 1000);
+}
+
+static void on_signal(int sig)
+{
+    stop = 1;
+}
+
+static void latency_add(LATENCY * lat, uint32_t us)
+{
+    if (lat->count < MAX_SAMPLES) {
+        lat->samples[lat->count++] = us;
+    }
+    if (us > lat->max) {
+        lat->max = us;
+    }
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void latency_print(const char *title, LATENCY * lat, double seconds, uint32_t errors)
+{
+    uint32_t p50 = 0;
+    uint32_t p99 = 0;
+
+    if (lat->count > 0) {
+        qsort(lat->samples, lat->count, sizeof(lat->samples[0]), cmp_u32);
+        p50 = lat->samples[(lat->count - 1) / 2];
+        p99 = lat->samples[((uint64_t) (lat->count - 1) * 99) / 100];
+    }
+
+    printf("%s: %u transactions (%.1f/s), %u failed, latency p50 %.2f ms p99 %.2f ms max %.2f ms\n",
+           title, lat->count, lat->count / seconds, errors, p50 / 1000.0, p99 / 1000.0, lat->max / 1000.0);
+    fflush(stdout);
+}
+
+static void send_adu(int conn, const uint8_t * mbap, const uint8_t * pdu, uint16_t pdu_len)
+{
+    uint8_t adu[MAX_ADU_LEN];
+    uint16_t len = pdu_len + 1;
+
+    memcpy(adu, mbap, MBAP_LEN);
+    adu[4] = len >> 8;
+    adu[5] = len & 0xFF;
+    memcpy(&adu[MBAP_LEN], pdu, pdu_len);
+
+    /* Responses are small, a connection not taking one at once is dropped */
+    if (send(connections[conn].fd, adu, MBAP_LEN + pdu_len, MSG_NOSIGNAL) != (ssize_t) (MBAP_LEN + pdu_len)) {
+        close(connections[conn].fd);
+        connections[conn].fd = -1;
+    }
+}
+
+static void send_exception(int conn, const uint8_t * mbap, uint8_t function, uint8_t code)
+{
+    uint8_t pdu[2];
+
+    pdu[0] = function | EXCEPTION_FLAG;
+    pdu[1] = code;
+    send_adu(conn, mbap, pdu, sizeof(pdu));
+}
+
+/* Called by the master when a forwarded request ends */
+static void transaction_done(MODBUS_TRANSACTION * trans)
+{
+    PENDING *p = (PENDING *) trans;
+    uint32_t us = now_us() - p->start_us;
+    bool alive = (connections[p->conn].fd >= 0) && (connections[p->conn].generation == p->generation);
+
+    if ((trans->status == MODBUS_TRANS_DONE) || (trans->status == MODBUS_TRANS_EXCEPTION)) {
+        latency_add(&interval, us);
+        latency_add(&total, us);
+    } else {
+        interval_errors++;
+        total_errors++;
+    }
+
+    if (verbose) {
+        printf("unit %3u function %3u: status %d, %.2f ms\n", p->mbap[6], p->pdu[0] & ~EXCEPTION_FLAG,
+               trans->status, us / 1000.0);
+    }
+
+    /* Broadcasts are not answered */
+    if (alive && (trans->slave != 0)) {
+        if ((trans->status == MODBUS_TRANS_DONE) || (trans->status == MODBUS_TRANS_EXCEPTION)) {
+            send_adu(p->conn, p->mbap, trans->pdu, trans->pdu_len);
+        } else {
+            send_exception(p->conn, p->mbap, p->pdu[0], GATEWAY_TARGET_FAILED);
+        }
+    }
+
+    p->used = false;
+    pending_used--;
+}
+
+/**
+ * Forwards a complete MODBUS TCP request to its slave
+ * @return false if the pending pool is full (the request must be retried later)
+ */
+static bool forward_request(int conn, const uint8_t * adu, uint16_t pdu_len)
+{
+    const ROUTE *route = &routes[adu[6]];
+    PENDING *p = NULL;
+    int i;
+
+    if (!route->valid) {
+        send_exception(conn, adu, adu[MBAP_LEN], GATEWAY_PATH_UNAVAILABLE);
+        return true;
+    }
+
+    for (i = 0; i < MAX_PENDING; i++) {
+        if (!pending[i].used) {
+            p = &pending[i];
+            break;
+        }
+    }
+    if (p == NULL) {
+        return false;
+    }
+
+    memcpy(p->mbap, adu, MBAP_LEN);
+    memcpy(p->pdu, &adu[MBAP_LEN], pdu_len);
+    p->conn = conn;
+    p->generation = connections[conn].generation;
+    p->start_us = now_us();
+    p->trans.type = MODBUS_TRANS_RAW;
+    p->trans.slave = route->slave;
+    p->trans.pdu = p->pdu;
+    p->trans.pdu_len = pdu_len;
+    p->trans.done_cb = transaction_done;
+
+    if (!MODBUS_Master_Submit(&masters[route->port], &p->trans)) {
+        send_exception(conn, adu, adu[MBAP_LEN], GATEWAY_PATH_UNAVAILABLE);
+        return true;
+    }
+
+    p->used = true;
+    pending_used++;
+    return true;
+}
+
+/* Forwards the complete requests received on a connection, as long as there is room */
+static void process_connection(int conn)
+{
+    CONNECTION *c = &connections[conn];
+    uint16_t proto;
+    uint16_t len;
+
+    while ((c->fd >= 0) && (c->rx_len >= MBAP_LEN)) {
+        proto = (c->rx[2] << 8) | c->rx[3];
+        len = (c->rx[4] << 8) | c->rx[5];
+
+        /* Length counts the unit identifier and the PDU */
+        if ((proto != 0) || (len < 2) || (len > (MODBUS_MAX_PDU + 1))) {
+            close(c->fd);
+            c->fd = -1;
+            return;
+        }
+        if (c->rx_len < (uint32_t) (6 + len)) {
+            return;
+        }
+
+        if (!forward_request(conn, c->rx, len - 1)) {
+            return;
+        }
+
+        c->rx_len -= 6 + len;
+        memmove(c->rx, &c->rx[6 + len], c->rx_len);
+    }
+}
+
+static void accept_connection(int listen_fd)
+{
+    int fd;
+    int one = 1;
+    int i;
+
+    fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+        return;
+    }
+
+    for (i = 0; i < MAX_CONNECTIONS; i++) {
+        if (connections[i].fd < 0) {
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            connections[i].fd = fd;
+            connections[i].generation++;
+            connections[i].rx_len = 0;
+            return;
+        }
+    }
+
+    close(fd);
+}
+
+static void read_connection(int conn)
+{
+    CONNECTION *c = &connections[conn];
+    ssize_t n;
+
+    n = recv(c->fd, &c->rx[c->rx_len], sizeof(c->rx) - c->rx_len, 0);
+    if (n <= 0) {
+        close(c->fd);
+        c->fd = -1;
+        return;
+    }
+
+    c->rx_len += n;
+    process_connection(conn);
+}
+
+/* unit=port:slave */
+static bool parse_route(const char *arg)
+{
+    unsigned int unit;
+    unsigned int port;
+    unsigned int slave;
+
+    if ((sscanf(arg, "%u=%u:%u", &unit, &port, &slave) != 3) || (unit > 255) || (port >= (unsigned int)num_ports)
+        || (slave > 247)) {
+        return false;
+    }
+
+    routes[unit].valid = true;
+    routes[unit].port = port;
+    routes[unit].slave = slave;
+    return true;
+}
+
+/* N (none), E (even) or O (odd) */
+static bool parse_parity(const char *arg, uint32_t *parity)
+{
+    if (strcmp(arg, "N") == 0) {
+        *parity = ARM_USART_PARITY_NONE;
+    } else if (strcmp(arg, "E") == 0) {
+        *parity = ARM_USART_PARITY_EVEN;
+    } else if (strcmp(arg, "O") == 0) {
+        *parity = ARM_USART_PARITY_ODD;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-p tcp_port] [-d device]... [-b baudrate] [-P N|E|O] [-m unit=port:slave]... [-v]\n",
+            name);
+    fprintf(stderr, "  -d  serial port or pty of a RTU bus (up to %d), a new pty if none\n", MAX_PORTS);
+    fprintf(stderr, "  -b  rate of the RTU buses, 9600 if none\n");
+    fprintf(stderr, "  -P  parity of the RTU buses (one stop bit), none if not given\n");
+    fprintf(stderr, "  -m  routes a unit identifier to a slave of a port (default unit N to slave N of port 0)\n");
+    fprintf(stderr, "  -v  prints every transaction\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *devices[MAX_PORTS];
+    const char *maps[256];
+    MODBUS_LINE_CONFIG line = MODBUS_LINE_CONFIG_DEFAULT;
+    int num_maps = 0;
+    int tcp_port = 5020;
+    struct sockaddr_in addr;
+    struct pollfd fds[1 + MAX_CONNECTIONS];
+    int conn_of[1 + MAX_CONNECTIONS];
+    int listen_fd;
+    int one = 1;
+    int nfds;
+    int opt;
+    int i;
+    uint64_t last_summary;
+    uint64_t start;
+    uint64_t now;
+    const char *path;
+
+    while ((opt = getopt(argc, argv, "p:d:b:P:m:v")) != -1) {
+        switch (opt) {
+        case 'p':
+            tcp_port = atoi(optarg);
+            break;
+        case 'd':
+            if (num_ports == MAX_PORTS) {
+                fprintf(stderr, "Too many ports, build with -DMODBUS_MAX_MASTERS=2 for two\n");
+                return 1;
+            }
+            devices[num_ports++] = optarg;
+            break;
+        case 'b':
+            line.baudrate = strtoul(optarg, NULL, 10);
+            break;
+        case 'P':
+            if (!parse_parity(optarg, &line.parity)) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'm':
+            if (num_maps < 256) {
+                maps[num_maps++] = optarg;
+            }
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (num_ports == 0) {
+        devices[num_ports++] = NULL;
+    }
+
+    for (i = 0; i < num_ports; i++) {
+        path = USART_PTY_Open(i, devices[i]);
+        if (path == NULL) {
+            fprintf(stderr, "Cannot open %s\n", devices[i] ? devices[i] : "a new pty");
+            return 1;
+        }
+        if (devices[i] == NULL) {
+            printf("RTU port %d on %s\n", i, path);
+        }
+        if (!MODBUS_Master_Init(&masters[i], drivers[i], &line)) {
+            fprintf(stderr, "Cannot initialize RTU port %d\n", i);
+            return 1;
+        }
+    }
+
+    for (i = 1; i <= 247; i++) {
+        routes[i].valid = true;
+        routes[i].port = 0;
+        routes[i].slave = i;
+    }
+    for (i = 0; i < num_maps; i++) {
+        if (!parse_route(maps[i])) {
+            fprintf(stderr, "Wrong mapping %s\n", maps[i]);
+            return 1;
+        }
+    }
+
+    interval.samples = malloc(MAX_SAMPLES * sizeof(uint32_t));
+    total.samples = malloc(MAX_SAMPLES * sizeof(uint32_t));
+    if ((interval.samples == NULL) || (total.samples == NULL)) {
+        return 1;
+    }
+
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(tcp_port);
+    if ((bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) || (listen(listen_fd, MAX_CONNECTIONS) != 0)) {
+        perror("listen");
+        return 1;
+    }
+    printf("MODBUS TCP on port %d\n", tcp_port);
+    fflush(stdout);
+
+    for (i = 0; i < MAX_CONNECTIONS; i++) {
+        connections[i].fd = -1;
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    start = now_us();
+    last_summary = start;
+
+    while (!stop) {
+        nfds = 0;
+        fds[nfds].fd = listen_fd;
+        fds[nfds].events = POLLIN;
+        conn_of[nfds++] = -1;
+
+        /* Backpressure: leave the requests in the sockets while no transaction is free */
+        if (pending_used < MAX_PENDING) {
+            for (i = 0; i < MAX_CONNECTIONS; i++) {
+                if (connections[i].fd >= 0) {
+                    fds[nfds].fd = connections[i].fd;
+                    fds[nfds].events = POLLIN;
+                    conn_of[nfds++] = i;
+                }
+            }
+        }
+
+        /* The master needs the 1 ms time base to follow the line */
+        if (poll(fds, nfds, 1) > 0) {
+            if (fds[0].revents & POLLIN) {
+                accept_connection(listen_fd);
+            }
+            for (i = 1; i < nfds; i++) {
+                if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                    read_connection(conn_of[i]);
+                }
+            }
+        }
+
+        for (i = 0; i < num_ports; i++) {
+            MODBUS_Master_Poll(&masters[i]);
+        }
+
+        /* Requests left behind by a full pool */
+        for (i = 0; i < MAX_CONNECTIONS; i++) {
+            process_connection(i);
+        }
+
+        now = now_us();
+        if ((now - last_summary) >= 1000000) {
+            if ((interval.count > 0) || (interval_errors > 0)) {
+                latency_print("last second", &interval, (now - last_summary) / 1e6, interval_errors);
+            }
+            interval.count = 0;
+            interval.max = 0;
+            interval_errors = 0;
+            last_summary = now;
+        }
+    }
+
+    latency_print("total", &total, (now_us() - start) / 1e6, total_errors);
+
+    for (i = 0; i < num_ports; i++) {
+        drivers[i]->Uninitialize();
+    }
+
+    return 0;
+}
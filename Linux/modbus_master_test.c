@@ -0,0 +1,458 @@
+/*
+ * Copyright (c) 2020 Màrius Montón <marius.monton@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the License); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an AS IS BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Project:   MODBUS RTU master test for Linux hosts
+ *
+ * Runs the MODBUS master (Examples/modbus_master.c) against a simulated USART
+ * and slave on a virtual time line of 1 ms ticks, and checks it recovers when
+ * the driver never signals the end of a transmission (TX error, DE line stuck):
+ * - a read answered normally
+ * - the end of transmission of the first request lost, the retry is answered
+ * - the end of transmission of every try lost, the transaction fails and the
+ *   one queued behind it is still served
+ * - RS-485 asked on a port without DE line, the init fails
+ *
+ * Build & run (from this directory, CMSIS_5 is a checkout of the CMSIS repository):
+ *   gcc -O2 -I. -I../Examples -I<CMSIS_5>/CMSIS/Driver/Include \
+ *       modbus_master_test.c ../Examples/modbus_master.c ../Examples/modbus_crc.c -o modbus_master_test
+ *   ./modbus_master_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "cmsis_compiler.h"
+#include "Driver_USART.h"
+#include "modbus_master.h"
+#include "modbus_crc.h"
+
+#define SLAVE_ADDRESS (1)
+#define OTHER_ADDRESS (2)
+
+#define READ_HOLDING_REGS (3)
+
+/* Time a slave takes to start its response, in ticks */
+#define SLAVE_DELAY (2)
+
+/* Longest a case may run, in ticks */
+#define MAX_CASE_TICKS (10000)
+
+static const uint32_t baudrates[] = { 9600, 115200 };
+
+/* Simulated line and slave, times in ticks */
+typedef struct {
+    uint32_t now;
+    uint32_t baudrate;          /* Set by the master */
+    ARM_USART_SignalEvent_t cb_event;
+
+    uint32_t lost_tx;           /* Sends whose end of transmission is never signaled */
+    uint32_t sends;
+    bool tx_busy;
+    uint32_t tx_done;
+    uint8_t request[MODBUS_MASTER_MAX_BUFF];
+    uint32_t request_len;
+
+    uint8_t *rx_buf;
+    uint32_t rx_num;
+    uint32_t rx_cnt;
+    bool rx_busy;
+    uint8_t response[MODBUS_MASTER_MAX_BUFF];
+    uint32_t response_len;
+    uint32_t response_time;     /* Tick the response is received, 0 if none pending */
+} SIM_LINE;
+
+static SIM_LINE line;
+
+/* Milliseconds time base of the MODBUS master, on the virtual time line */
+uint32_t getSysTicks(void)
+{
+    return line.now;
+}
+
+static ARM_DRIVER_VERSION SIM_GetVersion(void)
+{
+    ARM_DRIVER_VERSION version = { ARM_USART_API_VERSION, ARM_DRIVER_VERSION_MAJOR_MINOR(1, 0) };
+
+    return version;
+}
+
+static ARM_USART_CAPABILITIES SIM_GetCapabilities(void)
+{
+    ARM_USART_CAPABILITIES capabilities = { 0 };
+
+    capabilities.asynchronous = 1;
+    capabilities.event_tx_complete = 1;
+    return capabilities;
+}
+
+static int32_t SIM_Initialize(ARM_USART_SignalEvent_t cb_event)
+{
+    line.cb_event = cb_event;
+    return ARM_DRIVER_OK;
+}
+
+static int32_t SIM_Uninitialize(void)
+{
+    return ARM_DRIVER_OK;
+}
+
+static int32_t SIM_PowerControl(ARM_POWER_STATE state)
+{
+    (void) state;
+    return ARM_DRIVER_OK;
+}
+
+static int32_t SIM_Send(const void *data, uint32_t num)
+{
+    if (line.tx_busy) {
+        return ARM_DRIVER_ERROR_BUSY;
+    }
+
+    memcpy(line.request, data, num);
+    line.request_len = num;
+    line.sends++;
+    line.tx_busy = true;
+    if (line.lost_tx > 0) {
+        /* Never completes, until aborted */
+        line.lost_tx--;
+        line.tx_done = 0;
+    } else {
+        /* 11 bits per character, at least a tick */
+        line.tx_done = line.now + 1 + ((num * 11000UL) / line.baudrate);
+    }
+    return ARM_DRIVER_OK;
+}
+
+static int32_t SIM_Receive(void *data, uint32_t num)
+{
+    if (line.rx_busy) {
+        return ARM_DRIVER_ERROR_BUSY;
+    }
+
+    line.rx_buf = data;
+    line.rx_num = num;
+    line.rx_cnt = 0;
+    line.rx_busy = true;
+    return ARM_DRIVER_OK;
+}
+
+static int32_t SIM_Transfer(const void *data_out, void *data_in, uint32_t num)
+{
+    (void) data_out;
+    (void) data_in;
+    (void) num;
+    return ARM_DRIVER_ERROR_UNSUPPORTED;
+}
+
+static uint32_t SIM_GetTxCount(void)
+{
+    return 0;
+}
+
+static uint32_t SIM_GetRxCount(void)
+{
+    return line.rx_cnt;
+}
+
+static int32_t SIM_Control(uint32_t control, uint32_t arg)
+{
+    switch (control & ARM_USART_CONTROL_Msk) {
+    case ARM_USART_MODE_ASYNCHRONOUS:
+        line.baudrate = arg;
+        break;
+    case ARM_USART_ABORT_RECEIVE:
+        line.rx_busy = false;
+        break;
+    case ARM_USART_ABORT_SEND:
+        line.tx_busy = false;
+        break;
+    case ARM_USART_CONTROL_RS485:
+        /* A plain TTL port, no DE line */
+        return ARM_DRIVER_ERROR_UNSUPPORTED;
+    default:
+        break;
+    }
+
+    return ARM_DRIVER_OK;
+}
+
+static ARM_USART_STATUS SIM_GetStatus(void)
+{
+    ARM_USART_STATUS status = { 0 };
+
+    status.tx_busy = line.tx_busy;
+    status.rx_busy = line.rx_busy;
+    return status;
+}
+
+static int32_t SIM_SetModemControl(ARM_USART_MODEM_CONTROL control)
+{
+    (void) control;
+    return ARM_DRIVER_ERROR_UNSUPPORTED;
+}
+
+static ARM_USART_MODEM_STATUS SIM_GetModemStatus(void)
+{
+    ARM_USART_MODEM_STATUS modem_status = { 0 };
+
+    return modem_status;
+}
+
+static ARM_DRIVER_USART Driver_USART_SIM = {
+    SIM_GetVersion,
+    SIM_GetCapabilities,
+    SIM_Initialize,
+    SIM_Uninitialize,
+    SIM_PowerControl,
+    SIM_Send,
+    SIM_Receive,
+    SIM_Transfer,
+    SIM_GetTxCount,
+    SIM_GetRxCount,
+    SIM_Control,
+    SIM_GetStatus,
+    SIM_SetModemControl,
+    SIM_GetModemStatus
+};
+
+/* Register value the slaves answer, from its slave and address */
+static uint16_t register_value(uint8_t slave, uint16_t addr)
+{
+    return (slave << 12) + addr;
+}
+
+/* The slave answers a function 3 request once it is completely sent */
+static void slave_respond(void)
+{
+    uint16_t addr = (line.request[2] << 8) | line.request[3];
+    uint16_t num = (line.request[4] << 8) | line.request[5];
+    uint16_t value;
+    uint16_t crc;
+    uint16_t i;
+
+    line.response[0] = line.request[0];
+    line.response[1] = READ_HOLDING_REGS;
+    line.response[2] = num * 2;
+    for (i = 0; i < num; i++) {
+        value = register_value(line.request[0], addr + i);
+        line.response[3 + (i * 2)] = value >> 8;
+        line.response[4 + (i * 2)] = value & 0xFF;
+    }
+    line.response_len = 3 + (num * 2);
+    crc = CRC16(line.response, line.response_len);
+    line.response[line.response_len++] = crc & 0x00FF;
+    line.response[line.response_len++] = crc >> 8;
+    line.response_time = line.now + SLAVE_DELAY + ((line.response_len * 11000UL) / line.baudrate);
+}
+
+/* Advances the virtual time line one tick and signals the master */
+static void advance_line(void)
+{
+    line.now++;
+
+    if (line.tx_busy && (line.tx_done != 0) && (line.tx_done <= line.now)) {
+        line.tx_busy = false;
+        line.cb_event(ARM_USART_EVENT_SEND_COMPLETE | ARM_USART_EVENT_TX_COMPLETE);
+        slave_respond();
+    }
+
+    /* Bytes arriving without a reception armed are lost */
+    if ((line.response_time != 0) && (line.response_time <= line.now)) {
+        if (line.rx_busy) {
+            memcpy(line.rx_buf, line.response, line.response_len);
+            line.rx_cnt = line.response_len;
+        }
+        line.response_time = 0;
+    }
+}
+
+/**
+ * Starts a test case on an idle line
+ * @param lost_tx number of sends whose end of transmission is lost
+ */
+static void start_case(MODBUS_MASTER * master, uint32_t baudrate, uint32_t lost_tx)
+{
+    MODBUS_LINE_CONFIG line_cfg = MODBUS_LINE_CONFIG_DEFAULT;
+
+    line.now += 1000;
+    line.lost_tx = lost_tx;
+    line.sends = 0;
+    line.tx_busy = false;
+    line.rx_busy = false;
+    line.response_time = 0;
+
+    line_cfg.baudrate = baudrate;
+    MODBUS_Master_Init(master, &Driver_USART_SIM, &line_cfg);
+}
+
+/* Runs the master until it is idle */
+static bool run_case(MODBUS_MASTER * master)
+{
+    uint32_t start = line.now;
+
+    while (MODBUS_Master_Poll(master)) {
+        if ((line.now - start) > MAX_CASE_TICKS) {
+            return false;
+        }
+        advance_line();
+    }
+    return true;
+}
+
+static void init_read(MODBUS_TRANSACTION * trans, uint8_t slave, uint16_t addr, uint16_t num, uint16_t * data)
+{
+    memset(trans, 0, sizeof(*trans));
+    trans->type = MODBUS_TRANS_READ;
+    trans->slave = slave;
+    trans->addr = addr;
+    trans->num = num;
+    trans->data = data;
+}
+
+/**
+ * Checks a finished read transaction
+ * @return true if it has the expected status (and data, if done)
+ */
+static bool check_read(const char *name, const MODBUS_TRANSACTION * trans, MODBUS_TRANSACTION_STATUS status)
+{
+    uint16_t i;
+
+    if (trans->status != status) {
+        printf("FAIL %-20s %6u bps: status %d, expected %d\n", name, line.baudrate, trans->status, status);
+        return false;
+    }
+
+    if (status == MODBUS_TRANS_DONE) {
+        for (i = 0; i < trans->num; i++) {
+            if (trans->data[i] != register_value(trans->slave, trans->addr + i)) {
+                printf("FAIL %-20s %6u bps: register %u\n", name, line.baudrate, trans->addr + i);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/* A read answered at the first try */
+static bool test_read(MODBUS_MASTER * master, uint32_t baudrate)
+{
+    MODBUS_TRANSACTION trans;
+    uint16_t data[4];
+
+    start_case(master, baudrate, 0);
+    init_read(&trans, SLAVE_ADDRESS, 10, 4, data);
+    MODBUS_Master_Submit(master, &trans);
+    if (!run_case(master)) {
+        printf("FAIL %-20s %6u bps: master stuck\n", "read", baudrate);
+        return false;
+    }
+
+    return check_read("read", &trans, MODBUS_TRANS_DONE) && (line.sends == 1);
+}
+
+/* The end of the first transmission is lost: it is aborted and the retry answered */
+static bool test_tx_lost_once(MODBUS_MASTER * master, uint32_t baudrate)
+{
+    MODBUS_TRANSACTION trans;
+    uint16_t data[4];
+
+    start_case(master, baudrate, 1);
+    init_read(&trans, SLAVE_ADDRESS, 20, 4, data);
+    MODBUS_Master_Submit(master, &trans);
+    if (!run_case(master)) {
+        printf("FAIL %-20s %6u bps: master stuck\n", "TX lost once", baudrate);
+        return false;
+    }
+
+    return check_read("TX lost once", &trans, MODBUS_TRANS_DONE) && (line.sends == 2);
+}
+
+/* The end of every try is lost: the transaction fails, the next one is served */
+static bool test_tx_never_ends(MODBUS_MASTER * master, uint32_t baudrate)
+{
+    MODBUS_TRANSACTION lost;
+    MODBUS_TRANSACTION next;
+    uint16_t lost_data[2];
+    uint16_t next_data[2];
+
+    start_case(master, baudrate, 1 + MODBUS_MASTER_RETRIES);
+    init_read(&lost, SLAVE_ADDRESS, 30, 2, lost_data);
+    init_read(&next, OTHER_ADDRESS, 30, 2, next_data);
+    MODBUS_Master_Submit(master, &lost);
+    MODBUS_Master_Submit(master, &next);
+    if (!run_case(master)) {
+        printf("FAIL %-20s %6u bps: master stuck\n", "TX never ends", baudrate);
+        return false;
+    }
+
+    if (!check_read("TX never ends", &lost, MODBUS_TRANS_ERROR)) {
+        return false;
+    }
+    return check_read("TX never ends", &next, MODBUS_TRANS_DONE) && (line.sends == (2 + MODBUS_MASTER_RETRIES));
+}
+
+/* The port has no DE line: init only fails when RS-485 is asked for */
+static bool test_rs485_unsupported(MODBUS_MASTER * master, uint32_t baudrate)
+{
+    MODBUS_LINE_CONFIG line_cfg = MODBUS_LINE_CONFIG_DEFAULT;
+
+    line_cfg.baudrate = baudrate;
+    if (!MODBUS_Master_Init(master, &Driver_USART_SIM, &line_cfg)) {
+        printf("FAIL %-20s %6u bps: init failed without RS-485\n", "RS-485 unsupported", baudrate);
+        return false;
+    }
+    line_cfg.rs485 = true;
+    if (MODBUS_Master_Init(master, &Driver_USART_SIM, &line_cfg)) {
+        printf("FAIL %-20s %6u bps: init succeeded with RS-485\n", "RS-485 unsupported", baudrate);
+        return false;
+    }
+    return true;
+}
+
+typedef bool (*test_case_t)(MODBUS_MASTER * master, uint32_t baudrate);
+
+static const test_case_t test_cases[] = {
+    test_read,
+    test_tx_lost_once,
+    test_tx_never_ends,
+    test_rs485_unsupported,
+};
+
+int main(void)
+{
+    static MODBUS_MASTER master;
+    uint32_t failed = 0;
+    uint32_t runs = 0;
+    unsigned int i;
+    unsigned int j;
+
+    for (i = 0; i < sizeof(test_cases) / sizeof(test_cases[0]); i++) {
+        for (j = 0; j < sizeof(baudrates) / sizeof(baudrates[0]); j++) {
+            if (!test_cases[i] (&master, baudrates[j])) {
+                failed++;
+            }
+            runs++;
+        }
+    }
+
+    printf("%u of %u runs passed\n", runs - failed, runs);
+
+    return (failed == 0) ? 0 : 1;
+}
@@ -0,0 +1,693 @@
+/*
+ * Copyright (c) 2020 Màrius Montón <marius.monton@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the License); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an AS IS BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Project:   MODBUS RTU frame delimiting test for Linux hosts
+ *
+ * Replays timed byte streams into the MODBUS client (Examples/modbus_client.c)
+ * through a simulated USART driver on a virtual time line, polled as a MCU does
+ * it (when a byte arrives, a transmission ends or the 1 ms tick elapses), and
+ * checks the frames are split on the t3.5 silence:
+ * - back-to-back frames, each after exactly t3.5 of silence
+ * - a silence just under t3.5 (the frames are merged), of exactly t3.5, just over
+ *   it and of 4.5 characters (split, unless t3.5 is the fixed 1750 us and longer)
+ * - a pause before the last CRC byte, under t1.5 (one frame) and of t3.5 (two)
+ * Built with MODBUS_ASCII, it also checks the longest ASCII frames are decoded
+ * without writing past recv_buf, and the ones too long for it are dropped.
+ *
+ * The silences are exact, to the microsecond, with no margin. Each case is run at
+ * several rates and with the stream starting at several points of a tick.
+ *
+ * Build & run (from this directory, CMSIS_5 is a checkout of the CMSIS repository):
+ *   gcc -O2 -I. -I../Examples -I<CMSIS_5>/CMSIS/Driver/Include \
+ *       modbus_replay_test.c ../Examples/modbus_client.c ../Examples/modbus_crc.c -o modbus_replay_test
+ *   ./modbus_replay_test
+ * Add -DMODBUS_ASCII=1 to run the ASCII cases too.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "cmsis_compiler.h"
+#include "Driver_USART.h"
+#include "modbus_client.h"
+#include "modbus_crc.h"
+
+#define NUM_REGISTERS (100)
+#define SLAVE_ADDRESS (1)
+#define OTHER_ADDRESS (2)
+
+#define READ_HOLDING_REGS (3)
+#define WRITE_SINGLE_REG (6)
+
+#define MAX_STREAM (1024)
+#define MAX_RESPONSES (4)
+#if MODBUS_ASCII
+#define MAX_RESPONSE (MODBUS_ASCII_MAX_BUFF)
+#else
+#define MAX_RESPONSE (MODBUS_MAX_SEND_BUFF)
+#endif
+
+/* Longest odd ASCII frame recv_buf holds as RTU, the 1 byte LRC counting as the 2 bytes CRC */
+#define ASCII_MAX_ODD_LEN ((MODBUS_MAX_RECV_BUFF - 2) | 1)
+
+static const uint32_t baudrates[] = { 1200, 9600, 19200, 115200 };
+static const uint32_t phases[] = { 0, 250, 500, 750, 999 };
+
+/* Simulated line, times in microseconds */
+typedef struct {
+    uint64_t now;
+    uint32_t baudrate;          /* Set by the client */
+    ARM_USART_SignalEvent_t cb_event;
+
+    /* Byte stream replayed, with the time each byte is complete */
+    uint8_t bytes[MAX_STREAM];
+    uint64_t arrival[MAX_STREAM];
+    uint32_t num_bytes;
+    uint32_t next_byte;
+    uint64_t line_free;         /* End of the last byte queued */
+    uint8_t *rx_buf;
+    uint32_t rx_num;
+    uint32_t rx_cnt;
+    bool rx_busy;
+
+    /* Responses sent by the client */
+    uint8_t resp[MAX_RESPONSES][MAX_RESPONSE];
+    uint32_t resp_len[MAX_RESPONSES];
+    uint32_t num_resp;
+    uint64_t tx_done;
+    bool tx_busy;
+} SIM_LINE;
+
+static SIM_LINE line;
+static uint32_t case_phase;
+static uint16_t my_registers[NUM_REGISTERS];
+
+/* Milliseconds time base of the MODBUS client, on the virtual time line */
+uint32_t getSysTicks(void)
+{
+    return (uint32_t) (line.now / 1000);
+}
+
+/* Microseconds time base of the MODBUS client, on the virtual time line */
+uint32_t getSysMicros(void)
+{
+    return (uint32_t) line.now;
+}
+
+static uint64_t char_time(void)
+{
+    /* 11 bits per character (start, 8 data, parity or 2nd stop, stop) */
+    return (11000000ULL + line.baudrate - 1) / line.baudrate;
+}
+
+static uint64_t t35_time(void)
+{
+    return (line.baudrate > 19200) ? 1750 : ((38500000ULL + line.baudrate - 1) / line.baudrate);
+}
+
+static bool read_registers(uint16_t addr, uint16_t num, uint16_t * data)
+{
+    if ((addr + num) > NUM_REGISTERS) {
+        return false;
+    }
+
+    memcpy(data, &my_registers[addr], num * sizeof(uint16_t));
+    return true;
+}
+
+static bool write_registers(uint16_t addr, uint16_t num, const uint16_t * data)
+{
+    if ((addr + num) > NUM_REGISTERS) {
+        return false;
+    }
+
+    memcpy(&my_registers[addr], data, num * sizeof(uint16_t));
+    return true;
+}
+
+static ARM_DRIVER_VERSION SIM_GetVersion(void)
+{
+    ARM_DRIVER_VERSION version = { ARM_USART_API_VERSION, ARM_DRIVER_VERSION_MAJOR_MINOR(1, 0) };
+
+    return version;
+}
+
+static ARM_USART_CAPABILITIES SIM_GetCapabilities(void)
+{
+    ARM_USART_CAPABILITIES capabilities = { 0 };
+
+    capabilities.asynchronous = 1;
+    capabilities.event_tx_complete = 1;
+    return capabilities;
+}
+
+static int32_t SIM_Initialize(ARM_USART_SignalEvent_t cb_event)
+{
+    line.cb_event = cb_event;
+    return ARM_DRIVER_OK;
+}
+
+static int32_t SIM_Uninitialize(void)
+{
+    return ARM_DRIVER_OK;
+}
+
+static int32_t SIM_PowerControl(ARM_POWER_STATE state)
+{
+    return ARM_DRIVER_OK;
+}
+
+static int32_t SIM_Send(const void *data, uint32_t num)
+{
+    if (line.tx_busy) {
+        return ARM_DRIVER_ERROR_BUSY;
+    }
+
+    if ((line.num_resp < MAX_RESPONSES) && (num <= MAX_RESPONSE)) {
+        memcpy(line.resp[line.num_resp], data, num);
+        line.resp_len[line.num_resp] = num;
+    }
+    line.num_resp++;
+    line.tx_done = line.now + (num * char_time());
+    line.tx_busy = true;
+    return ARM_DRIVER_OK;
+}
+
+static int32_t SIM_Receive(void *data, uint32_t num)
+{
+    if (line.rx_busy) {
+        return ARM_DRIVER_ERROR_BUSY;
+    }
+
+    line.rx_buf = data;
+    line.rx_num = num;
+    line.rx_cnt = 0;
+    line.rx_busy = true;
+    return ARM_DRIVER_OK;
+}
+
+static int32_t SIM_Transfer(const void *data_out, void *data_in, uint32_t num)
+{
+    return ARM_DRIVER_ERROR_UNSUPPORTED;
+}
+
+static uint32_t SIM_GetTxCount(void)
+{
+    return 0;
+}
+
+static uint32_t SIM_GetRxCount(void)
+{
+    return line.rx_cnt;
+}
+
+static int32_t SIM_Control(uint32_t control, uint32_t arg)
+{
+    switch (control & ARM_USART_CONTROL_Msk) {
+    case ARM_USART_MODE_ASYNCHRONOUS:
+        line.baudrate = arg;
+        break;
+    case ARM_USART_ABORT_RECEIVE:
+        line.rx_busy = false;
+        break;
+    case ARM_USART_ABORT_SEND:
+        line.tx_busy = false;
+        break;
+    default:
+        break;
+    }
+
+    return ARM_DRIVER_OK;
+}
+
+static ARM_USART_STATUS SIM_GetStatus(void)
+{
+    ARM_USART_STATUS status = { 0 };
+
+    status.tx_busy = line.tx_busy;
+    status.rx_busy = line.rx_busy;
+    return status;
+}
+
+static int32_t SIM_SetModemControl(ARM_USART_MODEM_CONTROL control)
+{
+    return ARM_DRIVER_ERROR_UNSUPPORTED;
+}
+
+static ARM_USART_MODEM_STATUS SIM_GetModemStatus(void)
+{
+    ARM_USART_MODEM_STATUS modem_status = { 0 };
+
+    return modem_status;
+}
+
+static ARM_DRIVER_USART Driver_USART_SIM = {
+    SIM_GetVersion,
+    SIM_GetCapabilities,
+    SIM_Initialize,
+    SIM_Uninitialize,
+    SIM_PowerControl,
+    SIM_Send,
+    SIM_Receive,
+    SIM_Transfer,
+    SIM_GetTxCount,
+    SIM_GetRxCount,
+    SIM_Control,
+    SIM_GetStatus,
+    SIM_SetModemControl,
+    SIM_GetModemStatus
+};
+
+/**
+ * Builds a function 3 or 6 request with its CRC
+ * @return frame length
+ */
+static uint32_t build_request(uint8_t * pkt, uint8_t address, uint8_t function, uint16_t addr, uint16_t value)
+{
+    uint16_t crc;
+
+    pkt[0] = address;
+    pkt[1] = function;
+    pkt[2] = addr >> 8;
+    pkt[3] = addr & 0xFF;
+    pkt[4] = value >> 8;
+    pkt[5] = value & 0xFF;
+
+    crc = CRC16(pkt, 6);
+    pkt[6] = crc & 0x00FF;
+    pkt[7] = crc >> 8;
+
+    return 8;
+}
+
+/**
+ * Appends bytes to the stream: the first one after 'silence' of idle line, the
+ * others back to back
+ * @param silence microseconds from the end of the previous byte to the start of the first one
+ */
+static void queue_bytes(const uint8_t * data, uint32_t num, uint64_t silence)
+{
+    uint32_t i;
+
+    line.line_free += silence;
+    for (i = 0; (i < num) && (line.num_bytes < MAX_STREAM); i++) {
+        line.line_free += char_time();
+        line.bytes[line.num_bytes] = data[i];
+        line.arrival[line.num_bytes] = line.line_free;
+        line.num_bytes++;
+    }
+}
+
+/* Advances the virtual time line to its next event and signals the client */
+static void advance_line(void)
+{
+    uint64_t next = ((line.now / 1000) + 1) * 1000;     /* SysTick */
+    bool more = (line.next_byte < line.num_bytes);
+
+    if (more && (line.arrival[line.next_byte] < next)) {
+        next = line.arrival[line.next_byte];
+    }
+    if (line.tx_busy && (line.tx_done < next)) {
+        next = line.tx_done;
+    }
+    line.now = next;
+
+    if (more && (line.arrival[line.next_byte] == line.now)) {
+        /* Bytes arriving without a reception armed are lost */
+        if (line.rx_busy && (line.rx_cnt < line.rx_num)) {
+            line.rx_buf[line.rx_cnt++] = line.bytes[line.next_byte];
+            if (line.rx_cnt == line.rx_num) {
+                line.rx_busy = false;
+                line.cb_event(ARM_USART_EVENT_RECEIVE_COMPLETE);
+            }
+        }
+        line.next_byte++;
+    }
+
+    if (line.tx_busy && (line.tx_done == line.now)) {
+        line.tx_busy = false;
+        line.cb_event(ARM_USART_EVENT_SEND_COMPLETE | ARM_USART_EVENT_TX_COMPLETE);
+    }
+}
+
+/**
+ * Starts a test case on an idle line: a new stream, 'phase' microseconds into a tick
+ */
+static void start_case(MODBUS_CLIENT * client, MODBUS_TRANSPORT transport, uint32_t baudrate, uint32_t phase)
+{
+    MODBUS_LINE_CONFIG line_cfg = MODBUS_LINE_CONFIG_DEFAULT;
+    uint32_t i;
+
+    line.rx_busy = false;
+    line.tx_busy = false;
+    line.num_bytes = 0;
+    line.next_byte = 0;
+    line.num_resp = 0;
+    line.now = ((line.now / 1000) + 100) * 1000;
+    line.line_free = line.now + phase;
+    case_phase = phase;
+
+    for (i = 0; i < NUM_REGISTERS; i++) {
+        my_registers[i] = 0x1000 + i;
+    }
+
+    line_cfg.baudrate = baudrate;
+    line_cfg.transport = transport;
+    if (transport == MODBUS_TRANSPORT_ASCII) {
+        line_cfg.parity = ARM_USART_PARITY_EVEN;
+    }
+    MODBUS_Init(client, &Driver_USART_SIM, &line_cfg);
+    MODBUS_SetRegisterCallbacks(client, read_registers, write_registers);
+    MODBUS_SetAddress(client, SLAVE_ADDRESS);
+    MODBUS_ClearCounters(client);
+
+    /* Reception armed before the stream starts, as the main loop does */
+    MODBUS_Poll(client);
+}
+
+/* Replays the stream, until the line is idle well after its last byte */
+static void run_case(MODBUS_CLIENT * client)
+{
+    uint64_t end = line.line_free + 100000;
+
+    while ((line.now < end) || line.tx_busy) {
+        advance_line();
+        MODBUS_Poll(client);
+    }
+}
+
+/**
+ * Checks the responses sent and the client counters
+ * @param read_addr first register of the expected function 3 response, or -1 if none was expected
+ * @param read_num registers in the expected response
+ */
+static bool check_case(const char *name, MODBUS_CLIENT * client, int read_addr, uint16_t read_num,
+                       uint32_t messages, uint32_t errors)
+{
+    MODBUS_COUNTERS counters;
+    uint8_t expected[MAX_RESPONSE];
+    uint32_t len = 0;
+    uint16_t crc;
+    uint16_t i;
+    bool ok;
+
+    if (read_addr >= 0) {
+        expected[0] = SLAVE_ADDRESS;
+        expected[1] = READ_HOLDING_REGS;
+        expected[2] = read_num * 2;
+        for (i = 0; i < read_num; i++) {
+            expected[3 + (i * 2)] = my_registers[read_addr + i] >> 8;
+            expected[4 + (i * 2)] = my_registers[read_addr + i] & 0xFF;
+        }
+        len = 3 + (read_num * 2);
+        crc = CRC16(expected, len);
+        expected[len++] = crc & 0x00FF;
+        expected[len++] = crc >> 8;
+    }
+
+    MODBUS_GetCounters(client, &counters);
+    ok = (counters.bus_messages == messages) && (counters.bus_comm_errors == errors);
+    if (read_addr >= 0) {
+        ok = ok && (line.num_resp == 1) && (line.resp_len[0] == len) && (memcmp(line.resp[0], expected, len) == 0);
+    } else {
+        ok = ok && (line.num_resp == 0);
+    }
+
+    if (!ok) {
+        printf("FAIL %-22s %6u bps, phase %3u us: %u responses, %u messages, %u CRC errors\n", name, line.baudrate,
+               case_phase, line.num_resp, counters.bus_messages, counters.bus_comm_errors);
+    }
+    return ok;
+}
+
+/* Broadcast writes and a read, each after exactly t3.5 of silence */
+static bool test_back_to_back(MODBUS_CLIENT * client, uint32_t baudrate, uint32_t phase)
+{
+    uint8_t pkt[8];
+    uint32_t len;
+    uint16_t i;
+
+    start_case(client, MODBUS_TRANSPORT_RTU, baudrate, phase);
+    for (i = 0; i < 3; i++) {
+        len = build_request(pkt, MODBUS_ADDRESS_BROADCAST, WRITE_SINGLE_REG, 10 + i, 0xA000 + i);
+        queue_bytes(pkt, len, t35_time());
+    }
+    len = build_request(pkt, SLAVE_ADDRESS, READ_HOLDING_REGS, 10, 3);
+    queue_bytes(pkt, len, t35_time());
+    run_case(client);
+
+    if ((my_registers[10] != 0xA000) || (my_registers[11] != 0xA001) || (my_registers[12] != 0xA002)) {
+        printf("FAIL %-22s %6u bps, phase %3u us: writes not applied\n", "back to back", baudrate, phase);
+        return false;
+    }
+    return check_case("back to back", client, 10, 3, 4, 0);
+}
+
+/* A silence just under t3.5 does not end the frame: both requests are one invalid frame */
+static bool test_gap_under_t35(MODBUS_CLIENT * client, uint32_t baudrate, uint32_t phase)
+{
+    uint8_t pkt[8];
+    uint32_t len;
+
+    start_case(client, MODBUS_TRANSPORT_RTU, baudrate, phase);
+    len = build_request(pkt, SLAVE_ADDRESS, READ_HOLDING_REGS, 0, 1);
+    queue_bytes(pkt, len, 0);
+    len = build_request(pkt, SLAVE_ADDRESS, READ_HOLDING_REGS, 20, 2);
+    queue_bytes(pkt, len, t35_time() - 1);
+    run_case(client);
+
+    return check_case("gap under t3.5", client, -1, 0, 1, 1);
+}
+
+/* A silence just under t3.5 after a foreign frame: ours is skipped with it */
+static bool test_gap_under_t35_foreign(MODBUS_CLIENT * client, uint32_t baudrate, uint32_t phase)
+{
+    uint8_t pkt[8];
+    uint32_t len;
+
+    start_case(client, MODBUS_TRANSPORT_RTU, baudrate, phase);
+    len = build_request(pkt, OTHER_ADDRESS, READ_HOLDING_REGS, 0, 1);
+    queue_bytes(pkt, len, 0);
+    len = build_request(pkt, SLAVE_ADDRESS, READ_HOLDING_REGS, 20, 2);
+    queue_bytes(pkt, len, t35_time() - 1);
+    run_case(client);
+
+    return check_case("gap under t3.5 foreign", client, -1, 0, 1, 0);
+}
+
+/* A silence of exactly t3.5 after a foreign frame: ours is answered */
+static bool test_gap_t35(MODBUS_CLIENT * client, uint32_t baudrate, uint32_t phase)
+{
+    uint8_t pkt[8];
+    uint32_t len;
+
+    start_case(client, MODBUS_TRANSPORT_RTU, baudrate, phase);
+    len = build_request(pkt, OTHER_ADDRESS, READ_HOLDING_REGS, 0, 1);
+    queue_bytes(pkt, len, 0);
+    len = build_request(pkt, SLAVE_ADDRESS, READ_HOLDING_REGS, 20, 2);
+    queue_bytes(pkt, len, t35_time());
+    run_case(client);
+
+    return check_case("gap t3.5", client, 20, 2, 2, 0);
+}
+
+/* A silence just over t3.5 after a foreign frame: ours is answered */
+static bool test_gap_over_t35(MODBUS_CLIENT * client, uint32_t baudrate, uint32_t phase)
+{
+    uint8_t pkt[8];
+    uint32_t len;
+
+    start_case(client, MODBUS_TRANSPORT_RTU, baudrate, phase);
+    len = build_request(pkt, OTHER_ADDRESS, READ_HOLDING_REGS, 0, 1);
+    queue_bytes(pkt, len, 0);
+    len = build_request(pkt, SLAVE_ADDRESS, READ_HOLDING_REGS, 20, 2);
+    queue_bytes(pkt, len, t35_time() + 1);
+    run_case(client);
+
+    return check_case("gap over t3.5", client, 20, 2, 2, 0);
+}
+
+/* A silence of 4.5 characters after a foreign frame: ours is answered, unless the
+ * rate is above 19200 bps and t3.5 the fixed 1750 us (then it is skipped too) */
+static bool test_gap_4_5_chars(MODBUS_CLIENT * client, uint32_t baudrate, uint32_t phase)
+{
+    uint8_t pkt[8];
+    uint32_t len;
+    uint64_t gap;
+
+    start_case(client, MODBUS_TRANSPORT_RTU, baudrate, phase);
+    gap = (9 * char_time()) / 2;
+    len = build_request(pkt, OTHER_ADDRESS, READ_HOLDING_REGS, 0, 1);
+    queue_bytes(pkt, len, 0);
+    len = build_request(pkt, SLAVE_ADDRESS, READ_HOLDING_REGS, 20, 2);
+    queue_bytes(pkt, len, gap);
+    run_case(client);
+
+    if (gap < t35_time()) {
+        return check_case("gap 4.5 chars", client, -1, 0, 1, 0);
+    }
+    return check_case("gap 4.5 chars", client, 20, 2, 2, 0);
+}
+
+/* A pause under t1.5 before the last CRC byte, the frame is still whole */
+static bool test_split_crc(MODBUS_CLIENT * client, uint32_t baudrate, uint32_t phase)
+{
+    uint8_t pkt[8];
+    uint32_t len;
+
+    start_case(client, MODBUS_TRANSPORT_RTU, baudrate, phase);
+    len = build_request(pkt, SLAVE_ADDRESS, READ_HOLDING_REGS, 30, 4);
+    queue_bytes(pkt, len - 1, 0);
+    queue_bytes(&pkt[len - 1], 1, char_time() - 1);
+    run_case(client);
+
+    return check_case("split CRC", client, 30, 4, 1, 0);
+}
+
+/* A pause of t3.5 before the last CRC byte splits the frame: the first part is
+ * dropped, the lone CRC byte is taken as a frame for another slave */
+static bool test_split_crc_over_t35(MODBUS_CLIENT * client, uint32_t baudrate, uint32_t phase)
+{
+    uint8_t pkt[8];
+    uint32_t len;
+
+    start_case(client, MODBUS_TRANSPORT_RTU, baudrate, phase);
+    len = build_request(pkt, SLAVE_ADDRESS, READ_HOLDING_REGS, 30, 4);
+    queue_bytes(pkt, len - 1, 0);
+    queue_bytes(&pkt[len - 1], 1, t35_time());
+    run_case(client);
+
+    return check_case("split CRC at t3.5", client, -1, 0, 2, 1);
+}
+
+#if MODBUS_ASCII
+/**
+ * Builds a MODBUS ASCII frame of function 3 with filler data, its LRC included
+ * @param chars frame characters, 1 + (2 * len) + 2 of them
+ * @param len frame length as bytes, the LRC included
+ * @return frame length in characters
+ */
+static uint32_t build_ascii_frame(uint8_t * chars, uint8_t address, uint32_t len)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    uint8_t byte;
+    uint8_t lrc = 0;
+    uint32_t num = 0;
+    uint32_t i;
+
+    chars[num++] = ':';
+    for (i = 0; i < len; i++) {
+        if (i == 0) {
+            byte = address;
+        } else if (i == 1) {
+            byte = READ_HOLDING_REGS;
+        } else if (i == (len - 1)) {
+            byte = -lrc;
+        } else {
+            byte = i;
+        }
+        lrc += byte;
+        chars[num++] = digits[byte >> 4];
+        chars[num++] = digits[byte & 0x0F];
+    }
+    chars[num++] = '\r';
+    chars[num++] = '\n';
+
+    return num;
+}
+
+/* The longest odd frame is decoded, its padded last byte stays inside recv_buf */
+static bool test_ascii_max_odd(MODBUS_CLIENT * client, uint32_t baudrate, uint32_t phase)
+{
+    uint8_t chars[MODBUS_ASCII_MAX_BUFF];
+    uint32_t num;
+
+    start_case(client, MODBUS_TRANSPORT_ASCII, baudrate, phase);
+    num = build_ascii_frame(chars, OTHER_ADDRESS, ASCII_MAX_ODD_LEN);
+    queue_bytes(chars, num, 0);
+    run_case(client);
+
+    if (client->ascii_buf[0] != ':') {
+        printf("FAIL %-22s %6u bps, phase %3u us: ascii_buf overwritten\n", "ASCII max odd", baudrate, phase);
+        return false;
+    }
+    return check_case("ASCII max odd", client, -1, 0, 1, 0);
+}
+
+/* An odd frame one byte longer than recv_buf holds is dropped before it is decoded */
+static bool test_ascii_too_long(MODBUS_CLIENT * client, uint32_t baudrate, uint32_t phase)
+{
+    uint8_t chars[MODBUS_ASCII_MAX_BUFF];
+    uint32_t num;
+
+    start_case(client, MODBUS_TRANSPORT_ASCII, baudrate, phase);
+    num = build_ascii_frame(chars, OTHER_ADDRESS, MODBUS_MAX_RECV_BUFF);
+    queue_bytes(chars, num, 0);
+    run_case(client);
+
+    if (client->ascii_buf[0] != ':') {
+        printf("FAIL %-22s %6u bps, phase %3u us: ascii_buf overwritten\n", "ASCII too long", baudrate, phase);
+        return false;
+    }
+    return check_case("ASCII too long", client, -1, 0, 1, 1);
+}
+#endif
+
+typedef bool (*test_case_t)(MODBUS_CLIENT * client, uint32_t baudrate, uint32_t phase);
+
+static const test_case_t test_cases[] = {
+    test_back_to_back,
+    test_gap_under_t35,
+    test_gap_under_t35_foreign,
+    test_gap_t35,
+    test_gap_over_t35,
+    test_gap_4_5_chars,
+    test_split_crc,
+    test_split_crc_over_t35,
+#if MODBUS_ASCII
+    test_ascii_max_odd,
+    test_ascii_too_long,
+#endif
+};
+
+int main(void)
+{
+    static MODBUS_CLIENT client;
+    uint32_t failed = 0;
+    uint32_t runs = 0;
+    unsigned int i;
+    unsigned int j;
+    unsigned int k;
+
+    for (i = 0; i < sizeof(test_cases) / sizeof(test_cases[0]); i++) {
+        for (j = 0; j < sizeof(baudrates) / sizeof(baudrates[0]); j++) {
+            for (k = 0; k < sizeof(phases) / sizeof(phases[0]); k++) {
+                if (!test_cases[i] (&client, baudrates[j], phases[k])) {
+                    failed++;
+                }
+                runs++;
+            }
+        }
+    }
+
+    printf("%u of %u runs passed\n", runs - failed, runs);
+
+    return (failed == 0) ? 0 : 1;
+}
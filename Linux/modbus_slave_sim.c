@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2020 Màrius Montón <marius.monton@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the License); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an AS IS BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Project:   MODBUS RTU slave simulator for Linux hosts
+ *
+ * Runs the MODBUS client (Examples/modbus_client.c) on the pty USART driver, to
+ * test modbus_gateway or any RTU master without hardware. Prints its diagnostic
+ * counters at exit (Ctrl+C). With -A it serves MODBUS ASCII instead (7E1), the client
+ * must be built with -DMODBUS_ASCII=1.
+ *
+ * Build & run (from this directory, CMSIS_5 is a checkout of the CMSIS repository):
+ *   gcc -O2 -I. -I../Examples -I<CMSIS_5>/CMSIS/Driver/Include \
+ *       modbus_slave_sim.c Driver_USART_pty.c ../Examples/modbus_client.c ../Examples/modbus_crc.c \
+ *       -lpthread -o modbus_slave_sim
+ *   ./modbus_slave_sim -d /dev/pts/3 -a 1
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "cmsis_compiler.h"
+#include "Driver_USART_pty.h"
+#include "modbus_client.h"
+
+#define NUM_REGISTERS (1000)
+#define NUM_COILS (256)
+#define NUM_INPUT_REGISTERS (16)
+
+static uint16_t my_registers[NUM_REGISTERS];
+static uint32_t my_coils[(NUM_COILS + 31) / 32];
+static volatile uint16_t my_inputs[NUM_INPUT_REGISTERS];
+
+static MODBUS_CLIENT modbus;
+static volatile sig_atomic_t stop;
+
+/* Milliseconds time base of the MODBUS client */
+uint32_t getSysTicks(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t) ((ts.tv_sec * 1000) + (ts.tv_nsec / 1000000));
+}
+
+/* Microseconds time base of the MODBUS client */
+uint32_t getSysMicros(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t) ((ts.tv_sec * 1000000) + (ts.tv_nsec / 1000));
+}
+
+static bool read_registers(uint16_t addr, uint16_t num, uint16_t * data)
+{
+    if ((addr + num) > NUM_REGISTERS) {
+        return false;
+    }
+
+    memcpy(data, &my_registers[addr], num * sizeof(uint16_t));
+    return true;
+}
+
+static bool write_registers(uint16_t addr, uint16_t num, const uint16_t * data)
+{
+    if ((addr + num) > NUM_REGISTERS) {
+        return false;
+    }
+
+    memcpy(&my_registers[addr], data, num * sizeof(uint16_t));
+    return true;
+}
+
+static void on_signal(int sig)
+{
+    stop = 1;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *device = NULL;
+    const char *path;
+    int address = MODBUS_ADDRESS_ANY;
+    MODBUS_LINE_CONFIG line = MODBUS_LINE_CONFIG_DEFAULT;
+    MODBUS_COUNTERS counters;
+    uint32_t i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:a:A")) != -1) {
+        switch (opt) {
+        case 'd':
+            device = optarg;
+            break;
+        case 'a':
+            address = atoi(optarg);
+            break;
+        case 'A':
+            line.parity = ARM_USART_PARITY_EVEN;
+            line.transport = MODBUS_TRANSPORT_ASCII;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-d device] [-a address] [-A]\n", argv[0]);
+            fprintf(stderr, "  -d  serial port or pty to serve, a new pty if none\n");
+            fprintf(stderr, "  -a  slave address (1 to 247), all frames are answered if none\n");
+            fprintf(stderr, "  -A  MODBUS ASCII (needs MODBUS_ASCII), RTU if none\n");
+            return 1;
+        }
+    }
+
+    path = USART_PTY_Open(0, device);
+    if (path == NULL) {
+        fprintf(stderr, "Cannot open %s\n", device ? device : "a new pty");
+        return 1;
+    }
+    printf("MODBUS %s slave on %s\n", (line.transport == MODBUS_TRANSPORT_ASCII) ? "ASCII" : "RTU", path);
+    fflush(stdout);
+
+    /* Recognizable contents: holding register N holds N, input register N holds 0x1000 + N */
+    for (i = 0; i < NUM_REGISTERS; i++) {
+        my_registers[i] = i;
+    }
+    for (i = 0; i < NUM_INPUT_REGISTERS; i++) {
+        my_inputs[i] = 0x1000 + i;
+    }
+
+    if (!MODBUS_Init(&modbus, &Driver_USART_PTY0, &line)) {
+        fprintf(stderr, "Cannot initialize the MODBUS client\n");
+        return 1;
+    }
+    MODBUS_SetRegisterCallbacks(&modbus, read_registers, write_registers);
+    MODBUS_SetAddress(&modbus, address);
+    MODBUS_SetCoils(&modbus, my_coils, NUM_COILS);
+    MODBUS_SetInputRegisters(&modbus, my_inputs, NUM_INPUT_REGISTERS);
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    while (!stop) {
+        MODBUS_Poll(&modbus);
+        __WFE();
+    }
+
+    MODBUS_GetCounters(&modbus, &counters);
+    printf("bus messages %u, CRC errors %u, exceptions %u, slave messages %u, no response %u, overruns %u\n",
+           counters.bus_messages, counters.bus_comm_errors, counters.exceptions, counters.slave_messages,
+           counters.no_response, counters.char_overruns);
+
+    Driver_USART_PTY0.Uninitialize();
+
+    return 0;
+}
@@ -24,6 +24,15 @@
  * Currently implemented:
  * - Implemented non-blocking mode for Send & Receive functions
  * - Implemented ARM_USART_GetModemStatus function
+ * - Implemented ARM_USART_ABORT_RECEIVE control
+ * - Implemented ARM_USART_CONTROL_RS485 control (RS-485 driver enable): DePin is
+ *   a GPIO set by Send and cleared from the transmission complete (TC) interrupt.
+ *   STM32F4 USARTs have no DE hardware (DEM). Only USART2 has DePin wired, see
+ *   USART2_DE_PORT
+ *
+ * Not supported:
+ * - 7 data bits without parity (i.e. MODBUS ASCII 7N2): the word length counts
+ *   the parity bit and STM32F4 USARTs have no 7 bit word. Use 7E1 or 7O1 instead
  *
  * To be implemented:
  * TODO: Implement transfer function
@@ -37,6 +46,20 @@
 
 #include "stm32f4xx_hal.h"
 
+/* Driver specific control: RS-485 transceiver driver enable (DE/RE), arg 1 enables it and 0 disables it */
+#ifndef ARM_USART_CONTROL_RS485
+#define ARM_USART_CONTROL_RS485 (0x80UL << ARM_USART_CONTROL_Pos)
+#endif
+
+/* RS-485 DE/RE pin of USART2, PD4 (its RTS pin) by default. Define USART2_DE_PORT
+ * as NULL if the board does not wire it */
+#ifndef USART2_DE_PORT
+#define USART2_DE_PORT GPIOD
+#endif
+#ifndef USART2_DE_PIN
+#define USART2_DE_PIN GPIO_PIN_4
+#endif
+
 #define ARM_USART_DRV_VERSION    ARM_DRIVER_VERSION_MAJOR_MINOR(1, 0)   /* driver version */
 
 /* Driver Version */
@@ -56,9 +79,11 @@ typedef struct {
     UART_HandleTypeDef instance;
     STM32_PIN TxPin;
     STM32_PIN RxPin;
+    STM32_PIN DePin;            /* RS-485 DE/RE pin, NULL port if not wired */
     ARM_USART_STATUS status;
     ARM_USART_MODEM_STATUS modem_status;
     ARM_USART_SignalEvent_t cb_event;
+    uint8_t rs485;              /* DePin driven by the driver */
 } STM32_USART_RESOURCES;
 
 /* Driver Capabilities */
@@ -74,7 +99,7 @@ static STM32_USART_RESOURCES USART1_Resources = {
      0,                         /* Smart Card Clock generator available */
      0,                         /* RTS Flow Control available */
      0,                         /* CTS Flow Control available */
-     0,                         /* Transmit completed event: \ref ARM_USART_EVENT_TX_COMPLETE */
+     1,                         /* Transmit completed event: \ref ARM_USART_EVENT_TX_COMPLETE */
      0,                         /* Signal receive character timeout event: \ref ARM_USART_EVENT_RX_TIMEOUT */
      0,                         /* RTS Line: 0=not available, 1=available */
      0,                         /* CTS Line: 0=not available, 1=available */
@@ -93,9 +118,11 @@ static STM32_USART_RESOURCES USART1_Resources = {
      UART_PARITY_NONE,.Init.HwFlowCtl = UART_HWCONTROL_NONE},
     {GPIOD, {.Pin = GPIO_PIN_5,.Mode = GPIO_MODE_AF_PP,.Pull = GPIO_NOPULL,.Speed = GPIO_SPEED_FREQ_VERY_HIGH,.Alternate = GPIO_AF7_USART1}},   /* Tx Pin */
     {GPIOD, {.Pin = GPIO_PIN_6,.Mode = GPIO_MODE_AF_PP,.Pull = GPIO_NOPULL,.Speed = GPIO_SPEED_FREQ_VERY_HIGH,.Alternate = GPIO_AF7_USART1}},   /* Rx Pin */
+    {NULL},                     /* DE Pin */
     {0},
     {0},
-    NULL
+    NULL,
+    0
 };
 #endif
 
@@ -111,7 +138,7 @@ static STM32_USART_RESOURCES USART2_Resources = {
      0,                         /* Smart Card Clock generator available */
      0,                         /* RTS Flow Control available */
      0,                         /* CTS Flow Control available */
-     0,                         /* Transmit completed event: \ref ARM_USART_EVENT_TX_COMPLETE */
+     1,                         /* Transmit completed event: \ref ARM_USART_EVENT_TX_COMPLETE */
      0,                         /* Signal receive character timeout event: \ref ARM_USART_EVENT_RX_TIMEOUT */
      0,                         /* RTS Line: 0=not available, 1=available */
      0,                         /* CTS Line: 0=not available, 1=available */
@@ -130,9 +157,11 @@ static STM32_USART_RESOURCES USART2_Resources = {
      UART_PARITY_NONE,.Init.HwFlowCtl = UART_HWCONTROL_NONE},
     {GPIOD, {.Pin = GPIO_PIN_5,.Mode = GPIO_MODE_AF_PP,.Pull = GPIO_NOPULL,.Speed = GPIO_SPEED_FREQ_VERY_HIGH,.Alternate = GPIO_AF7_USART2}},   /* Tx Pin */
     {GPIOD, {.Pin = GPIO_PIN_6,.Mode = GPIO_MODE_AF_PP,.Pull = GPIO_NOPULL,.Speed = GPIO_SPEED_FREQ_VERY_HIGH,.Alternate = GPIO_AF7_USART2}},   /* Rx Pin */
+    {USART2_DE_PORT, {.Pin = USART2_DE_PIN,.Mode = GPIO_MODE_OUTPUT_PP,.Pull = GPIO_NOPULL,.Speed = GPIO_SPEED_FREQ_VERY_HIGH}},      /* DE Pin */
     {0},
     {0},
-    NULL
+    NULL,
+    0
 };
 #endif
 
@@ -148,7 +177,7 @@ static STM32_USART_RESOURCES USART3_Resources = {
      0,                         /* Smart Card Clock generator available */
      0,                         /* RTS Flow Control available */
      0,                         /* CTS Flow Control available */
-     0,                         /* Transmit completed event: \ref ARM_USART_EVENT_TX_COMPLETE */
+     1,                         /* Transmit completed event: \ref ARM_USART_EVENT_TX_COMPLETE */
      0,                         /* Signal receive character timeout event: \ref ARM_USART_EVENT_RX_TIMEOUT */
      0,                         /* RTS Line: 0=not available, 1=available */
      0,                         /* CTS Line: 0=not available, 1=available */
@@ -167,9 +196,11 @@ static STM32_USART_RESOURCES USART3_Resources = {
      UART_PARITY_NONE,.Init.HwFlowCtl = UART_HWCONTROL_NONE},
     {GPIOD, {.Pin = GPIO_PIN_5,.Mode = GPIO_MODE_AF_PP,.Pull = GPIO_NOPULL,.Speed = GPIO_SPEED_FREQ_VERY_HIGH,.Alternate = GPIO_AF7_USART3}},   /* Tx Pin */
     {GPIOD, {.Pin = GPIO_PIN_6,.Mode = GPIO_MODE_AF_PP,.Pull = GPIO_NOPULL,.Speed = GPIO_SPEED_FREQ_VERY_HIGH,.Alternate = GPIO_AF7_USART3}},   /* Rx Pin */
+    {NULL},                     /* DE Pin */
     {0},
     {0},
-    NULL
+    NULL,
+    0
 };
 #endif
 
@@ -185,7 +216,7 @@ static STM32_USART_RESOURCES UART5_Resources = {
      0,                         /* Smart Card Clock generator available */
      0,                         /* RTS Flow Control available */
      0,                         /* CTS Flow Control available */
-     0,                         /* Transmit completed event: \ref ARM_USART_EVENT_TX_COMPLETE */
+     1,                         /* Transmit completed event: \ref ARM_USART_EVENT_TX_COMPLETE */
      0,                         /* Signal receive character timeout event: \ref ARM_USART_EVENT_RX_TIMEOUT */
      0,                         /* RTS Line: 0=not available, 1=available */
      0,                         /* CTS Line: 0=not available, 1=available */
@@ -204,9 +235,11 @@ static STM32_USART_RESOURCES UART5_Resources = {
      UART_PARITY_NONE,.Init.HwFlowCtl = UART_HWCONTROL_NONE},
     {GPIOC, {.Pin = GPIO_PIN_12,.Mode = GPIO_MODE_AF_PP,.Pull = GPIO_NOPULL,.Speed = GPIO_SPEED_FREQ_VERY_HIGH,.Alternate = GPIO_AF8_UART5}},   /* Tx Pin */
     {GPIOD, {.Pin = GPIO_PIN_2,.Mode = GPIO_MODE_AF_PP,.Pull = GPIO_NOPULL,.Speed = GPIO_SPEED_FREQ_VERY_HIGH,.Alternate = GPIO_AF8_UART5}},    /* Rx Pin */
+    {NULL},                     /* DE Pin */
     {0},
     {0},
-    NULL
+    NULL,
+    0
 };
 #endif
 
@@ -279,42 +312,42 @@ static int32_t STM32_USART_Initialize(ARM_USART_SignalEvent_t cb_event, STM32_US
 #endif
 
 #ifdef GPIOA
-    if ((usart->TxPin.port == GPIOA) || (usart->RxPin.port == GPIOA)) {
+    if ((usart->TxPin.port == GPIOA) || (usart->RxPin.port == GPIOA) || (usart->DePin.port == GPIOA)) {
         __HAL_RCC_GPIOA_CLK_ENABLE();
     }
 #endif
 #ifdef GPIOB
-    if ((usart->TxPin.port == GPIOB) || (usart->RxPin.port == GPIOB)) {
+    if ((usart->TxPin.port == GPIOB) || (usart->RxPin.port == GPIOB) || (usart->DePin.port == GPIOB)) {
         __HAL_RCC_GPIOB_CLK_ENABLE();
     }
 #endif
 #ifdef GPIOC
-    if ((usart->TxPin.port == GPIOC) || (usart->RxPin.port == GPIOC)) {
+    if ((usart->TxPin.port == GPIOC) || (usart->RxPin.port == GPIOC) || (usart->DePin.port == GPIOC)) {
         __HAL_RCC_GPIOC_CLK_ENABLE();
     }
 #endif
 #ifdef GPIOD
-    if ((usart->TxPin.port == GPIOD) || (usart->RxPin.port == GPIOD)) {
+    if ((usart->TxPin.port == GPIOD) || (usart->RxPin.port == GPIOD) || (usart->DePin.port == GPIOD)) {
         __HAL_RCC_GPIOD_CLK_ENABLE();
     }
 #endif
 #ifdef GPIOE
-    if ((usart->TxPin.port == GPIOE) || (usart->RxPin.port == GPIOE)) {
+    if ((usart->TxPin.port == GPIOE) || (usart->RxPin.port == GPIOE) || (usart->DePin.port == GPIOE)) {
         __HAL_RCC_GPIOE_CLK_ENABLE();
     }
 #endif
 #ifdef GPIOF
-    if ((usart->TxPin.port == GPIOF) || (usart->RxPin.port == GPIOF)) {
+    if ((usart->TxPin.port == GPIOF) || (usart->RxPin.port == GPIOF) || (usart->DePin.port == GPIOF)) {
         __HAL_RCC_GPIOF_CLK_ENABLE();
     }
 #endif
 #ifdef GPIOG
-    if ((usart->TxPin.port == GPIOG) || (usart->RxPin.port == GPIOG)) {
+    if ((usart->TxPin.port == GPIOG) || (usart->RxPin.port == GPIOG) || (usart->DePin.port == GPIOG)) {
         __HAL_RCC_GPIOG_CLK_ENABLE();
     }
 #endif
 #ifdef GPIOH
-    if ((usart->TxPin.port == GPIOH) || (usart->RxPin.port == GPIOH)) {
+    if ((usart->TxPin.port == GPIOH) || (usart->RxPin.port == GPIOH) || (usart->DePin.port == GPIOH)) {
         __HAL_RCC_GPIOH_CLK_ENABLE();
     }
 #endif
@@ -332,9 +365,50 @@ static int32_t STM32_USART_Initialize(ARM_USART_SignalEvent_t cb_event, STM32_US
 static int32_t STM32_USART_Uninitialize(STM32_USART_RESOURCES * usart)
 {
     HAL_UART_DeInit(&usart->instance);
+    if (usart->DePin.port != NULL) {
+        HAL_GPIO_DeInit(usart->DePin.port, usart->DePin.pin.Pin);
+    }
+    usart->rs485 = 0;
     return ARM_DRIVER_OK;
 }
 
+/**
+ * Enables or disables the RS-485 transceiver driver enable line.
+ * DePin is a GPIO set by Send and cleared on the TC interrupt, when the last
+ * stop bit has left the shift register.
+ * @param enable 1 to drive DePin, 0 to release it
+ * @param usart USART resources
+ * @return ARM_DRIVER_OK or ARM_DRIVER_ERROR_UNSUPPORTED if DePin is not wired
+ */
+static int32_t STM32_USART_RS485(uint32_t enable, STM32_USART_RESOURCES * usart)
+{
+    if (usart->DePin.port == NULL) {
+        return ARM_DRIVER_ERROR_UNSUPPORTED;
+    }
+    if (enable != 0) {
+        HAL_GPIO_WritePin(usart->DePin.port, usart->DePin.pin.Pin, GPIO_PIN_RESET);
+        HAL_GPIO_Init(usart->DePin.port, &usart->DePin.pin);
+        usart->rs485 = 1;
+    } else {
+        usart->rs485 = 0;
+        HAL_GPIO_WritePin(usart->DePin.port, usart->DePin.pin.Pin, GPIO_PIN_RESET);
+    }
+
+    return ARM_DRIVER_OK;
+}
+
+/**
+ * Releases the RS-485 bus after the last stop bit, before the application is
+ * told about it. Called from the TC interrupt.
+ * @param usart USART resources
+ */
+static void STM32_USART_TxDone(STM32_USART_RESOURCES * usart)
+{
+    if (usart->rs485 != 0) {
+        HAL_GPIO_WritePin(usart->DePin.port, usart->DePin.pin.Pin, GPIO_PIN_RESET);
+    }
+}
+
 static int32_t STM32_USART_PowerControl(ARM_POWER_STATE state, STM32_USART_RESOURCES const *usart)
 {
     switch (state) {
@@ -357,6 +431,10 @@ static int32_t STM32_USART_Send(const void *data, uint32_t num, STM32_USART_RESO
         return ARM_DRIVER_ERROR_PARAMETER;
     }
 
+    if (usart->rs485 != 0) {
+        HAL_GPIO_WritePin(usart->DePin.port, usart->DePin.pin.Pin, GPIO_PIN_SET);
+    }
+
     ret = HAL_UART_Transmit_IT(&usart->instance, (uint8_t *) data, num);
 
     if (ret == HAL_OK) {
@@ -389,12 +467,14 @@ static int32_t STM32_USART_Transfer(const void *data_out, void *data_in,
 
 static uint32_t STM32_USART_GetTxCount(STM32_USART_RESOURCES const *usart)
 {
-    return usart->instance.TxXferCount;
+    /* HAL counts down the pending items */
+    return usart->instance.TxXferSize - usart->instance.TxXferCount;
 }
 
 static uint32_t STM32_USART_GetRxCount(STM32_USART_RESOURCES const *usart)
 {
-    return usart->instance.RxXferCount;
+    /* HAL counts down the pending items */
+    return usart->instance.RxXferSize - usart->instance.RxXferCount;
 }
 
 static int32_t STM32_USART_Control(uint32_t control, uint32_t arg, STM32_USART_RESOURCES * usart)
@@ -423,21 +503,17 @@ static int32_t STM32_USART_Control(uint32_t control, uint32_t arg, STM32_USART_R
         return ARM_DRIVER_OK;
         break;
 
-    default:
-        return ARM_DRIVER_ERROR_PARAMETER;
-    }
-
-    switch (control & ARM_USART_DATA_BITS_Msk) {
-    case ARM_USART_DATA_BITS_5:
-    case ARM_USART_DATA_BITS_6:
-    case ARM_USART_DATA_BITS_7:
-        return ARM_DRIVER_ERROR_PARAMETER;
-    case ARM_USART_DATA_BITS_8:
-        usart->instance.Init.WordLength = UART_WORDLENGTH_8B;
+    case ARM_USART_ABORT_RECEIVE:
+        if (HAL_UART_AbortReceive(&usart->instance) != HAL_OK) {
+            return ARM_DRIVER_ERROR;
+        }
+        return ARM_DRIVER_OK;
         break;
-    case ARM_USART_DATA_BITS_9:
-        usart->instance.Init.WordLength = UART_WORDLENGTH_9B;
+
+    case ARM_USART_CONTROL_RS485:
+        return STM32_USART_RS485(arg, usart);
         break;
+
     default:
         return ARM_DRIVER_ERROR_PARAMETER;
     }
@@ -456,6 +532,35 @@ static int32_t STM32_USART_Control(uint32_t control, uint32_t arg, STM32_USART_R
         return ARM_DRIVER_ERROR_PARAMETER;
     }
 
+    /* STM32 word length includes the parity bit */
+    switch (control & ARM_USART_DATA_BITS_Msk) {
+    case ARM_USART_DATA_BITS_5:
+    case ARM_USART_DATA_BITS_6:
+        return ARM_DRIVER_ERROR_PARAMETER;
+    case ARM_USART_DATA_BITS_7:
+        /* No 7 bit word length, 7N1 and 7N2 are not possible */
+        if (usart->instance.Init.Parity == UART_PARITY_NONE) {
+            return ARM_DRIVER_ERROR_PARAMETER;
+        }
+        usart->instance.Init.WordLength = UART_WORDLENGTH_8B;
+        break;
+    case ARM_USART_DATA_BITS_8:
+        if (usart->instance.Init.Parity == UART_PARITY_NONE) {
+            usart->instance.Init.WordLength = UART_WORDLENGTH_8B;
+        } else {
+            usart->instance.Init.WordLength = UART_WORDLENGTH_9B;
+        }
+        break;
+    case ARM_USART_DATA_BITS_9:
+        if (usart->instance.Init.Parity != UART_PARITY_NONE) {
+            return ARM_DRIVER_ERROR_PARAMETER;
+        }
+        usart->instance.Init.WordLength = UART_WORDLENGTH_9B;
+        break;
+    default:
+        return ARM_DRIVER_ERROR_PARAMETER;
+    }
+
     switch (control & ARM_USART_STOP_BITS_Msk) {
     case ARM_USART_STOP_BITS_1:
         usart->instance.Init.StopBits = UART_STOPBITS_1;
@@ -887,10 +992,12 @@ void HAL_UART_TxCpltCallback(UART_HandleTypeDef * UartHandle)
 {
     uint32_t event = 0;
 
-    event = ARM_USART_EVENT_TX_COMPLETE;
+    /* HAL signals the end of transmission (TC), so all data was sent too */
+    event = ARM_USART_EVENT_SEND_COMPLETE | ARM_USART_EVENT_TX_COMPLETE;
 
 #ifdef USART1
     if (UartHandle->Instance == USART1_Resources.instance.Instance) {
+        STM32_USART_TxDone(&USART1_Resources);
         if (USART1_Resources.cb_event != NULL) {
             USART1_Resources.cb_event(event);
         }
@@ -898,6 +1005,7 @@ void HAL_UART_TxCpltCallback(UART_HandleTypeDef * UartHandle)
 #endif
 #ifdef USART2
     else if (UartHandle->Instance == USART2_Resources.instance.Instance) {
+        STM32_USART_TxDone(&USART2_Resources);
         if (USART2_Resources.cb_event != NULL) {
             USART2_Resources.cb_event(event);
         }
@@ -905,6 +1013,7 @@ void HAL_UART_TxCpltCallback(UART_HandleTypeDef * UartHandle)
 #endif
 #ifdef USART3
     else if (UartHandle->Instance == USART3_Resources.instance.Instance) {
+        STM32_USART_TxDone(&USART3_Resources);
         if (USART3_Resources.cb_event != NULL) {
             USART3_Resources.cb_event(event);
         }
@@ -912,6 +1021,7 @@ void HAL_UART_TxCpltCallback(UART_HandleTypeDef * UartHandle)
 #endif
 #ifdef USART4
     else if (UartHandle->Instance == USART4_Resources.instance.Instance) {
+        STM32_USART_TxDone(&USART4_Resources);
         if (USART4_Resources.cb_event != NULL) {
             USART4_Resources.cb_event(event);
         }
@@ -919,6 +1029,7 @@ void HAL_UART_TxCpltCallback(UART_HandleTypeDef * UartHandle)
 #endif
 #ifdef UART5
     else if (UartHandle->Instance == UART5_Resources.instance.Instance) {
+        STM32_USART_TxDone(&UART5_Resources);
         if (UART5_Resources.cb_event != NULL) {
             UART5_Resources.cb_event(event);
         }
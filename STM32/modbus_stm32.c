@@ -21,15 +21,77 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 #include "stm32f4xx_hal.h"
 
+#include "Driver_I2C.h"
 #include "modbus_client.h"
 
 extern ARM_DRIVER_USART Driver_USART2;
+extern ARM_DRIVER_USART Driver_UART5;
+extern ARM_DRIVER_I2C Driver_I2C1;
 
-uint16_t my_registers[50];
+#define NUM_REGISTERS (50)
+#define NUM_COILS (64)
+#define NUM_INPUTS (16)
 
-volatile uint32_t msTicks;      /* counts 1ms timeTicks */
+/* Each serial port serves its own register map */
+uint16_t my_registers[NUM_REGISTERS];
+uint16_t uart5_registers[NUM_REGISTERS];
+uint32_t my_coils[(NUM_COILS + 31) / 32];
+uint32_t my_inputs[(NUM_INPUTS + 31) / 32];
+
+/* LSM9DS1 accelerometer registers, the sensor is on I2C1 (PB8, PB9) as in CMSIS_Driver_Test_I2C.c */
+#define LSM9DS1_ADDR (0xD6)
+#define LSM9DS1_CTRL_REG6_XL (0x20)
+#define LSM9DS1_ODR_XL_119HZ (0x60)
+#define LSM9DS1_OUT_X_XL (0x28)
+
+#define ACCEL_PERIOD_MS (10)
+
+/* Events of a transfer that did not complete */
+#define I2C_ERROR_EVENTS (ARM_I2C_EVENT_ADDRESS_NACK | ARM_I2C_EVENT_BUS_ERROR | ARM_I2C_EVENT_ARBITRATION_LOST \
+                          | ARM_I2C_EVENT_TRANSFER_INCOMPLETE)
+
+typedef enum {
+    ACCEL_RESTARTING,           /* A transfer failed, the sensor is configured again in the next period */
+    ACCEL_CONFIGURING,
+    ACCEL_IDLE,
+    ACCEL_ADDRESSING,
+    ACCEL_READING,
+} ACCEL_STATE;
+
+/* Raw LSM9DS1 accelerometer readings (OUT_X_XL, OUT_Y_XL, OUT_Z_XL), served as
+ * input registers. The sensor sends them little endian, so the I2C read of 6 bytes
+ * from register 0x28 is received as is into accel_buf. accel_poll() copies it here
+ * once the transfer is done, so a failed read never shows and the client, polled
+ * from the same loop, never sees a half written sample */
+uint16_t accel_samples[3];
+
+static uint16_t accel_buf[3];
+static uint8_t accel_cmd[2];
+static volatile uint32_t i2c_events;    /* Events of the last transfer, 0 while it runs */
+static ACCEL_STATE accel_state;
+static uint32_t accel_ticks;
+
+/* Firmware version (major, minor), read only */
+uint16_t fw_version[2] = { 1, 0 };
+
+/* USART2 serves its holding registers from a map (0 to 49 and the version at 100),
+ * UART5 shows the block callbacks */
+static const MODBUS_REGISTER_RANGE register_map[] = {
+    {0, NUM_REGISTERS, my_registers, MODBUS_ACCESS_READ_WRITE, NULL, NULL},
+    {100, 2, fw_version, MODBUS_ACCESS_READ, NULL, NULL},
+};
+
+/* USART2 follows the master's rate (MODBUS default even parity) on an RS-485 transceiver (DE on
+ * USART2_DE_PIN), UART5 runs at 9600 8N1 */
+static const MODBUS_LINE_CONFIG usart2_line = {115200, ARM_USART_PARITY_EVEN, ARM_USART_STOP_BITS_1, true,
+    MODBUS_TRANSPORT_RTU, true
+};
+
+static MODBUS_CLIENT modbus_usart2;
+static MODBUS_CLIENT modbus_uart5;
 
 void SystemClock_Config(void);
 void Error_Handler(void);
@@ -44,14 +106,132 @@ uint32_t getSysTicks(void)
     return HAL_GetTick();
 }
 
-uint16_t read_register(uint16_t addr)
+/* Microseconds for the MODBUS frame timing, from the tick and the SysTick counter (counting down) */
+uint32_t getSysMicros(void)
+{
+    uint32_t ticks;
+    uint32_t count;
+
+    /* Read again if the tick changed in between */
+    do {
+        ticks = HAL_GetTick();
+        count = SysTick->VAL;
+    } while (ticks != HAL_GetTick());
+
+    return (ticks * 1000) + ((SysTick->LOAD - count) / ((SysTick->LOAD + 1) / 1000));
+}
+
+static void i2c_event(uint32_t event)
 {
-    return my_registers[addr];
+    i2c_events = event;
 }
 
-void write_register(uint16_t addr, uint16_t data)
+/**
+ * Writes the accelerometer configuration: 119 Hz, register address auto-increment
+ * is enabled by default
+ */
+static void accel_configure(void)
 {
-    my_registers[addr] = data;
+    accel_cmd[0] = LSM9DS1_CTRL_REG6_XL;
+    accel_cmd[1] = LSM9DS1_ODR_XL_119HZ;
+    accel_ticks = getSysTicks();
+    i2c_events = 0;
+    if (Driver_I2C1.MasterTransmit(LSM9DS1_ADDR, accel_cmd, 2, false) == ARM_DRIVER_OK) {
+        accel_state = ACCEL_CONFIGURING;
+    } else {
+        accel_state = ACCEL_RESTARTING;
+    }
+}
+
+/**
+ * Starts the I2C bus and the sensor
+ */
+static void accel_init(void)
+{
+    Driver_I2C1.Initialize(i2c_event);
+    Driver_I2C1.PowerControl(ARM_POWER_FULL);
+    Driver_I2C1.Control(ARM_I2C_BUS_SPEED, ARM_I2C_BUS_SPEED_STANDARD);
+
+    accel_configure();
+}
+
+/**
+ * Reads the accelerometer every ACCEL_PERIOD_MS without blocking. A transfer that
+ * fails (NACK, bus error, arbitration lost) or never ends restarts the sensor
+ */
+static void accel_poll(void)
+{
+    uint32_t events;
+
+    if ((accel_state != ACCEL_IDLE) && (accel_state != ACCEL_RESTARTING)) {
+        events = i2c_events;
+        if (events == 0) {
+            /* A failed transfer may signal nothing, start over in the next period */
+            if ((getSysTicks() - accel_ticks) >= ACCEL_PERIOD_MS) {
+                Driver_I2C1.Control(ARM_I2C_ABORT_TRANSFER, 0);
+                accel_state = ACCEL_RESTARTING;
+            }
+            return;
+        }
+        i2c_events = 0;
+        if (((events & ARM_I2C_EVENT_TRANSFER_DONE) == 0) || ((events & I2C_ERROR_EVENTS) != 0)) {
+            accel_state = ACCEL_RESTARTING;
+            return;
+        }
+    }
+
+    switch (accel_state) {
+    case ACCEL_RESTARTING:
+        if ((getSysTicks() - accel_ticks) >= ACCEL_PERIOD_MS) {
+            accel_configure();
+        }
+        break;
+    case ACCEL_IDLE:
+        if ((getSysTicks() - accel_ticks) >= ACCEL_PERIOD_MS) {
+            accel_ticks = getSysTicks();
+            /* Register address, then a repeated start to read the three axes */
+            accel_cmd[0] = LSM9DS1_OUT_X_XL;
+            if (Driver_I2C1.MasterTransmit(LSM9DS1_ADDR, accel_cmd, 1, true) == ARM_DRIVER_OK) {
+                accel_state = ACCEL_ADDRESSING;
+            }
+        }
+        break;
+    case ACCEL_ADDRESSING:
+        if (Driver_I2C1.MasterReceive(LSM9DS1_ADDR, (uint8_t *) accel_buf, sizeof(accel_buf), false) == ARM_DRIVER_OK) {
+            accel_state = ACCEL_READING;
+        } else {
+            accel_state = ACCEL_RESTARTING;
+        }
+        break;
+    case ACCEL_READING:
+        memcpy(accel_samples, accel_buf, sizeof(accel_samples));
+        accel_state = ACCEL_IDLE;
+        break;
+    default:
+        /* Configured, wait for the next period */
+        accel_state = ACCEL_IDLE;
+        break;
+    }
+}
+
+bool uart5_read_registers(uint16_t addr, uint16_t num, uint16_t * data)
+{
+    if ((addr + num) > NUM_REGISTERS) {
+        return false;
+    }
+
+    memcpy(data, &uart5_registers[addr], num * sizeof(uint16_t));
+    return true;
+}
+
+bool uart5_write_registers(uint16_t addr, uint16_t num, const uint16_t * data)
+{
+    if ((addr + num) > NUM_REGISTERS) {
+        return false;
+    }
+
+    memcpy(&uart5_registers[addr], data, num * sizeof(uint16_t));
+    return true;
 }
 
 int main(void)
@@ -60,14 +240,30 @@ int main(void)
 
     SystemClock_Config();
 
-    for (int i = 0; i < 50; i++) {
+    for (int i = 0; i < NUM_REGISTERS; i++) {
         my_registers[i] = i * 2;
+        uart5_registers[i] = i * 3;
     }
 
-    MODBUS_Init(&Driver_USART2);
+    accel_init();
+
+    MODBUS_Init(&modbus_usart2, &Driver_USART2, &usart2_line);
+    MODBUS_SetRegisterMap(&modbus_usart2, register_map, sizeof(register_map) / sizeof(register_map[0]));
+    MODBUS_SetCoils(&modbus_usart2, my_coils, NUM_COILS);
+    MODBUS_SetDiscreteInputs(&modbus_usart2, my_inputs, NUM_INPUTS);
+    MODBUS_SetInputRegisters(&modbus_usart2, accel_samples, 3);
+    MODBUS_SetAddress(&modbus_usart2, 1);
+
+    MODBUS_Init(&modbus_uart5, &Driver_UART5, NULL);
+    MODBUS_SetRegisterCallbacks(&modbus_uart5, uart5_read_registers, uart5_write_registers);
+    MODBUS_SetAddress(&modbus_uart5, 1);
 
     do {
-        do_MODBUS_Client(500);
+        /* MODBUS_Poll never blocks, other tasks can run in this loop */
+        MODBUS_Poll(&modbus_usart2);
+        MODBUS_Poll(&modbus_uart5);
+        accel_poll();
+        __WFE();
     } while (1);
 }
 